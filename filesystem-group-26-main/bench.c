@@ -0,0 +1,1041 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2016 Trevor Bakker
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Purpose:  Benchmark driver for mfs. The file system functions are compiled straight into
+//           this program (mfs.c is included with its main left out) and timed against images
+//           and host files in a scratch directory. Results are printed as CSV, or JSON with -j,
+//           one row per benchmark and parameter so runs can be diffed between releases.
+//
+//           Usage: ./bench [-j] [-r repetitions] [-o output file]
+
+#define MFS_NO_MAIN
+#include "mfs.c"
+
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define BENCH_DIR_TEMPLATE "/tmp/mfs_bench.XXXXXX"
+#define BENCH_IMAGE "bench.img"
+#define LOOKUP_ITERATIONS 100000		// Lookups per timing sample, they are too quick to time alone
+#define LIST_FILES 4096				// Files in the directory bench_list sorts
+
+// Running totals for one benchmark row
+struct timing
+{
+   uint64_t total_ns;
+   uint64_t min_ns;
+   uint64_t max_ns;
+   uint32_t count;
+};
+
+FILE *results;				// stdout is sent to /dev/null to mute mfs, results go here
+int   json_output = 0;			// Print JSON instead of CSV
+int   result_count = 0;			// Rows printed so far, JSON needs it for the commas
+int   repetitions = 20;			// Samples taken for each row
+
+//-------------------------------------------------------------------------------------------------
+// Helpers
+// ------------------------------------------------------------------------------------------------
+
+uint64_t now_ns()
+{
+   struct timespec ts;
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void timing_reset( struct timing *t )
+{
+   t->total_ns = 0;
+   t->min_ns   = UINT64_MAX;
+   t->max_ns   = 0;
+   t->count    = 0;
+}
+
+void timing_add( struct timing *t, uint64_t ns )
+{
+   t->total_ns += ns;
+   t->count++;
+   if ( ns < t->min_ns )
+   {
+      t->min_ns = ns;
+   }
+   if ( ns > t->max_ns )
+   {
+      t->max_ns = ns;
+   }
+}
+
+// Name: report
+// Parameters: benchmark - benchmark name, param - what was varied, t - the samples,
+//             bytes_per_op - bytes moved by each operation, 0 if throughput means nothing
+// Returns: none
+// Description: Prints one result row as CSV or JSON.
+void report( const char *benchmark, const char *param, struct timing *t, uint64_t bytes_per_op )
+{
+   if ( t->count == 0 )
+   {
+      return;
+   }
+
+   uint64_t mean_ns = t->total_ns / t->count;
+   double   mib_per_s = 0.0;
+   if ( bytes_per_op && mean_ns )
+   {
+      mib_per_s = ( (double) bytes_per_op / ( 1024.0 * 1024.0 ) ) / ( mean_ns / 1e9 );
+   }
+
+   if ( json_output )
+   {
+      fprintf( results, "%s  {\"benchmark\": \"%s\", \"param\": \"%s\", \"iterations\": %"PRIu32
+               ", \"mean_ns\": %"PRIu64", \"min_ns\": %"PRIu64", \"max_ns\": %"PRIu64
+               ", \"mib_per_s\": %.2f}",
+               result_count ? ",\n" : "", benchmark, param, t->count, mean_ns,
+               t->min_ns, t->max_ns, mib_per_s );
+   }
+   else
+   {
+      fprintf( results, "%s,%s,%"PRIu32",%"PRIu64",%"PRIu64",%"PRIu64",%.2f\n",
+               benchmark, param, t->count, mean_ns, t->min_ns, t->max_ns, mib_per_s );
+   }
+   fflush( results );
+   result_count++;
+}
+
+// Writes size bytes of pseudo random data to a host file for insert to copy
+void make_host_file( const char *name, uint32_t size )
+{
+   FILE *ofp = fopen( name, "w" );
+   for ( uint32_t i = 0; i < size; i++ )
+   {
+      fputc( rand() & 0xFF, ofp );
+   }
+   fclose( ofp );
+}
+
+// Empties and removes the scratch directory
+void remove_bench_dir( const char *dir_name )
+{
+   DIR *dir = opendir( "." );
+   struct dirent *entry;
+   while ( dir && ( entry = readdir( dir ) ) != NULL )
+   {
+      if ( strcmp( entry->d_name, "." ) && strcmp( entry->d_name, ".." ) )
+      {
+         unlink( entry->d_name );
+      }
+   }
+   if ( dir )
+   {
+      closedir( dir );
+   }
+   chdir( "/" );
+   rmdir( dir_name );
+}
+
+//-------------------------------------------------------------------------------------------------
+// Benchmarks
+// ------------------------------------------------------------------------------------------------
+
+// createfs, savefs under each fsync policy and open of a full size image
+void bench_image()
+{
+   struct timing t;
+   uint64_t image_bytes = (uint64_t) NUM_BLOCKS * BLOCK_SIZE;
+
+   timing_reset( &t );
+   for ( int i = 0; i < repetitions; i++ )
+   {
+      uint64_t start = now_ns();
+      createfs( BENCH_IMAGE );
+      timing_add( &t, now_ns() - start );
+   }
+   report( "createfs", "64MiB", &t, image_bytes );
+
+   const char *policies[] = { "none", "data", "full" };
+   for ( int policy = FSYNC_NONE; policy <= FSYNC_FULL; policy++ )
+   {
+      fsync_policy = policy;
+      timing_reset( &t );
+      for ( int i = 0; i < repetitions; i++ )
+      {
+         uint64_t start = now_ns();
+         savefs();
+         timing_add( &t, now_ns() - start );
+      }
+      report( "savefs", policies[policy], &t, image_bytes );
+   }
+   fsync_policy = FSYNC_FULL;
+
+   timing_reset( &t );
+   for ( int i = 0; i < repetitions; i++ )
+   {
+      closefs();
+      uint64_t start = now_ns();
+      openfs( BENCH_IMAGE );
+      timing_add( &t, now_ns() - start );
+   }
+   report( "openfs", "64MiB", &t, image_bytes );
+}
+
+// insert and retrieve of one file, from a single byte up to 16 MiB
+void bench_insert_retrieve()
+{
+   uint32_t sizes[] = { 1, 1024, 4096, 65536, 262144, 1048576, 16777216 };
+   struct timing insert_time;
+   struct timing retrieve_time;
+   struct timing noverify_time;
+
+   for ( int s = 0; s < (int) ( sizeof(sizes) / sizeof(sizes[0]) ); s++ )
+   {
+      char name[32];
+      char param[32];
+      snprintf( name, sizeof(name), "in_%"PRIu32, sizes[s] );
+      snprintf( param, sizeof(param), "%"PRIu32"B", sizes[s] );
+      make_host_file( name, sizes[s] );
+
+      timing_reset( &insert_time );
+      timing_reset( &retrieve_time );
+      timing_reset( &noverify_time );
+      for ( int i = 0; i < repetitions; i++ )
+      {
+         createfs( BENCH_IMAGE );
+
+         uint64_t start = now_ns();
+         insert( name );
+         timing_add( &insert_time, now_ns() - start );
+
+         start = now_ns();
+         retrieve( name, "out" );
+         timing_add( &retrieve_time, now_ns() - start );
+
+         // Same again without checking block checksums, to show what verifying costs
+         verify_checksums = 0;
+         start = now_ns();
+         retrieve( name, "out" );
+         timing_add( &noverify_time, now_ns() - start );
+         verify_checksums = 1;
+      }
+      report( "insert", param, &insert_time, sizes[s] );
+      report( "retrieve", param, &retrieve_time, sizes[s] );
+      report( "retrieve_noverify", param, &noverify_time, sizes[s] );
+      unlink( name );
+   }
+}
+
+// Keeps inserting 256 KiB files into one image until it is full, reporting insert latency
+// for each quarter of the way there so slowdowns as the disk fills show up
+void bench_fill()
+{
+   uint32_t file_size = 256 * 1024;
+   struct timing quarter[4];
+   char name[32];
+
+   make_host_file( "fill_src", file_size );
+   createfs( BENCH_IMAGE );
+
+   for ( int q = 0; q < 4; q++ )
+   {
+      timing_reset( &quarter[q] );
+   }
+
+   uint32_t capacity = df();
+   int inserted = 0;
+   while ( df() >= file_size && findFreeDirectoryEntry() != -1 && findFreeInode() != -1 )
+   {
+      // insert names the file after its path, so give every copy its own name
+      snprintf( name, sizeof(name), "fill_%03d", inserted );
+      link( "fill_src", name );
+
+      int q = (int) ( (uint64_t) ( capacity - df() ) * 4 / capacity );
+      uint64_t start = now_ns();
+      insert( name );
+      timing_add( &quarter[q < 4 ? q : 3], now_ns() - start );
+      inserted++;
+   }
+
+   const char *params[] = { "0-25%", "25-50%", "50-75%", "75-100%" };
+   for ( int q = 0; q < 4; q++ )
+   {
+      report( "fill_insert", params[q], &quarter[q], file_size );
+   }
+
+   // Inserting into a full image has to fail cleanly, time how long it takes to find out
+   struct timing t;
+   timing_reset( &t );
+   snprintf( name, sizeof(name), "fill_%03d", inserted );
+   link( "fill_src", name );
+   uint64_t start = now_ns();
+   insert( name );
+   timing_add( &t, now_ns() - start );
+   report( "fill_insert", "full", &t, 0 );
+
+   // Checking every block of the full image
+   timing_reset( &t );
+   for ( int i = 0; i < repetitions; i++ )
+   {
+      start = now_ns();
+      scrub();
+      timing_add( &t, now_ns() - start );
+   }
+   report( "scrub", "full", &t, (uint64_t) ( capacity - df() ) );
+}
+
+// Name lookup latency as the directory fills up, for the last file inserted and for a miss,
+// along with the latency of inserting and deleting one more file at that size
+void bench_lookup()
+{
+   int occupancy[] = { 1, 256, 4096, 32768 };
+   char name[32];
+   char param[32];
+   volatile int32_t sink = 0;
+
+   make_host_file( "lookup_src", 1 );
+
+   for ( int o = 0; o < (int) ( sizeof(occupancy) / sizeof(occupancy[0]) ); o++ )
+   {
+      createfs( BENCH_IMAGE );
+      for ( int i = 0; i < occupancy[o]; i++ )
+      {
+         snprintf( name, sizeof(name), "lookup_%05d", i );
+         link( "lookup_src", name );
+         insert( name );
+      }
+      snprintf( param, sizeof(param), "%d_files", occupancy[o] );
+
+      struct timing hit;
+      struct timing miss;
+      timing_reset( &hit );
+      timing_reset( &miss );
+      for ( int i = 0; i < repetitions; i++ )
+      {
+         uint64_t start = now_ns();
+         for ( int j = 0; j < LOOKUP_ITERATIONS; j++ )
+         {
+            sink += findDirectoryEntry( name );
+         }
+         timing_add( &hit, ( now_ns() - start ) / LOOKUP_ITERATIONS );
+
+         start = now_ns();
+         for ( int j = 0; j < LOOKUP_ITERATIONS; j++ )
+         {
+            sink += findDirectoryEntry( "no_such_file" );
+         }
+         timing_add( &miss, ( now_ns() - start ) / LOOKUP_ITERATIONS );
+      }
+      report( "lookup_hit", param, &hit, 0 );
+      report( "lookup_miss", param, &miss, 0 );
+
+      struct timing add;
+      struct timing remove;
+      timing_reset( &add );
+      timing_reset( &remove );
+      link( "lookup_src", "lookup_extra" );
+      for ( int i = 0; i < repetitions; i++ )
+      {
+         uint64_t start = now_ns();
+         insert( "lookup_extra" );
+         timing_add( &add, now_ns() - start );
+
+         start = now_ns();
+         delete( "lookup_extra" );
+         timing_add( &remove, now_ns() - start );
+      }
+      report( "insert_1B", param, &add, 1 );
+      report( "delete", param, &remove, 0 );
+   }
+}
+
+// Looking up the block behind a random offset of a 32 MiB file, among the direct blocks, the
+// blocks behind the indirect blocks in the inode and the blocks behind the double indirect one
+void bench_block_map()
+{
+   uint32_t file_blocks = 32768;
+   uint32_t ranges[][2] = { { 0, DIRECT_BLOCKS }, { DIRECT_BLOCKS, DOUBLE_INDIRECT_FIRST },
+                            { DOUBLE_INDIRECT_FIRST, file_blocks } };
+   const char *names[] = { "direct", "indirect", "double_indirect" };
+   uint32_t *offsets = malloc( LOOKUP_ITERATIONS * sizeof(uint32_t) );
+   volatile int32_t sink = 0;
+
+   make_host_file( "map_src", file_blocks * BLOCK_SIZE );
+   createfs( BENCH_IMAGE );
+   insert( "map_src" );
+   struct inode *file_inode = &inodes[directory[findFile( "map_src" )].inode];
+
+   for ( int r = 0; r < 3; r++ )
+   {
+      for ( int j = 0; j < LOOKUP_ITERATIONS; j++ )
+      {
+         offsets[j] = ranges[r][0] + rand() % ( ranges[r][1] - ranges[r][0] );
+      }
+
+      struct timing t;
+      timing_reset( &t );
+      for ( int i = 0; i < repetitions; i++ )
+      {
+         uint64_t start = now_ns();
+         for ( int j = 0; j < LOOKUP_ITERATIONS; j++ )
+         {
+            sink += fileBlock( file_inode, offsets[j] );
+         }
+         timing_add( &t, ( now_ns() - start ) / LOOKUP_ITERATIONS );
+      }
+      report( "block_map", names[r], &t, 0 );
+   }
+
+   free( offsets );
+   unlink( "map_src" );
+}
+
+// Resolving a path a few directories deep, through the dentry cache and with the cache
+// dropped before every lookup so each one walks the whole path
+void bench_paths()
+{
+   int depths[] = { 1, 4, 8 };
+   char path[128];
+   char param[32];
+   volatile int32_t sink = 0;
+
+   for ( int d = 0; d < (int) ( sizeof(depths) / sizeof(depths[0]) ); d++ )
+   {
+      createfs( BENCH_IMAGE );
+      path[0] = 0;
+      for ( int i = 0; i < depths[d]; i++ )
+      {
+         snprintf( path + strlen( path ), sizeof(path) - strlen( path ), "%sdir_%d",
+                   i ? "/" : "", i );
+         makeDirectory( path );
+      }
+      snprintf( param, sizeof(param), "depth_%d", depths[d] );
+
+      struct timing cached;
+      struct timing walked;
+      timing_reset( &cached );
+      timing_reset( &walked );
+      for ( int i = 0; i < repetitions; i++ )
+      {
+         uint64_t start = now_ns();
+         for ( int j = 0; j < LOOKUP_ITERATIONS; j++ )
+         {
+            sink += findDirectoryEntry( path );
+         }
+         timing_add( &cached, ( now_ns() - start ) / LOOKUP_ITERATIONS );
+
+         start = now_ns();
+         for ( int j = 0; j < LOOKUP_ITERATIONS; j++ )
+         {
+            dentry_generation++;
+            sink += findDirectoryEntry( path );
+         }
+         timing_add( &walked, ( now_ns() - start ) / LOOKUP_ITERATIONS );
+      }
+      report( "path_cached", param, &cached, 0 );
+      report( "path_walked", param, &walked, 0 );
+   }
+}
+
+// Listing a large directory sorted by name, all at once and one 20 file page at a time
+void bench_list()
+{
+   char name[32];
+   struct list_options options;
+   struct timing all;
+   struct timing page;
+
+   make_host_file( "list_src", 1 );
+   createfs( BENCH_IMAGE );
+   for ( int i = 0; i < LIST_FILES; i++ )
+   {
+      // Inserted in reverse so the sort has some work to do
+      snprintf( name, sizeof(name), "list_%05d", LIST_FILES - i );
+      link( "list_src", name );
+      insert( name );
+   }
+
+   memset( &options, 0, sizeof(options) );
+   options.sort = LIST_BY_NAME;
+   timing_reset( &all );
+   timing_reset( &page );
+   for ( int i = 0; i < repetitions; i++ )
+   {
+      options.page_size = 0;
+      uint64_t start = now_ns();
+      listFiles( &options );
+      timing_add( &all, now_ns() - start );
+
+      options.page_size = 20;
+      start = now_ns();
+      listFiles( &options );
+      timing_add( &page, now_ns() - start );
+   }
+
+   char param[32];
+   snprintf( param, sizeof(param), "%d_files", LIST_FILES );
+   report( "list_sorted", param, &all, 0 );
+   report( "list_page20", param, &page, 0 );
+}
+
+// Snapshots of an image holding 32 MiB of files: taking and deleting one, which copy only the
+// tables, and writes to a block a snapshot shares, which copy the block first, against writes
+// to a block the file has to itself
+void bench_snapshot()
+{
+   char name[32];
+   uint8_t buffer[4096];
+   struct timing take;
+   struct timing remove;
+   struct timing shared;
+   struct timing own;
+
+   make_host_file( "snap_src", 1048576 );
+   createfs( BENCH_IMAGE );
+   for ( int i = 0; i < 32; i++ )
+   {
+      snprintf( name, sizeof(name), "snap_%02d", i );
+      link( "snap_src", name );
+      insert( name );
+   }
+   int32_t inode_index = directory[findFile( "snap_00" )].inode;
+   memset( buffer, 0x5A, sizeof(buffer) );
+
+   timing_reset( &take );
+   timing_reset( &remove );
+   timing_reset( &shared );
+   timing_reset( &own );
+   for ( int i = 0; i < repetitions; i++ )
+   {
+      uint64_t start = now_ns();
+      takeSnapshot( "bench" );
+      timing_add( &take, now_ns() - start );
+
+      start = now_ns();
+      file_pwrite( inode_index, buffer, sizeof(buffer), 0 );
+      timing_add( &shared, now_ns() - start );
+
+      start = now_ns();
+      file_pwrite( inode_index, buffer, sizeof(buffer), 0 );
+      timing_add( &own, now_ns() - start );
+
+      start = now_ns();
+      deleteSnapshot( "bench" );
+      timing_add( &remove, now_ns() - start );
+   }
+
+   report( "snapshot_take", "32MiB", &take, 0 );
+   report( "snapshot_delete", "32MiB", &remove, 0 );
+   report( "pwrite_shared", "4096B", &shared, sizeof(buffer) );
+   report( "pwrite_own", "4096B", &own, sizeof(buffer) );
+}
+
+// Retrieves of every file in an image holding 32 MiB of files, straight after the image has
+// been dropped from the page cache and opened again, with readahead on and off. Every block
+// has to come in from the disk, one fault at a time unless readahead has asked for it first.
+void bench_readahead()
+{
+   char name[32];
+   struct timing cold[2];
+   int32_t inode_index[32];
+
+   make_host_file( "ra_src", 1048576 );
+   createfs( BENCH_IMAGE );
+   for ( int i = 0; i < 32; i++ )
+   {
+      snprintf( name, sizeof(name), "ra_%02d", i );
+      link( "ra_src", name );
+      insert( name );
+   }
+   savefs();
+
+   int null_fd = open( "/dev/null", O_WRONLY );
+   for ( int on = 0; on < 2; on++ )
+   {
+      readahead_enabled = on;
+      timing_reset( &cold[on] );
+      for ( int i = 0; i < repetitions; i++ )
+      {
+         // Pages the old mapping still holds can't be dropped, so let go of it first
+         closefs();
+         mapImage( -1 );
+         int image_fd = open( BENCH_IMAGE, O_RDONLY );
+         posix_fadvise( image_fd, 0, 0, POSIX_FADV_DONTNEED );
+         close( image_fd );
+         openfs( BENCH_IMAGE );
+
+         for ( int f = 0; f < 32; f++ )
+         {
+            snprintf( name, sizeof(name), "ra_%02d", f );
+            inode_index[f] = directory[findFile( name )].inode;
+         }
+
+         uint64_t start = now_ns();
+         for ( int f = 0; f < 32; f++ )
+         {
+            retrieve_fd( inode_index[f], null_fd );
+         }
+         timing_add( &cold[on], now_ns() - start );
+      }
+   }
+   close( null_fd );
+   readahead_enabled = 1;
+
+   report( "retrieve_cold", "readahead_off", &cold[0], 32 * 1048576 );
+   report( "retrieve_cold", "readahead_on", &cold[1], 32 * 1048576 );
+}
+
+// Opens a counter of this thread's dTLB read misses, or returns -1 where perf events aren't
+// available
+int open_dtlb_counter()
+{
+   struct perf_event_attr attr;
+   memset( &attr, 0, sizeof(attr) );
+   attr.size = sizeof(attr);
+   attr.type = PERF_TYPE_HW_CACHE;
+   attr.config = PERF_COUNT_HW_CACHE_DTLB | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) |
+                 ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 );
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   return syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+// Random 64 byte reads all over a 48 MiB file, with the image on 4 KiB pages and on huge
+// pages. Where perf events are available the dTLB read misses per 1000 reads are reported
+// too, in place of the times.
+void bench_huge_pages()
+{
+   uint32_t file_size = 48 * 1048576;
+   uint32_t *offsets = malloc( LOOKUP_ITERATIONS * sizeof(uint32_t) );
+   const char *names[] = { "4k_pages", "huge_pages" };
+   uint8_t buffer[64];
+   volatile uint32_t sink = 0;
+   int counter = open_dtlb_counter();
+
+   make_host_file( "huge_src", file_size );
+   for ( int j = 0; j < LOOKUP_ITERATIONS; j++ )
+   {
+      offsets[j] = ( (uint32_t) rand() * RAND_MAX + rand() ) % ( file_size - sizeof(buffer) );
+   }
+
+   for ( int huge = 0; huge < 2; huge++ )
+   {
+      huge_pages = huge;
+      createfs( BENCH_IMAGE );
+      insert( "huge_src" );
+      struct inode *file_inode = &inodes[directory[findFile( "huge_src" )].inode];
+
+      struct timing t;
+      struct timing misses;
+      timing_reset( &t );
+      timing_reset( &misses );
+      for ( int i = 0; i < repetitions; i++ )
+      {
+         uint64_t before = 0;
+         uint64_t after = 0;
+         if ( counter >= 0 && read( counter, &before, sizeof(before) ) != sizeof(before) )
+         {
+            before = 0;
+         }
+
+         // Each offset depends on the byte read before it, so the reads can't overlap and
+         // every TLB miss is paid in full, as when following a file's blocks to its data
+         uint64_t start = now_ns();
+         buffer[0] = 0;
+         for ( int j = 0; j < LOOKUP_ITERATIONS; j++ )
+         {
+            uint32_t pos = offsets[j] ^ ( buffer[0] & 1 );
+            memcpy( buffer, &data[fileBlock( file_inode, pos / BLOCK_SIZE )][pos % BLOCK_SIZE],
+                    sizeof(buffer) );
+         }
+         sink += buffer[0];
+         timing_add( &t, ( now_ns() - start ) / LOOKUP_ITERATIONS );
+
+         if ( counter >= 0 && read( counter, &after, sizeof(after) ) == sizeof(after) )
+         {
+            timing_add( &misses, ( after - before ) * 1000 / LOOKUP_ITERATIONS );
+         }
+      }
+      report( "random_read", names[huge], &t, sizeof(buffer) );
+      report( "random_read_dtlb_misses", names[huge], &misses, 0 );
+   }
+
+   huge_pages = 1;
+   if ( counter >= 0 )
+   {
+      close( counter );
+   }
+   free( offsets );
+   unlink( "huge_src" );
+}
+
+// Copying 32 MiB in 64 files out of an image, one retrieve at a time and all at once with
+// retrieve -a, which spreads the files over a pool of threads
+void bench_retrieve_all()
+{
+   char name[32];
+   char path[64];
+   struct timing serial;
+   struct timing parallel;
+
+   make_host_file( "all_src", 524288 );
+   createfs( BENCH_IMAGE );
+   for ( int i = 0; i < 64; i++ )
+   {
+      snprintf( name, sizeof(name), "all_%02d", i );
+      link( "all_src", name );
+      insert( name );
+   }
+   mkdir( "serial", 0755 );
+
+   timing_reset( &serial );
+   timing_reset( &parallel );
+   for ( int i = 0; i < repetitions; i++ )
+   {
+      uint64_t start = now_ns();
+      for ( int f = 0; f < 64; f++ )
+      {
+         snprintf( name, sizeof(name), "all_%02d", f );
+         snprintf( path, sizeof(path), "serial/%s", name );
+         retrieve( name, path );
+      }
+      timing_add( &serial, now_ns() - start );
+
+      start = now_ns();
+      retrieveAll( "parallel", NULL );
+      timing_add( &parallel, now_ns() - start );
+   }
+   report( "retrieve_serial", "64_files", &serial, 64 * 524288 );
+   report( "retrieve_all", "64_files", &parallel, 64 * 524288 );
+
+   // remove_bench_dir only empties the top directory
+   for ( int f = 0; f < 64; f++ )
+   {
+      snprintf( path, sizeof(path), "serial/all_%02d", f );
+      unlink( path );
+      snprintf( path, sizeof(path), "parallel/all_%02d", f );
+      unlink( path );
+   }
+   rmdir( "serial" );
+   rmdir( "parallel" );
+}
+
+// Exporting an image holding 32 MiB in 64 files to a tar archive and importing it again into
+// an empty image
+void bench_tar()
+{
+   char name[32];
+   struct timing export_time;
+   struct timing import_time;
+
+   make_host_file( "tar_src", 524288 );
+   timing_reset( &export_time );
+   timing_reset( &import_time );
+   for ( int i = 0; i < repetitions; i++ )
+   {
+      createfs( BENCH_IMAGE );
+      for ( int f = 0; f < 64; f++ )
+      {
+         snprintf( name, sizeof(name), "tar_%02d", f );
+         link( "tar_src", name );
+         insert( name );
+         unlink( name );
+      }
+
+      uint64_t start = now_ns();
+      exportTar( "bench.tar" );
+      timing_add( &export_time, now_ns() - start );
+
+      createfs( BENCH_IMAGE );
+      start = now_ns();
+      importTar( "bench.tar" );
+      timing_add( &import_time, now_ns() - start );
+   }
+   report( "export", "64_files", &export_time, 64 * 524288 );
+   report( "import", "64_files", &import_time, 64 * 524288 );
+   unlink( "bench.tar" );
+}
+
+// Searching 32 MiB in 64 files for a pattern that isn't there, so every file is searched to
+// the end, with the Horspool search and with the AVX2 one where the CPU has it
+void bench_grep()
+{
+   char name[32];
+   const char *names[] = { "horspool", "avx2" };
+   const uint8_t *(*picked)( const struct grep_pattern *, const uint8_t *, size_t ) = findPattern;
+
+   make_host_file( "grep_src", 524288 );
+   createfs( BENCH_IMAGE );
+   for ( int f = 0; f < 64; f++ )
+   {
+      snprintf( name, sizeof(name), "grep_%02d", f );
+      link( "grep_src", name );
+      insert( name );
+      unlink( name );
+   }
+
+   for ( int simd = 0; simd < 2; simd++ )
+   {
+      const uint8_t *(*search)( const struct grep_pattern *, const uint8_t *, size_t ) =
+         findPatternSw;
+#if defined(__x86_64__)
+      if ( simd && !__builtin_cpu_supports( "avx2" ) )
+      {
+         continue;
+      }
+      search = simd ? findPatternAvx2 : findPatternSw;
+#else
+      if ( simd )
+      {
+         continue;
+      }
+#endif
+      findPattern = search;
+
+      struct timing t;
+      timing_reset( &t );
+      for ( int i = 0; i < repetitions; i++ )
+      {
+         uint64_t start = now_ns();
+         grepCommand( "\\x00mfs\\xffgrep", NULL );
+         timing_add( &t, now_ns() - start );
+      }
+      report( "grep", names[simd], &t, 64 * 524288 );
+   }
+   findPattern = picked;
+   unlink( "grep_src" );
+}
+
+// Parsing and dispatching a shell command line, for a command the table has and one it
+// doesn't, as a script of commands would pay it on every line
+void bench_command()
+{
+   const char *lines[] = { "stats reset\n", "nosuchcommand a b c\n" };
+   const char *names[] = { "known", "unknown" };
+   char  line[MAX_COMMAND_SIZE];
+   char *token[MAX_NUM_ARGUMENTS];
+
+   for ( int l = 0; l < 2; l++ )
+   {
+      size_t length = strlen( lines[l] ) + 1;
+      struct timing t;
+      timing_reset( &t );
+      for ( int i = 0; i < repetitions; i++ )
+      {
+         uint64_t start = now_ns();
+         for ( int j = 0; j < LOOKUP_ITERATIONS; j++ )
+         {
+            memcpy( line, lines[l], length );
+            tokenize( line, token );
+            runCommand( token );
+         }
+         timing_add( &t, ( now_ns() - start ) / LOOKUP_ITERATIONS );
+      }
+      report( "command", names[l], &t, 0 );
+   }
+}
+
+void *bench_daemon_thread( void *socket_path )
+{
+   mfsdServe( socket_path );
+   return NULL;
+}
+
+// Round trips to mfsd from a client in the same process: a stat, and whole reads of a small
+// and a large file. Without mfsd each client would pay the open row first.
+void bench_daemon()
+{
+   uint32_t sizes[] = { 4096, 1048576 };
+   char socket_path[] = "bench.sock";
+   char name[32];
+   char param[32];
+   struct mfsd_request request;
+   struct mfsd_reply   reply;
+   uint8_t *reply_data;
+   struct timing t;
+   pthread_t server;
+   int fd;
+
+   createfs( BENCH_IMAGE );
+   for ( int s = 0; s < (int) ( sizeof(sizes) / sizeof(sizes[0]) ); s++ )
+   {
+      snprintf( name, sizeof(name), "mfsd_%"PRIu32, sizes[s] );
+      make_host_file( name, sizes[s] );
+      insert( name );
+   }
+
+   pthread_create( &server, NULL, bench_daemon_thread, socket_path );
+   while ( ( fd = mfsdConnect( socket_path ) ) < 0 )
+   {
+      usleep( 1000 );
+   }
+
+   timing_reset( &t );
+   for ( int i = 0; i < repetitions; i++ )
+   {
+      memset( &request, 0, sizeof(request) );
+      request.op = MFSD_STAT;
+      uint64_t start = now_ns();
+      mfsdCall( fd, &request, name, NULL, &reply, &reply_data );
+      timing_add( &t, now_ns() - start );
+      free( reply_data );
+   }
+   report( "mfsd_stat", "1_client", &t, 0 );
+
+   for ( int s = 0; s < (int) ( sizeof(sizes) / sizeof(sizes[0]) ); s++ )
+   {
+      snprintf( name, sizeof(name), "mfsd_%"PRIu32, sizes[s] );
+      snprintf( param, sizeof(param), "%"PRIu32"B", sizes[s] );
+      timing_reset( &t );
+      for ( int i = 0; i < repetitions; i++ )
+      {
+         memset( &request, 0, sizeof(request) );
+         request.op = MFSD_READ;
+         request.length = sizes[s];
+         uint64_t start = now_ns();
+         mfsdCall( fd, &request, name, NULL, &reply, &reply_data );
+         timing_add( &t, now_ns() - start );
+         free( reply_data );
+      }
+      report( "mfsd_read", param, &t, sizes[s] );
+   }
+
+   memset( &request, 0, sizeof(request) );
+   request.op = MFSD_SHUTDOWN;
+   mfsdCall( fd, &request, NULL, NULL, &reply, &reply_data );
+   close( fd );
+   pthread_join( server, NULL );
+}
+
+// XOR encryption throughput over files of a few sizes
+void bench_encrypt()
+{
+   uint32_t sizes[] = { 4096, 65536, 1048576 };
+   char name[32];
+   char param[32];
+
+   createfs( BENCH_IMAGE );
+   for ( int s = 0; s < (int) ( sizeof(sizes) / sizeof(sizes[0]) ); s++ )
+   {
+      snprintf( name, sizeof(name), "enc_%"PRIu32, sizes[s] );
+      snprintf( param, sizeof(param), "%"PRIu32"B", sizes[s] );
+      make_host_file( name, sizes[s] );
+      insert( name );
+
+      struct timing t;
+      timing_reset( &t );
+      for ( int i = 0; i < repetitions; i++ )
+      {
+         uint64_t start = now_ns();
+         encryption( name, 0x5A );
+         timing_add( &t, now_ns() - start );
+      }
+      report( "encrypt", param, &t, sizes[s] );
+   }
+}
+
+//-------------------------------------------------------------------------------------------------
+// Main
+// ------------------------------------------------------------------------------------------------
+
+int main( int argc, char *argv[] )
+{
+   char *output_name = NULL;
+   int   opt;
+
+   while ( ( opt = getopt( argc, argv, "jr:o:" ) ) != -1 )
+   {
+      switch ( opt )
+      {
+         case 'j':
+            json_output = 1;
+            break;
+         case 'r':
+            repetitions = atoi( optarg );
+            break;
+         case 'o':
+            output_name = optarg;
+            break;
+         default:
+            fprintf( stderr, "Usage: %s [-j] [-r repetitions] [-o output file]\n", argv[0] );
+            return 1;
+      }
+   }
+
+   if ( repetitions < 1 )
+   {
+      repetitions = 1;
+   }
+
+   // Results keep going to the real stdout (or the output file), everything mfs prints is muted
+   results = output_name ? fopen( output_name, "w" ) : fdopen( dup( STDOUT_FILENO ), "w" );
+   if ( results == NULL )
+   {
+      perror( "Opening output file returned" );
+      return 1;
+   }
+   freopen( "/dev/null", "w", stdout );
+
+   char dir_name[] = BENCH_DIR_TEMPLATE;
+   if ( mkdtemp( dir_name ) == NULL || chdir( dir_name ) != 0 )
+   {
+      perror( "Creating benchmark directory returned" );
+      return 1;
+   }
+
+   srand( 26 );
+   init();
+
+   if ( json_output )
+   {
+      fprintf( results, "[\n" );
+   }
+   else
+   {
+      fprintf( results, "benchmark,param,iterations,mean_ns,min_ns,max_ns,mib_per_s\n" );
+   }
+
+   bench_image();
+   bench_insert_retrieve();
+   bench_fill();
+   bench_lookup();
+   bench_block_map();
+   bench_paths();
+   bench_list();
+   bench_snapshot();
+   bench_readahead();
+   bench_huge_pages();
+   bench_retrieve_all();
+   bench_tar();
+   bench_grep();
+   bench_command();
+   bench_daemon();
+   bench_encrypt();
+
+   if ( json_output )
+   {
+      fprintf( results, "\n]\n" );
+   }
+
+   remove_bench_dir( dir_name );
+   fclose( results );
+   return 0;
+}
@@ -32,6 +32,22 @@
 // to our 8k bit block therefore necessitating a free block array which offset our original 
 // starting data block 278 by the v
 
+// The same goes for the directory and the inodes. They no longer have fixed blocks at all: the
+// superblock and a table map come first, and the directory, inode table and free inode map are
+// stored in data blocks listed by the table map. The tables start with 256 slots and double as
+// files are added, up to 65536. Inodes hold 8 direct block pointers and a few indirect blocks
+// instead of 1024 pointers each, so a large table doesn't eat the disk. The data blocks start
+// after the free block map and the block checksum table instead of at block 278 (see Disk
+// Layout below). Images from before the table map can't be opened and have to be recreated.
+
+// The free block map has become a reference count for each block so snapshots can share data
+// blocks with the live file system, copying them only when one side changes them. Images made
+// before that ("MFS2") can't be opened either.
+
+// Files are no longer limited to 2^20 bytes. Inodes gained a double indirect block, which
+// points at up to 256 more indirect blocks, so a file can be as large as the disk. The inode
+// grew by one pointer, so "MFS3" images can't be opened anymore either.
+
 //-------------------------------------------------------------------------------------------------
 // Includes & Defines
 // ------------------------------------------------------------------------------------------------
@@ -39,6 +55,7 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <stdlib.h>
@@ -48,6 +65,22 @@
 #include <stdint.h>
 #include <time.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 // MavShell Defines
 #define WHITESPACE " \t\n"     				// We want to split our command line up into tokens
@@ -55,1231 +88,7673 @@
                                 			// In this case  white space
                                 			// will separate the tokens on our command line
 #define MAX_COMMAND_SIZE 255   				// The maximum command-line size
-#define MAX_NUM_ARGUMENTS 5    				// Mav shell only supports 10 arguments
+#define MAX_NUM_ARGUMENTS 12    			// The command and up to 11 arguments
 
 // File System Defines
 #define BLOCK_SIZE 1024 				// Size of Each Block
 #define NUM_BLOCKS 65536 				// Max Number of Blocks in File System 
-#define BLOCKS_PER_FILE 1024				// Max File Size is 2^20 bytes and each block is 2^10 bytes 
-							// so 2^20/2^10 = 2^10 blocks
-#define MAX_FILES 256					// Requirements of the Assignment
-#define FIRST_DATA_BLOCK 350				// 278 Starting Requirement  + 512 for Free Block Map... 
+#define BLOCKS_PER_FILE (DOUBLE_INDIRECT_FIRST + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+							// More than the disk holds, files are limited by free space
+#define MAX_FILES 65536					// Most files the directory and inode table grow to
+#define FIRST_FILE_SLOTS 256				// Directory entries and inodes in a new image
 #define MAX_FILE_SIZE BLOCK_SIZE * BLOCKS_PER_FILE 	// Can we do Block_Size * Blocks_Per_File ?? 
+#define DIRECT_BLOCKS 8					// Block pointers held in the inode itself
+#define POINTERS_PER_BLOCK (BLOCK_SIZE / (int32_t) sizeof(int32_t))	// In an indirect block
+#define INDIRECT_BLOCKS 2				// Indirect pointers in the inode
+#define DOUBLE_INDIRECT_FIRST (DIRECT_BLOCKS + INDIRECT_BLOCKS * POINTERS_PER_BLOCK)	// First
+							// block number reached through the double indirect block
+#define INDIRECT_SLOTS (INDIRECT_BLOCKS + POINTERS_PER_BLOCK)	// Indirect blocks a file can have
+// Indirect blocks a file of n blocks needs, the double indirect block included
+#define INDIRECT_FOR_BLOCKS(n) ((n) > DIRECT_BLOCKS ? \
+                                ((n) - DIRECT_BLOCKS + POINTERS_PER_BLOCK - 1) / \
+                                POINTERS_PER_BLOCK + ((n) > DOUBLE_INDIRECT_FIRST) : 0)
+#define IS_DATA_BLOCK(b) ((b) >= FIRST_DATA_BLOCK && (b) < NUM_BLOCKS)
+#define MAX_FILENAME 64					// Directory entries hold 64 byte names
+#define STREAM_BUFFER_SIZE (256 * 1024)		// stdio buffer for streamed inserts
+#define WRITE_CHUNK_SIZE (64 * 1024)			// write/append copy host files in 64 KiB pieces
+#define BLOCKS_FOR_SIZE(size) (((size) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define FILE_BLOCKS(size) (BLOCKS_FOR_SIZE(size) + INDIRECT_FOR_BLOCKS(BLOCKS_FOR_SIZE(size)))
+
+// read Defines
+#define HEXDUMP_WIDTH 16				// Bytes shown on each line of a hex dump
+#define HEXDUMP_LINE_MAX 80				// Longest line hexdump_line can produce
+#define HEXDUMP_BUFFER_SIZE (256 * 1024)		// Hex dump output is batched up to this size
+
+// tar Defines
+#define TAR_BLOCK_SIZE 512				// Archives are made of 512 byte records
+#define TAR_PATH_MAX 257				// 155 byte prefix, "/", 100 byte name and a NUL
+
+// grep Defines
+#define GREP_PATTERN_MAX 128				// Longest byte pattern grep searches for
+#define GREP_MAX_LISTED 16				// Most match offsets listed for one file
+
+// list Defines
+#define LIST_BUFFER_SIZE (64 * 1024)			// Listing output is batched up to this size
+#define LIST_LINE_MAX 160				// Longest line one listed file can produce
+#define LIST_CURSOR_MAX 96				// Longest page cursor, a key and a file name
+
+// defrag Defines, the owner map packs (inode, block number in the file) into one int64_t
+#define OWNER_NONE -1					// Block belongs to no file
+#define OWNER_CONFLICT -2				// Block is claimed by more than one file
+#define OWNER_ID(inode, idx) ((int64_t) (inode) * BLOCKS_PER_FILE + (idx))
+
+// fsck Defines
+#define MAX_THREADS 16					// Most worker threads a parallel scan will use
+#define FSCK_MAX_LISTED 20				// Most blocks of one kind listed individually
+
+// delete Defines
+#define RECLAIM_BATCH_BLOCKS 64				// Least a trash reclaim for space frees
+
+// Path Defines
+#define ROOT_DIRECTORY -1				// Parent of the entries at the top of the tree
+#define NO_DIRECTORY -2					// A directory on the way down a path is missing
+#define DENTRY_CACHE_SIZE 1024				// Directory paths remembered, a power of two
+#define DENTRY_PATH_MAX 256				// Longest directory path the cache remembers
 
 #define HIDDEN 0x1
 #define READONLY 0x2
+#define DIRECTORY 0x4					// The entry is a directory, it has no blocks
+
+// Snapshot Defines
+#define MAX_SNAPSHOTS 16				// Snapshot records in the super block
+#define SNAPSHOT_NAME_MAX 32				// Snapshot names are shorter than this
+#define SNAPSHOT_MAP_POINTERS (POINTERS_PER_BLOCK - 1)	// Table blocks listed per map block
+
+// mfsd Defines
+#define MFSD_MAGIC 0x4453464D				// "MFSD" at the start of every request and reply
+#define MFSD_MAX_EVENTS 64				// epoll events handled per wakeup
+#define MFSD_BACKLOG 64					// Connections waiting to be accepted
+#define MFSD_PATH_MAX 1024				// Longest path a request can carry
+
+// savefs Defines
+#define SAVE_CHUNK_SIZE (1024 * 1024)			// savefs streams the image out in 1 MiB writes
+#define FSYNC_NONE 0					// Leave flushing the temp image to the kernel
+#define FSYNC_DATA 1					// fdatasync the temp image before the rename
+#define FSYNC_FULL 2					// fsync the temp image and its directory
+
+// Readahead Defines
+#define READAHEAD_STREAMS 64				// Files whose reads are followed at once
+#define READAHEAD_MIN_BLOCKS 16				// Prefetched past the first sequential read
+#define READAHEAD_MAX_BLOCKS 1024			// The window stops doubling here
+
+// Huge page Defines
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)		// Transparent huge pages are 2 MiB
+#define IMAGE_PAGES_SMALL 0				// The image is on ordinary 4 KiB pages
+#define IMAGE_PAGES_TRANSPARENT 1			// MADV_HUGEPAGE asked for huge pages
+#define IMAGE_PAGES_HUGETLB 2				// The image is on reserved hugetlb pages
+#define IMAGE_PAGES_FILE 3				// The image is mapped from its file
+
+// Metrics Defines, build with -DMFS_METRICS=0 to compile all of the instrumentation out
+#ifndef MFS_METRICS
+#define MFS_METRICS 1
+#endif
+#define HIST_SUB_BITS 3					// Each power of two is split into 8 buckets,
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)		// so a recorded latency is within 12.5%
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)		// Enough buckets for any 64 bit value
+
+// Trace Defines, build with -DMFS_TRACE=0 to compile the event trace out
+#ifndef MFS_TRACE
+#define MFS_TRACE 1
+#endif
+#define TRACE_RING_SIZE (1 << 16)			// Events kept, must be a power of two
+
+//-------------------------------------------------------------------------------------------------
+// Disk Layout
+// ------------------------------------------------------------------------------------------------
+
+// Each region starts where the one before it ends, sized from what is stored in it. The
+// inode table, the directory, the name table and the free inode map are stored back to back in
+// table blocks taken from the data area as they grow, the table map lists which blocks those are.
+//
+// Everything in the image is fixed width and little-endian, and the super block carries a
+// format version that openfs checks.
+#define SUPER_BLOCK 0					// Image format and table sizes
+#define TABLE_BYTES(slots) ((size_t) (slots) * \
+                            ( sizeof(struct inode) + sizeof(struct directoryEntry) + \
+                              MAX_FILENAME + 1 ))
+#define TABLE_BLOCKS(slots) ((int32_t) ((TABLE_BYTES(slots) + BLOCK_SIZE - 1) / BLOCK_SIZE))
+#define TABLE_MAP_BLOCK 1				// Table block numbers
+#define TABLE_MAP_BLOCKS ((int32_t) \
+                          ((TABLE_BLOCKS(MAX_FILES) * sizeof(int32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE))
+#define BLOCK_REF_MAP_BLOCK (TABLE_MAP_BLOCK + TABLE_MAP_BLOCKS)	// One byte per block
+#define BLOCK_REF_MAP_BLOCKS (NUM_BLOCKS / BLOCK_SIZE)
+#define CHECKSUM_BLOCK (BLOCK_REF_MAP_BLOCK + BLOCK_REF_MAP_BLOCKS)	// CRC32C of every block
+#define CHECKSUM_BLOCKS (NUM_BLOCKS * sizeof(uint32_t) / BLOCK_SIZE)
+#define FIRST_DATA_BLOCK ((int32_t) (CHECKSUM_BLOCK + CHECKSUM_BLOCKS))
+#define DATA_BLOCKS (NUM_BLOCKS - FIRST_DATA_BLOCK)	// Blocks in the data area
+#define MFS_MAGIC 0x2053464D				// "MFS " at the start of the super block
+#define MFS_VERSION 5					// Image format, bumped when the layout changes
+#define CACHE_LINE 64					// Inodes and names are one cache line each
+
+// Images are the in memory tables copied out as they are
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "mfs images are little-endian and mfs only builds for little-endian machines"
+#endif
 
 //-------------------------------------------------------------------------------------------------
 // Global Variables & Structures
 // ------------------------------------------------------------------------------------------------
 
 
-// Data Structure of 67 MB Disk Image
-uint8_t data[NUM_BLOCKS][BLOCK_SIZE];
+// Data Structure of 67 MB Disk Image. openfs maps the image file in privately, so blocks are
+// only read from disk the first time they are touched and changes stay in memory until savefs
+// writes a new file. createfs starts from a zero filled anonymous mapping.
+uint8_t (*data)[BLOCK_SIZE];
+uint8_t image_mapped;		// data is backed by the image file, blocks may not be in memory yet
+uint8_t huge_pages = 1;		// Put images that aren't mapped from their file on huge pages
+uint8_t image_pages;		// What the current image is on, one of the IMAGE_PAGES values
 
-// 64 blocks just for free block map // How I get 64 blocks?
-// Out Free_block array will have 65536 Entries and each entry is 1 byte each
-// (NUM_BLOCKS  / sizeof(Block) = number of free blocks
+// 64 blocks just for the block reference map // How I get 64 blocks?
+// Our block_refs array will have 65536 Entries and each entry is 1 byte each
+// (NUM_BLOCKS  / sizeof(Block) = number of blocks
 // 65536 / 1024 = 64 ... 
-uint8_t * free_blocks;
+// Each entry counts the references to a data block from the live file system and from every
+// snapshot, 0 means the block is free. More than 1 means a snapshot shares it.
+uint8_t * block_refs;
 uint8_t * free_inodes;
+uint32_t  free_block_count;	// Blocks with no references, so df doesn't have to count them
+int32_t   alloc_hint;		// Where the next free block search starts
+
+// CRC32C of each block's full BLOCK_SIZE bytes, indexed by block number. Kept up to date for
+// every data block that belongs to a file.
+uint32_t * block_crcs;
+uint8_t    verify_checksums = 1;	// Check blocks against block_crcs before handing them out
+
+// Readahead: each file being read gets a stream, picked by inode number, that remembers where
+// its last read ended. A read starting there is sequential, and the blocks past it are
+// prefetched with a window that doubles on every sequential read.
+struct readahead_stream
+{
+   int32_t  inode_index;		// File being read, -1 before the stream is first used
+   uint32_t next;			// Block number a sequential read would start at
+   uint32_t window;			// Blocks to prefetch past the end of each read
+   uint32_t prefetched;			// Blocks before this one have been prefetched already
+};
+
+struct readahead_stream readahead_streams[READAHEAD_STREAMS];
+uint8_t                 readahead_enabled = 1;
+pthread_mutex_t         readahead_lock = PTHREAD_MUTEX_INITIALIZER;	// retrieve -a threads
+long                    page_size;
 
-// Directory Structure
+// Directory Structure. The names are kept apart in the name table, filenames[i] is the name of
+// directory[i], so scans that only look at which entries are in use and where they are don't
+// read the names.
 struct directoryEntry
 {
-   char     filename[64];
-   short    in_use;
+   uint8_t  in_use;
+   uint8_t  reserved[3];
    int32_t  inode;
+   int32_t  parent;			// Directory index of the directory it is in, or ROOT_DIRECTORY
 };
 
 struct directoryEntry * directory;
+char                 (* filenames)[MAX_FILENAME];
 
-// inode Structure
+// inode Structure, exactly one cache line with the fields every scan reads first. The first
+// DIRECT_BLOCKS block pointers are kept here, the rest in indirect blocks of POINTERS_PER_BLOCK
+// pointers each, so an inode is small whatever the file size. The first INDIRECT_BLOCKS
+// indirect blocks are listed here too, and the rest in the double indirect block.
 struct inode
 {
-   int32_t  blocks[BLOCKS_PER_FILE];
-   short    in_use;
+   uint8_t  in_use;
    uint8_t  attribute;			// Attributes of the file
+   uint16_t reserved;
    uint32_t file_size;
-   time_t   t;
+   int32_t  direct[DIRECT_BLOCKS];
+   int32_t  indirect[INDIRECT_BLOCKS];
+   int32_t  double_indirect;
+   uint32_t trashed;			// Delete sequence number while in the trash, 0 otherwise
+   int64_t  t;				// Seconds since the epoch
 };
 
 struct inode * inodes;
 
+// A frozen copy of the directory, inode table and free inode map. The copy is stored in table
+// blocks of its own, listed by a chain of map blocks: each holds SNAPSHOT_MAP_POINTERS table
+// block numbers and then the next map block. The data blocks are shared with the live file
+// system until one side changes them.
+struct snapshot
+{
+   char     name[SNAPSHOT_NAME_MAX];
+   uint8_t  in_use;
+   uint8_t  reserved[3];
+   int32_t  map;			// First map block
+   uint32_t file_slots;
+   uint32_t trash_seq;
+   int64_t  t;
+};
+
+// Block 0 of the image
+struct superblock
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t file_slots;
+   uint32_t trash_seq;
+   struct snapshot snapshots[MAX_SNAPSHOTS];
+};
+
+// The image holds these as they are, so their sizes are part of the format
+_Static_assert( sizeof(struct directoryEntry) == 12, "directory entries must be 12 bytes" );
+_Static_assert( sizeof(struct inode) == CACHE_LINE, "inodes must fill one cache line" );
+_Static_assert( sizeof(struct snapshot) == 56, "snapshot records must be 56 bytes" );
+_Static_assert( sizeof(struct superblock) <= BLOCK_SIZE, "the super block must fit in a block" );
+
+// The directory, inodes and free inode map are loaded into these heap tables when an image is
+// opened and stored back into the table blocks by savefs. They have file_slots entries each
+// and double in size when they fill up.
+struct superblock * super;
+int32_t  * table_map;		// Blocks the tables are stored in
+uint32_t   file_slots;
+uint32_t   trash_seq;		// Sequence number of the latest delete
+int32_t    entry_hint;		// Where the next free directory entry search starts
+int32_t    inode_hint;		// Where the next free inode search starts
+
+// Open addressed hash of the (parent, name) pairs of the entries in use, for findChild. Holds
+// directory indexes, -1 in empty slots, and is kept at most half full.
+int32_t  * name_index;
+uint32_t   name_index_mask;
+
+// Dentry cache: directory paths resolveParent has walked, and the directory index they ended at.
+// Entries filled before the current generation are stale, bumping it drops the whole cache.
+struct dentry
+{
+   uint32_t generation;
+   int32_t  directory_index;
+   uint32_t length;
+   char     path[DENTRY_PATH_MAX];
+};
+
+struct dentry dentry_cache[DENTRY_CACHE_SIZE];
+uint32_t      dentry_generation = 1;
+
 FILE     *fp;
-char     image_name[64];
+char     image_name[PATH_MAX];
 uint8_t  image_open;		// Bool Value if the disk image is open
+uint8_t  fsync_policy = FSYNC_FULL;	// How hard savefs works to make the image durable
+
+// Byte to hex lookup tables for the read command, hex_pairs[b] is the two digit form of b
+const char hex_digits[] = "0123456789abcdef";
+char       hex_pairs[256][2];
 
 //-------------------------------------------------------------------------------------------------
-// Light Functions
+// Metrics
 // ------------------------------------------------------------------------------------------------
 
-// Used in insert to find a free block 
-int32_t findFreeBlock()
+// Operations that get their own counters and latency histogram
+enum metric_op
 {
-   // The reason we search through zero to NUM_BlOCKS is 
-   // because we are just seaching the the free blocks array and
-   // not the data array and our actual data blocks and 
-   // our index have an offset of FIRST_DATA_BLOCK
-   for (int i = 0; i < NUM_BLOCKS; i++)
-   {
-      if ( free_blocks[i] )
-      {
-         return i + FIRST_DATA_BLOCK;
-      }
-   }
-   return -1;
+   OP_INSERT,
+   OP_RETRIEVE,
+   OP_READ,
+   OP_WRITE,
+   OP_TRUNCATE,
+   OP_DELETE,
+   OP_ENCRYPT,
+   OP_DECRYPT,
+   OP_SAVEFS,
+   OP_GREP,
+   OP_COUNT
+};
+
+const char *metric_op_names[OP_COUNT] =
+{
+   "insert", "retrieve", "read", "write", "truncate", "delete", "encrypt", "decrypt", "savefs",
+   "grep"
+};
+
+struct op_metrics
+{
+   uint64_t count;				// Completed operations
+   uint64_t bytes;				// File data moved by them
+   uint64_t total_ns;
+   uint64_t max_ns;
+   uint64_t latency[HIST_BUCKETS];		// Log-linear histogram of latency in nanoseconds
+};
+
+struct mfs_metrics
+{
+   struct op_metrics ops[OP_COUNT];
+   uint64_t block_allocs;			// Data blocks taken from the free block map
+   uint64_t block_frees;			// Data blocks handed back to it
+   uint64_t alloc_search;			// Free block map entries looked at to find them
+   uint64_t syscalls;				// System calls made directly, stdio buffering not counted
+   uint64_t path_lookups;			// Paths resolved down to the directory holding them
+   uint64_t cache_hits;				// Of those, found in the dentry cache without a walk
+   uint64_t cow_copies;				// Blocks copied because a snapshot shared them
+   uint64_t readahead_blocks;			// Blocks prefetched for reads
+};
+
+struct mfs_metrics metrics;
+
+#if MFS_METRICS || MFS_TRACE
+
+// Record the start time of an operation, and when it completes count it into op's metrics
+// and the event trace
+#define METRIC_BEGIN()			uint64_t metric_start = metric_clock()
+#define METRIC_END( op, nbytes )	op_complete( (op), (nbytes), metric_start )
+
+#else
+
+#define METRIC_BEGIN()
+#define METRIC_END( op, nbytes )
+
+#endif
 
+#if MFS_METRICS
+
+// retrieve -a counts from several threads at once, so the counters are added to atomically
+#define METRIC_ADD( field, n )		__atomic_fetch_add( &metrics.field, (n), __ATOMIC_RELAXED )
+#define METRIC_SYSCALL()		__atomic_fetch_add( &metrics.syscalls, 1, __ATOMIC_RELAXED )
+
+#else
+
+#define METRIC_ADD( field, n )
+#define METRIC_SYSCALL()
+
+#endif
+
+uint64_t metric_clock()
+{
+   struct timespec ts;
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-int32_t findFreeInode()
+// Histogram bucket for a value: values below HIST_SUB_BUCKETS get their own bucket, after
+// that every power of two is split into HIST_SUB_BUCKETS equal buckets
+int hist_bucket( uint64_t value )
 {
-   for (int i = 0; i < MAX_FILES; i++)
+   if ( value < HIST_SUB_BUCKETS )
    {
-      if ( free_inodes[i] )
-      {
-         return i;
-      }
+      return value;
    }
-   return -1;
 
+   int msb   = 63 - __builtin_clzll( value );
+   int shift = msb - HIST_SUB_BITS;
+   return ( shift + 1 ) * HIST_SUB_BUCKETS + ( ( value >> shift ) & ( HIST_SUB_BUCKETS - 1 ) );
 }
 
-int32_t findFreeInodeBlock( int32_t inode )
+// Largest value that lands in a histogram bucket
+uint64_t hist_bucket_max( int bucket )
 {
-   for (int i = 0; i < BLOCKS_PER_FILE; i++)
+   if ( bucket < HIST_SUB_BUCKETS )
    {
-      if ( inodes[inode].blocks[i] == -1)
-      {
-         return i;
-      }
+      return bucket;
    }
-   return -1;
 
+   int shift = bucket / HIST_SUB_BUCKETS - 1;
+   uint64_t low = (uint64_t) ( HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS ) << shift;
+   return low + ( ( 1ull << shift ) - 1 );
 }
 
-void init( )
+void metric_record( enum metric_op op, uint64_t bytes, uint64_t ns )
 {
-   //Pointing the Pointers to the right spot in our disk image
-   directory 	= (struct directoryEntry*) &data[0][0]; 
-   free_inodes 	= (uint8_t *) &data[19][0];
-   inodes    	= (struct inode*) &data[20][0];
-   free_blocks 	= (uint8_t *) &data[277][0];
-
-   memset( image_name, 0, 64 ); // Initializing the disk image name to zero
-   image_open = 0;		// Disk image is not open 
-
-   // Every file initialization
-   for (int i = 0; i < MAX_FILES; i++)
+   struct op_metrics *m = &metrics.ops[op];
+   m->count++;
+   m->bytes += bytes;
+   m->total_ns += ns;
+   if ( ns > m->max_ns )
    {
-      directory[i].in_use = 0;		// Marking File as not used
-      directory[i].inode = -1;		// Pointer to inode is nothing...
-      free_inodes[i] = 1;
+      m->max_ns = ns;
+   }
+   m->latency[hist_bucket( ns )]++;
+}
 
-      memset( directory[i].filename, 0, 64 );	// Initializing the filenames to zero
+// Value at or below which the fraction p of the recorded latencies fall
+uint64_t metric_percentile( struct op_metrics *m, double p )
+{
+   uint64_t target = (uint64_t) ( p * m->count + 0.5 );
+   uint64_t seen = 0;
 
-      //For Every Block in Every File
-      for (int j = 0; j < BLOCKS_PER_FILE; j++)
-      {
-         inodes[i].blocks[j] = -1;	// Pointer to inode is nothing...
-         inodes[i].in_use = 0; 		// Marking inode as not used
-         inodes[i].attribute = 0;
-         inodes[i].file_size = 0;
-         inodes[i].t = 0;
-      }
+   if ( target == 0 )
+   {
+      target = 1;
    }
 
-   for (int j = 0; j < NUM_BLOCKS; j++)
+   for ( int i = 0; i < HIST_BUCKETS; i++ )
    {
-      free_blocks[j] = 1;
+      seen += m->latency[i];
+      if ( seen >= target )
+      {
+         uint64_t value = hist_bucket_max( i );
+         return value < m->max_ns ? value : m->max_ns;
+      }
    }
+   return m->max_ns;
+}
 
+void metrics_reset()
+{
+   memset( &metrics, 0, sizeof(metrics) );
 }
 
-uint32_t df()
+// Name: metrics_print
+// Parameters: out - stream to print to
+// Returns: none
+// Description: Prints the counters and latency percentiles (in microseconds) of every
+//              operation that has run since start up or the last metrics_reset.
+void metrics_print( FILE *out )
 {
-   int count = 0;
-   // look at all our data blocks
-   for (int j = FIRST_DATA_BLOCK; j < NUM_BLOCKS; j++)
+#if MFS_METRICS
+   fprintf( out, "%-9s %8s %12s %9s %9s %9s %9s %9s\n",
+            "op", "count", "bytes", "avg_us", "p50_us", "p99_us", "p999_us", "max_us" );
+
+   for ( int op = 0; op < OP_COUNT; op++ )
    {
-      // if a datablock is free then count it
-      if (free_blocks[j-FIRST_DATA_BLOCK])
+      struct op_metrics *m = &metrics.ops[op];
+      if ( m->count == 0 )
       {
-         count++;
+         continue;
       }
+
+      fprintf( out, "%-9s %8"PRIu64" %12"PRIu64" %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+               metric_op_names[op], m->count, m->bytes,
+               m->total_ns / 1000.0 / m->count,
+               metric_percentile( m, 0.50 ) / 1000.0,
+               metric_percentile( m, 0.99 ) / 1000.0,
+               metric_percentile( m, 0.999 ) / 1000.0,
+               m->max_ns / 1000.0 );
    }
-   
-   return count * BLOCK_SIZE;
+
+   fprintf( out, "block allocs: %"PRIu64"  block frees: %"PRIu64"  alloc search: %"PRIu64
+            " entries (%.1f per alloc)  syscalls: %"PRIu64"\n",
+            metrics.block_allocs, metrics.block_frees, metrics.alloc_search,
+            metrics.block_allocs ? (double) metrics.alloc_search / metrics.block_allocs : 0.0,
+            metrics.syscalls );
+   fprintf( out, "path lookups: %"PRIu64"  cache hits: %"PRIu64" (%.1f%%)\n",
+            metrics.path_lookups, metrics.cache_hits,
+            metrics.path_lookups ? 100.0 * metrics.cache_hits / metrics.path_lookups : 0.0 );
+   fprintf( out, "copy on write: %"PRIu64" blocks  readahead: %"PRIu64" blocks\n",
+            metrics.cow_copies, metrics.readahead_blocks );
+#else
+   fprintf( out, "Metrics are not compiled in, rebuild with -DMFS_METRICS=1.\n" );
+#endif
 }
 
-void createfs( char* diskName )
+//-------------------------------------------------------------------------------------------------
+// Tracing
+// ------------------------------------------------------------------------------------------------
+
+// A finished span of work: a whole command or one phase inside it
+struct trace_event
 {
-   fp = fopen ( diskName, "w" );
+   const char *name;
+   uint64_t    start_ns;
+   uint64_t    end_ns;
+   uint32_t    tid;
+};
 
-   strncpy( image_name, diskName, strlen(diskName) );		// Copying diskname to our image_name variable
+uint8_t trace_enabled = 0;		// Turned on and off with the trace command
 
-   memset( data, 0, NUM_BLOCKS * BLOCK_SIZE );			// Allocating Memory Space for Disk Image
+#if MFS_TRACE
 
-   image_open = 1;	// Disk Image is now Open
+// Spans are timed from TRACE_START to TRACE_END, nothing is recorded unless tracing is on
+#define TRACE_START( var )	uint64_t var = trace_enabled ? metric_clock() : 0
+#define TRACE_END( name, var )	do { if ( trace_enabled ) trace_record( (name), (var) ); } while (0)
 
-   // Initializing Every File
-   for (int i = 0; i < MAX_FILES; i++)
-   {
-      directory[i].in_use = 0;		// Marking every file as not used
-      directory[i].inode = -1;		// Pointer inodes is nothing
-      free_inodes[i] = 1;
+// The ring is written lock free: each writer claims a slot by bumping trace_head and the
+// oldest events are overwritten once it wraps
+struct trace_event trace_ring[TRACE_RING_SIZE];
+uint64_t           trace_head = 0;
+__thread uint32_t  trace_tid = 0;
 
-      memset( directory[i].filename, 0, 64 ); // Init filenames to zeros
+void trace_record( const char *name, uint64_t start_ns )
+{
+   uint64_t end_ns = metric_clock();
+   uint64_t slot = __atomic_fetch_add( &trace_head, 1, __ATOMIC_RELAXED ) & ( TRACE_RING_SIZE - 1 );
 
-      // Initializing Every Block in Every File
-      for (int j = 0; j < BLOCKS_PER_FILE; j++)
-      {
-         inodes[i].blocks[j]=-1;
-         inodes[i].in_use=0;
-         inodes[i].attribute=0;
-         inodes[i].file_size = 0;
-      }
-   }
-   
-   for (int j = 0; j < NUM_BLOCKS; j++)
+   if ( trace_tid == 0 )
    {
-      free_blocks[j] = 1;
+      trace_tid = (uint32_t) gettid();
    }
 
-   fclose ( fp ); 	// This makes the closefs pointless
+   trace_ring[slot].name     = name;
+   trace_ring[slot].start_ns = start_ns;
+   trace_ring[slot].end_ns   = end_ns;
+   trace_ring[slot].tid      = trace_tid;
 }
 
-void savefs()
+#else
+
+#define TRACE_START( var )
+#define TRACE_END( name, var )
+
+#endif
+
+// Name: trace_dump
+// Parameters: filename - file to write the trace to
+// Returns: none
+// Description: Writes the events in the ring, oldest first, as Chrome trace event JSON that
+//              chrome://tracing or Perfetto can load. Times are in microseconds.
+void trace_dump( char *filename )
 {
-   if ( image_open == 0 )
+#if MFS_TRACE
+   FILE *ofp = fopen( filename, "w" );
+   if ( ofp == NULL )
    {
-      printf("ERROR: Disk image is not open.\n");
+      printf("ERROR: Could not open %s.\n", filename);
+      return;
    }
-   else
-   {
-   	fp = fopen ( image_name, "w");
 
-   	fwrite( &data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp );
+   uint64_t head  = __atomic_load_n( &trace_head, __ATOMIC_ACQUIRE );
+   uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+   int      pid   = getpid();
 
-   	memset( image_name, 0, 64);	// Zeroing Disk Image Name out because not using it
-
-   	fclose ( fp );		// Again makes closefs pointless
+   fprintf( ofp, "{\"traceEvents\": [\n" );
+   for ( uint64_t i = first; i < head; i++ )
+   {
+      struct trace_event *event = &trace_ring[i & ( TRACE_RING_SIZE - 1 )];
+      fprintf( ofp, "%s  {\"name\": \"%s\", \"cat\": \"mfs\", \"ph\": \"X\", \"ts\": %.3f, "
+               "\"dur\": %.3f, \"pid\": %d, \"tid\": %"PRIu32"}",
+               i == first ? "" : ",\n", event->name, event->start_ns / 1000.0,
+               ( event->end_ns - event->start_ns ) / 1000.0, pid, event->tid );
    }
+   fprintf( ofp, "\n], \"displayTimeUnit\": \"ns\"}\n" );
+   fclose( ofp );
+
+   printf("Wrote %"PRIu64" trace events to %s\n", head - first, filename );
+#else
+   (void) filename;
+   printf("Tracing is not compiled in, rebuild with -DMFS_TRACE=1.\n");
+#endif
 }
 
-void openfs( char* diskName )
+// Name: trace_command
+// Parameters: action - on, off, clear or dump (NULL shows the state), filename - for dump
+// Returns: none
+// Description: Implements the trace command.
+void trace_command( char *action, char *filename )
 {
-   fp = fopen ( diskName, "r");
-   
-   if (fp == NULL)
+#if MFS_TRACE
+   if ( action == NULL )
    {
-	   printf("ERROR: Disk image does not exist\n");
+      uint64_t head = trace_head;
+      printf("trace %s, %"PRIu64" events buffered (%d max)\n", trace_enabled ? "on" : "off",
+             head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE, TRACE_RING_SIZE );
+   }
+   else if ( !strcmp( action, "on" ) )
+   {
+      trace_enabled = 1;
+   }
+   else if ( !strcmp( action, "off" ) )
+   {
+      trace_enabled = 0;
+   }
+   else if ( !strcmp( action, "clear" ) )
+   {
+      trace_head = 0;
+   }
+   else if ( !strcmp( action, "dump" ) && filename != NULL )
+   {
+      trace_dump( filename );
    }
    else
    {
-   	strncpy( image_name, diskName, strlen(diskName) );	// Copy the disk image name to our image name variable
+      printf("ERROR: Usage: trace [on|off|clear|dump <file>]\n");
+   }
+#else
+   (void) action;
+   (void) filename;
+   printf("Tracing is not compiled in, rebuild with -DMFS_TRACE=1.\n");
+#endif
+}
+
+// Called by METRIC_END when an operation completes, feeds both the metrics and the trace
+void op_complete( enum metric_op op, uint64_t bytes, uint64_t start_ns )
+{
+#if MFS_METRICS
+   metric_record( op, bytes, metric_clock() - start_ns );
+#else
+   (void) bytes;
+#endif
+   TRACE_END( metric_op_names[op], start_ns );
+}
 
-   	fread( &data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp );	// Store the data in the disk image to our data structure
+//-------------------------------------------------------------------------------------------------
+// Light Functions
+// ------------------------------------------------------------------------------------------------
 
-   	image_open = 1;		// Mark the disk image as open 
+// Software CRC32C (Castagnoli), one table lookup per byte. Filled in by init.
+uint32_t crc32c_table[256];
 
-   	fclose ( fp );		// Again makes closefs pointless
+uint32_t crc32c_sw( const uint8_t *buf, size_t len )
+{
+   uint32_t crc = 0xFFFFFFFF;
+   while ( len-- > 0 )
+   {
+      crc = crc32c_table[( crc ^ *buf++ ) & 0xFF] ^ ( crc >> 8 );
    }
+   return ~crc;
 }
 
-void closefs()
+#if defined(__x86_64__)
+// SSE4.2 has a CRC32C instruction that does 8 bytes at a time, only called if the CPU has it
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw( const uint8_t *buf, size_t len )
 {
-   if ( image_open == 0 )
+   uint64_t crc = 0xFFFFFFFF;
+   while ( len >= 8 )
    {
-      printf("ERROR: Disk image is not open.\n");
-      return;
+      uint64_t word;
+      memcpy( &word, buf, 8 );
+      crc = __builtin_ia32_crc32di( crc, word );
+      buf += 8;
+      len -= 8;
    }
-
-   image_open = 0;		// Mark the disk image as closed 
-   memset( image_name, 0, 64 );	// Zeroing out Disk Image name becuase not using it
+   while ( len-- > 0 )
+   {
+      crc = __builtin_ia32_crc32qi( (uint32_t) crc, *buf++ );
+   }
+   return ~(uint32_t) crc;
 }
+#endif
 
-void delete( char *filename )
+// Points at the fastest CRC32C this CPU supports, picked by init
+uint32_t (*crc32c)( const uint8_t *buf, size_t len ) = crc32c_sw;
+
+// A byte pattern for grep, with its Boyer-Moore-Horspool shift table
+struct grep_pattern
+{
+   uint8_t  bytes[GREP_PATTERN_MAX];
+   uint32_t length;
+   uint32_t shift[256];			// How far to move on when the window ends in byte b
+};
+
+// Name: findPatternSw
+// Parameters: pattern - what to look for, text - bytes to search, len - length of text
+// Returns: the first match in text, or NULL if there is none
+// Description: Boyer-Moore-Horspool. The last byte of the window is checked first, and the
+//              window moves on by the shift for that byte, up to the whole pattern length.
+const uint8_t *findPatternSw( const struct grep_pattern *pattern, const uint8_t *text, size_t len )
 {
-   short counter    = 0;         // This is also the index for directory
-   short encontrado = 0;         // found
-   int32_t inode_index;          // needed to free correct inode
+   size_t  m = pattern->length;
+   uint8_t last = pattern->bytes[m - 1];
 
-   while(!encontrado && (counter < MAX_FILES))
+   for (size_t i = 0; i + m <= len; i += pattern->shift[text[i + m - 1]])
    {
-      // cheking for file
-      if ( !strcmp( directory[counter].filename, filename ) )
+      if ( text[i + m - 1] == last && !memcmp( text + i, pattern->bytes, m - 1 ) )
       {
-         encontrado = 1;
-         continue;
+         return text + i;
       }
-
-      counter++;
-   }
-
-   if ( !encontrado )
-   {
-      printf("delete: File not found\n");
-   }
-   else
-   {
-      inode_index = directory[counter].inode;   // obtaining the location of inode
-
-      inodes[inode_index].in_use    = 0;        // inode is no longer in use
-      free_inodes[inode_index]      = 1;        // inode is now free
-
-      directory[counter].in_use     = 0;        // directory is no longer in use
-      free_blocks[counter]          = 1;        // directory is no free
    }
-
+   return NULL;
 }
 
-void undel( char *filename )
+#if defined(__x86_64__)
+// AVX2 compares the first and last byte of the pattern at 32 window positions at once, and the
+// whole pattern is only compared where both match. Only called if the CPU has AVX2.
+__attribute__((target("avx2")))
+const uint8_t *findPatternAvx2( const struct grep_pattern *pattern, const uint8_t *text,
+                                size_t len )
 {
-   short counter           = 0;         // This is also the index for directory
-   short encontrado        = 0;         // found
-   int32_t inode_index;                 // needed to free correct inode
+   size_t  m = pattern->length;
+   __m256i first = _mm256_set1_epi8( (char) pattern->bytes[0] );
+   __m256i last  = _mm256_set1_epi8( (char) pattern->bytes[m - 1] );
+   size_t  i = 0;
 
-   while(!encontrado && (counter < MAX_FILES))
+   for ( ; i + m - 1 + 32 <= len; i += 32)
    {
-      // cheking for file
-      if ( !strcmp( directory[counter].filename, filename ) )
+      __m256i starts = _mm256_loadu_si256( (const __m256i *) ( text + i ) );
+      __m256i ends   = _mm256_loadu_si256( (const __m256i *) ( text + i + m - 1 ) );
+      uint32_t candidates = (uint32_t) _mm256_movemask_epi8(
+         _mm256_and_si256( _mm256_cmpeq_epi8( starts, first ), _mm256_cmpeq_epi8( ends, last ) ) );
+
+      while ( candidates )
       {
-         encontrado = 1;
-         continue;
+         int bit = __builtin_ctz( candidates );
+         if ( !memcmp( text + i + bit, pattern->bytes, m ) )
+         {
+            return text + i + bit;
+         }
+         candidates &= candidates - 1;
       }
-
-      counter++;
    }
 
-   if ( !encontrado )
-   {
-      // file does not exist
-      printf("undelete: can not find the file.\n");
-   }
-   else
-   {
-      directory[counter].in_use     = 1;        // directory is in use
-      free_blocks[counter]          = 0;        // directory is no longer free
+   // Fewer than 32 window positions are left
+   return findPatternSw( pattern, text + i, len - i );
+}
+#endif
 
-      inode_index = directory[counter].inode;   // obtaining inode location
-            
-      inodes[inode_index].in_use    = 1;        // inode is now in use
-      free_inodes[inode_index]      = 0;        // directory is not free
-   }
+// Points at the fastest pattern search this CPU supports, picked by init
+const uint8_t *(*findPattern)( const struct grep_pattern *pattern, const uint8_t *text,
+                               size_t len ) = findPatternSw;
 
+// Records the checksum of a data block after its contents change
+void blockWritten( int32_t block_index )
+{
+   block_crcs[block_index] = crc32c( data[block_index], BLOCK_SIZE );
 }
 
-void list()
+// Returns the indirect block in indirect slot k of a file, or -1 if it has none. Slot k holds
+// the pointers for block numbers DIRECT_BLOCKS + k * POINTERS_PER_BLOCK on.
+int32_t indirectBlock( struct inode *file_inode, uint32_t k )
 {
-   int not_found = 1; // boolean to check if a file is found to print message
-   for (int i = 0; i < MAX_FILES; i++)
+   if ( k < INDIRECT_BLOCKS )
    {
-      if (directory[i].in_use && !(inodes[directory[i].inode].attribute & HIDDEN))
-      {
-         not_found = 0;
-         char filename[65];
-         memset( filename, 0, 65 );
-         strncpy( filename, directory[i].filename, strlen(directory[i].filename) );
-         printf("%10s ", filename);
-         printf("%8"PRIu32" B     ", inodes[directory[i].inode].file_size);
-         printf("%s", ctime(&inodes[directory[i].inode].t));
-         
-      }
+      return file_inode->indirect[k];
    }
-   
-   if ( not_found )
+   if ( !IS_DATA_BLOCK( file_inode->double_indirect ) )
    {
-      printf("ERROR: No files found.\n");
+      return -1;
    }
+   return ( (int32_t *) data[file_inode->double_indirect] )[k - INDIRECT_BLOCKS];
 }
 
-void list_hidden()
+// Returns where indirect slot k of a file is kept, in the inode or in its double indirect
+// block. The double indirect block has to exist, and its checksum is the caller's to update.
+int32_t *indirectSlot( struct inode *file_inode, uint32_t k )
 {
-   int not_found = 1; // boolean to check if a file is found to print message
+   if ( k < INDIRECT_BLOCKS )
+   {
+      return &file_inode->indirect[k];
+   }
+   return &( (int32_t *) data[file_inode->double_indirect] )[k - INDIRECT_BLOCKS];
+}
 
-   for (int i = 0; i < MAX_FILES; i++)
+// Returns the block holding block number idx of a file, or -1 if it has none. Every lookup is
+// at most two pointers deep whatever the offset, the indirect blocks are read straight out of
+// the image.
+int32_t fileBlock( struct inode *file_inode, uint32_t idx )
+{
+   if ( idx < DIRECT_BLOCKS )
    {
-      if (directory[i].in_use)
-      {
-         not_found = 0;
-         char filename[65];
-         memset( filename, 0, 65 );
-         strncpy( filename, directory[i].filename, strlen(directory[i].filename) );
-         printf("%s\n", filename );
-      }
+      return file_inode->direct[idx];
    }
-   
-   if ( not_found )
+
+   idx -= DIRECT_BLOCKS;
+   int32_t indirect = indirectBlock( file_inode, idx / POINTERS_PER_BLOCK );
+   if ( !IS_DATA_BLOCK( indirect ) )
    {
-      printf("ERROR: No files found.\n");
+      return -1;
    }
+   return ( (int32_t *) data[indirect] )[idx % POINTERS_PER_BLOCK];
 }
 
-void list_attribute()
+// Name: verifyFileBlocks
+// Parameters: file_inode - file to check, first - first block number in the file to check,
+//             last - one past the last block number to check
+// Returns: -1 if every block matches its checksum (or checking is off), otherwise the block
+//          number in the file of the first one that doesn't
+int32_t verifyFileBlocks( struct inode *file_inode, uint32_t first, uint32_t last )
 {
-   int not_found = 1; // boolean to check if a file is found to print message
+   if ( !verify_checksums )
+   {
+      return -1;
+   }
 
-   for (int i = 0; i < MAX_FILES; i++)
+   for ( uint32_t i = first; i < last; i++ )
    {
-      if (directory[i].in_use && !(inodes[directory[i].inode].attribute & HIDDEN))
+      int32_t block_index = fileBlock( file_inode, i );
+      if ( crc32c( data[block_index], BLOCK_SIZE ) != block_crcs[block_index] )
       {
-         not_found = 0;
-         char filename[65];
-         memset( filename, 0, 65 );
-         strncpy( filename, directory[i].filename, strlen(directory[i].filename) );
-         printf("%s %8d \n", filename, inodes[directory[i].inode].attribute);
+         return i;
       }
    }
-   
-   if ( not_found )
-   {
-      printf("ERROR: No files found.\n");
-   }
+   return -1;
 }
 
-void attribute(char* attribute, char* filename)
+// Name: adviseImage
+// Parameters: first_block - first block of the range, blocks - number of blocks in it,
+//             advice - madvise advice for them
+// Returns: none
+// Description: Passes an access hint for part of the image to the kernel, widened to whole
+//              pages. Only an image mapped from its file has anything to read in.
+void adviseImage( int32_t first_block, int32_t blocks, int advice )
 {
-   uint8_t found = 0;
-   struct inode * file_inode;
-	for( int i = 0; i < MAX_FILES; i++ )
-	{
-		if( !strcmp(directory[i].filename, filename))
-		{
-			found = 1;
-			file_inode = &inodes[directory[i].inode];
-         break;
-      }
+   if ( !image_mapped || blocks <= 0 )
+   {
+      return;
    }
 
-   if (found == 0)
+   uintptr_t start = (uintptr_t) data[first_block] & ~( (uintptr_t) page_size - 1 );
+   uintptr_t end   = (uintptr_t) data[first_block] + (uintptr_t) blocks * BLOCK_SIZE;
+   madvise( (void *) start, end - start, advice );
+   METRIC_SYSCALL();
+}
+
+// Name: readAhead
+// Parameters: inode_index - file about to be read, first - first block number in the file
+//             the read covers, last - one past the last
+// Returns: none
+// Description: Called before a read touches a file's blocks. The blocks of the read itself
+//              and, if it carries on where the last read of the file ended, the window past
+//              it are handed to the kernel to start reading in while the caller works through
+//              the first ones. Runs of consecutive blocks go in one request each. The window
+//              starts at READAHEAD_MIN_BLOCKS, doubles with each sequential read up to
+//              READAHEAD_MAX_BLOCKS and is dropped when a read jumps somewhere else.
+void readAhead( int32_t inode_index, uint32_t first, uint32_t last )
+{
+   if ( !image_mapped || !readahead_enabled )
    {
-      printf("ERROR: No matching file found.\n");
       return;
    }
 
-   if ( !strcmp(attribute, "+h") )
+   struct inode            *file_inode = &inodes[inode_index];
+   struct readahead_stream *stream = &readahead_streams[inode_index % READAHEAD_STREAMS];
+   uint32_t                 block_count = BLOCKS_FOR_SIZE( file_inode->file_size );
+
+   pthread_mutex_lock( &readahead_lock );
+
+   if ( stream->inode_index == inode_index && first == stream->next )
    {
-      file_inode->attribute |= HIDDEN;
+      stream->window = stream->window * 2 < READAHEAD_MAX_BLOCKS ?
+                       stream->window * 2 : READAHEAD_MAX_BLOCKS;
+      stream->window = stream->window > READAHEAD_MIN_BLOCKS ?
+                       stream->window : READAHEAD_MIN_BLOCKS;
    }
-
-   else if (!strcmp(attribute, "-h"))
+   else
    {
-      file_inode->attribute &= ~HIDDEN;
+      // A read from the start of a file is taken as the start of a sequential one
+      stream->inode_index = inode_index;
+      stream->window      = first == 0 ? READAHEAD_MIN_BLOCKS : 0;
+      stream->prefetched  = first;
    }
 
-   else if (!strcmp(attribute, "+r"))
+   uint32_t start = stream->prefetched > first ? stream->prefetched : first;
+   uint32_t end   = last + stream->window < block_count ? last + stream->window : block_count;
+   int32_t  run_start = -1;
+   int32_t  run_length = 0;
+
+   for (uint32_t j = start; j < end; j++)
    {
-      file_inode->attribute |= READONLY;
+      int32_t block_index = fileBlock( file_inode, j );
+      if ( run_length > 0 && block_index == run_start + run_length )
+      {
+         run_length++;
+         continue;
+      }
+
+      adviseImage( run_start, run_length, MADV_WILLNEED );
+      run_start  = block_index;
+      run_length = IS_DATA_BLOCK( block_index );
    }
+   adviseImage( run_start, run_length, MADV_WILLNEED );
+   METRIC_ADD( readahead_blocks, end > start ? end - start : 0 );
 
-   else if (!strcmp(attribute, "-r"))
+   stream->next       = last;
+   stream->prefetched = end > stream->prefetched ? end : stream->prefetched;
+   pthread_mutex_unlock( &readahead_lock );
+}
+
+// Returns how many threads to split a parallel scan over
+int workerThreads()
+{
+   long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+   if ( cpus < 1 )
    {
-      file_inode->attribute &= ~READONLY;
+      cpus = 1;
    }
+   return cpus < MAX_THREADS ? cpus : MAX_THREADS;
+}
 
-   else
+// Name: runThreads
+// Parameters: fn - the work to run, work - array of threads work items of work_size bytes,
+//             threads - how many to run at once
+// Returns: none
+// Description: Runs fn on every work item at the same time, one thread each, and waits for
+//              them all. The first item runs on the calling thread.
+void runThreads( void *(*fn)( void * ), void *work, size_t work_size, int threads )
+{
+   pthread_t tids[MAX_THREADS];
+   uint8_t   started[MAX_THREADS];
+
+   for (int t = 1; t < threads; t++)
    {
-      printf("ERROR: Incorrect attribute specified.\n");
+      started[t] = pthread_create( &tids[t], NULL, fn, (uint8_t *) work + t * work_size ) == 0;
+      if ( !started[t] )
+      {
+         // Couldn't get a thread, do that share of the work here instead
+         fn( (uint8_t *) work + t * work_size );
+      }
+   }
+   fn( work );
+   for (int t = 1; t < threads; t++)
+   {
+      if ( started[t] )
+      {
+         pthread_join( tids[t], NULL );
+      }
    }
 }
 
-//-------------------------------------------------------------------------------------------------
-// Heavy Functions: Insert, Retrieve, Read, Encrypt, & Decrypt
-// ------------------------------------------------------------------------------------------------
-void readDisk( char* filename, int32_t start_byte, int32_t num_bytes )
+// Used in insert to find a free block 
+int32_t findFreeBlock()
 {
-	uint8_t found = 0;
-	for( int i = 0; i < MAX_FILES; i++ )
-	{
-		if( !strcmp(directory[i].filename, filename))
-		{
-			found = 1;
-			struct inode file_inode = inodes[directory[i].inode];
-			FILE* diskFile = fopen( image_name, "r");
-			// Now, open the output file that we are going to write the data to.
-			if( diskFile == NULL )
-			{
-				printf("Could not open disk file: %s\n", filename );
-				perror("Opening disk file returned");
-				return;
-			}
-
-			// Initialize our offsets and pointers just we did above when reading from the file.
-			uint8_t index_offset = start_byte / BLOCK_SIZE;
-			uint16_t remainder = start_byte % BLOCK_SIZE;
-			uint32_t block_index = file_inode.blocks[index_offset];
-			int32_t read_size   = (int) num_bytes;
-			uint32_t offset      = (block_index * BLOCK_SIZE) + remainder;
-
-
-			printf("Reading %d bytes to %s\n", (int) read_size, filename );
-
-			char buffer[BLOCK_SIZE+1];
-			memset( buffer, '\0', BLOCK_SIZE+1);
-
-			// Using copy_size as a count to determine when we've copied enough bytes to the output file.
-			// Each time through the loop, except the last time, we will copy BLOCK_SIZE number of bytes from
-			// our stored data to the file fp, then we will increment the offset into the file we are writing to.
-			// On the last iteration of the loop, instead of copying BLOCK_SIZE number of bytes we just copy
-			// how ever much is remaining ( copy_size % BLOCK_SIZE ).  If we just copied BLOCK_SIZE on the
-			// last iteration we'd end up with gibberish at the end of our file. 
-			while( read_size > 0 )
-			{ 
-				int temp_num_bytes;
-
-				// If the remaining number of bytes we need to copy is less than BLOCK_SIZE then
-				// only copy the amount that remains. If we copied BLOCK_SIZE number of bytes we'd
-				// end up with garbage at the end of the file.
-				if( (read_size + start_byte)%BLOCK_SIZE  < BLOCK_SIZE )
-				{
-					if ( read_size + start_byte > file_inode.file_size )
-					{
-						temp_num_bytes = file_inode.file_size - start_byte;
-					}
-					else
-						temp_num_bytes = read_size;
-				}
-				else 
-				{
-					temp_num_bytes = (read_size + start_byte) - BLOCK_SIZE;
-				}
+   TRACE_START( trace_start );
+   // The reason we search through zero to NUM_BlOCKS is 
+   // because we are just seaching the the free blocks array and
+   // not the data array and our actual data blocks and 
+   // our index have an offset of FIRST_DATA_BLOCK
+   //
+   // The search carries on from the last block found instead of starting over at zero, so
+   // filling the disk doesn't walk over every used block again for each allocation
+   for (int n = 0; n < DATA_BLOCKS && free_block_count > 0; n++)
+   {
+      int32_t i = alloc_hint + n < DATA_BLOCKS ? alloc_hint + n : alloc_hint + n - DATA_BLOCKS;
+      if ( block_refs[i] == 0 )
+      {
+         METRIC_ADD( alloc_search, n + 1 );
+         TRACE_END( "alloc", trace_start );
+         alloc_hint = i;
+         return i + FIRST_DATA_BLOCK;
+      }
+   }
+   METRIC_ADD( alloc_search, free_block_count > 0 ? DATA_BLOCKS : 0 );
+   TRACE_END( "alloc", trace_start );
+   return -1;
 
-				// Read num_bytes number of bytes from our data array into our output file.
+}
 
-				fseek( diskFile, offset, SEEK_SET );
-				fread( buffer, temp_num_bytes, 1, diskFile ); 
-				char *buff = &buffer[0];
-				while(*buff)
-				{
-					printf("%X", (uint32_t) *buff++);
-				}
-				printf("\n");
-
-				// Reduce the amount of bytes remaining to copy, increase the offset into the file
-				// and increment the block_index to move us to the next data block.
-				
-				if ( read_size + start_byte > file_inode.file_size )
-					read_size -= read_size;
-				else
-					read_size -= temp_num_bytes;
-				offset    += BLOCK_SIZE;
-				block_index = file_inode.blocks[++index_offset];
-
-				// Since we've copied from the point pointed to by our current file pointer, increment
-				// offset number of bytes so we will be ready to copy to the next area of our output file.
-			}
+// Takes a free data block, giving it its first reference, returns -1 if the disk is full
+int32_t allocBlock()
+{
+   int32_t block_index = findFreeBlock();
+   if ( block_index != -1 )
+   {
+      block_refs[block_index - FIRST_DATA_BLOCK] = 1;
+      free_block_count--;
+      METRIC_ADD( block_allocs, 1 );
+   }
+   return block_index;
 
-		        // Close the output file, we're done. 
-		        fclose( diskFile );
-		}
-	}
-	if(!found)
-		printf("ERROR: File not found.\n"); 
 }
 
-void retrieve(char* filename, char* newFilename)
+// Copies the contents of one data block over another
+void copyBlock( int32_t dst_block, int32_t src_block )
 {
-	uint8_t found = 0;
-	for( int i = 0; i < MAX_FILES; i++ )
-	{
-		if( !strcmp(directory[i].filename, filename))
-		{
-			found = 1;
-			struct inode file_inode = inodes[directory[i].inode];
-			FILE* newFile = fopen( newFilename, "w");
-			// Now, open the output file that we are going to write the data to.
-			if( newFile == NULL )
-			{
-				printf("Could not open output file: %s\n", filename );
-				perror("Opening output file returned");
-				return;
-			}
+   memcpy( data[dst_block], data[src_block], BLOCK_SIZE );
+   block_crcs[dst_block] = block_crcs[src_block];
 
-			// Initialize our offsets and pointers just we did above when reading from the file.
-			uint16_t inode_block_idx = 0;
-			uint32_t block_index = file_inode.blocks[inode_block_idx];
-			int32_t copy_size   = (int) file_inode.file_size;
-			uint32_t offset      = 0;
-
-			printf("Writing %d bytes to %s\n", (int) copy_size, newFilename );
-
-			// Using copy_size as a count to determine when we've copied enough bytes to the output file.
-			// Each time through the loop, except the last time, we will copy BLOCK_SIZE number of bytes from
-			// our stored data to the file fp, then we will increment the offset into the file we are writing to.
-			// On the last iteration of the loop, instead of copying BLOCK_SIZE number of bytes we just copy
-			// how ever much is remaining ( copy_size % BLOCK_SIZE ).  If we just copied BLOCK_SIZE on the
-			// last iteration we'd end up with gibberish at the end of our file. 
-			while( copy_size > 0 )
-			{ 
-				int num_bytes;
-
-				// If the remaining number of bytes we need to copy is less than BLOCK_SIZE then
-				// only copy the amount that remains. If we copied BLOCK_SIZE number of bytes we'd
-				// end up with garbage at the end of the file.
-				if( copy_size < BLOCK_SIZE )
-				{
-					num_bytes = copy_size;
-				}
-				else 
-				{
-					num_bytes = BLOCK_SIZE;
-				}
+}
 
-				// Write num_bytes number of bytes from our data array into our output file.
-				fwrite( data[block_index], num_bytes, 1, newFile ); 
+// Drops a reference to a data block, it is free once nothing refers to it
+void freeBlock( int32_t block_index )
+{
+   if ( --block_refs[block_index - FIRST_DATA_BLOCK] == 0 )
+   {
+      free_block_count++;
+      METRIC_ADD( block_frees, 1 );
+   }
 
-				// Reduce the amount of bytes remaining to copy, increase the offset into the file
-				// and increment the block_index to move us to the next data block.
-				copy_size -= BLOCK_SIZE;
-				offset    += BLOCK_SIZE;
-				block_index = file_inode.blocks[++inode_block_idx];
+}
 
+// Adds a reference to a data block, taking it out of the free blocks if it had none
+void shareBlock( int32_t block_index )
+{
+   if ( block_refs[block_index - FIRST_DATA_BLOCK]++ == 0 )
+   {
+      free_block_count--;
+   }
 
-				// Since we've copied from the point pointed to by our current file pointer, increment
-				// offset number of bytes so we will be ready to copy to the next area of our output file.
-				fseek( newFile, offset, SEEK_SET );
-			}
+}
 
-		        // Close the output file, we're done. 
-		        fclose( newFile );
-		}
-	}
-	if(!found)
-		printf("ERROR: File not found.\n"); 
+// Returns 1 if a snapshot holds the data block too, so it has to be copied before it changes
+int isShared( int32_t block_index )
+{
+   return IS_DATA_BLOCK( block_index ) && block_refs[block_index - FIRST_DATA_BLOCK] > 1;
 
 }
 
-void insert( char* filename)
+// Copy on write: moves one reference of a shared block over to a new copy of it, returns the
+// copy or -1 if the disk is full
+int32_t copyShared( int32_t block_index )
 {
-   // Verify filename isn't null
-   if (filename == NULL)
+   int32_t copy = allocBlock();
+   if ( copy != -1 )
    {
-      printf("ERROR: Filename is NULL.\n");
-      return;
+      copyBlock( copy, block_index );
+      freeBlock( block_index );
+      METRIC_ADD( cow_copies, 1 );
    }
+   return copy;
 
-   // verify the file exists
-   // read man page for stat for more details
-   struct stat buf;
-   int ret = stat( filename, &buf );
+}
 
-   if ( ret == -1 )
+// Recounts free_block_count after the block reference map has been loaded or rebuilt
+void countFreeBlocks()
+{
+   free_block_count = 0;
+   for (int i = 0; i < DATA_BLOCKS; i++)
    {
-      printf("ERROR: File does not exist.\n");
-      return;
+      free_block_count += block_refs[i] == 0;
    }
+   alloc_hint = 0;
 
-   // Verify file isn't too big (10MB Limit)
-   if ( buf.st_size > MAX_FILE_SIZE )
+}
+
+// Name: takeIndirectBlock
+// Parameters: indirect - pointer to an indirect block, or -1 if there isn't one yet
+// Returns: 0 on success, -1 if the disk is full
+// Description: Gets an indirect block ready to have pointers in it changed. A new one is
+//              taken with every pointer clear, and one a snapshot shares is copied.
+int takeIndirectBlock( int32_t *indirect )
+{
+   int32_t block_index;
+   if ( *indirect == -1 )
    {
-      printf("ERROR: File size is too large.\n");
-      return;
+      block_index = allocBlock();
+      if ( block_index != -1 )
+      {
+         memset( data[block_index], 0xFF, BLOCK_SIZE );
+      }
    }
-
-   // Verify the is enough space
-   if ( buf.st_size > df() )
+   else if ( isShared( *indirect ) )
    {
-      printf("ERROR: Not enough free disk sapce.\n");
-      return;
+      block_index = copyShared( *indirect );
    }
-
-   // Find empty directory entry
-   int directory_entry = -1;
-   for (int i = 0; i < MAX_FILES; i++)
+   else
    {
-      if (directory[i].in_use == 0)
-      {
-         directory_entry = i;
-         break;
-      }
+      return 0;
    }
 
-   if ( directory_entry == -1)
+   if ( block_index == -1 )
    {
-      printf("ERROR: Could not find a free directory entry.\n");
-      return;
+      return -1;
    }
+   *indirect = block_index;
+   return 0;
+}
 
-   // Open the input file read-only 
-    FILE *ifp = fopen ( filename, "r" ); 
-    printf("Reading %d bytes from %s\n", (int) buf . st_size, filename );
- 
-    // Save off the size of the input file since we'll use it in a couple of places and 
-    // also initialize our index variables to zero. 
-    int32_t copy_size   = buf . st_size;
-
-    // We want to copy and write in chunks of BLOCK_SIZE. So to do this 
-    // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
-    // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
-    int32_t offset      = 0;               
-
-    // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
-    // memory pool. Why? We are simulating the way the file system stores file data in
-    // blocks of space on the disk. block_index will keep us pointing to the area of
-    // the area that we will read from or write to.
-    int32_t block_index = -1;
-   
-   // Find a free inode
-   int32_t inode_index = findFreeInode();
-   if ( inode_index == -1 )
+// Name: setFileBlock
+// Parameters: file_inode - file to change, idx - block number in the file,
+//             block_index - block to put there, or -1 to clear it
+// Returns: 0 on success, -1 if an indirect block was needed and the disk is full
+// Description: Sets one block pointer of a file, taking an indirect block for it if the
+//              pointer doesn't have one yet, or copying the indirect block if a snapshot
+//              shares it. The double indirect block is taken or copied the same way when the
+//              indirect block listed in it changes.
+int setFileBlock( struct inode *file_inode, uint32_t idx, int32_t block_index )
+{
+   if ( idx < DIRECT_BLOCKS )
    {
-      printf("ERROR: Cannont find free inode.\n");
-      return;
+      file_inode->direct[idx] = block_index;
+      return 0;
    }
 
-   // Place the file into the directory
-   directory[directory_entry].in_use = 1;		// Mark File as in use
-   directory[directory_entry].inode = inode_index;	// Point to the correct block
-   strncpy(directory[directory_entry].filename, filename, strlen( filename )); // copy the filename into the directory entry
-
-   // Inode configurations
-   inodes[inode_index].file_size = buf.st_size; // mark the file size of the file
-   inodes[inode_index].in_use = 1;  // set the inode of the file in use
-   free_inodes[inode_index] = 0;  // update the free inode list
-   time_t t;
-   inodes[inode_index].t = time(&t);
-
-   // copy_size is initialized to the size of the input file so each loop iteration we
-   // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-   // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-   // we have copied all the data from the input file.
-   while( copy_size > 0 )
+   idx -= DIRECT_BLOCKS;
+   uint32_t k = idx / POINTERS_PER_BLOCK;
+   int32_t  indirect = indirectBlock( file_inode, k );
+   if ( indirect == -1 && block_index == -1 )
    {
-      fseek( ifp, offset, SEEK_SET );
- 
-      // Read BLOCK_SIZE number of bytes from the input file and store them in our
-      // data array. 
-
-      // Find a free block
-      block_index = findFreeBlock();
+      return 0;
+   }
 
-      if ( block_index == -1 )
+   if ( indirect == -1 || isShared( indirect ) )
+   {
+      if ( k >= INDIRECT_BLOCKS && takeIndirectBlock( &file_inode->double_indirect ) != 0 )
       {
-         printf("ERROR: Cannont find free block.\n");
-         return;
+         return -1;
       }
-      else 
+      if ( takeIndirectBlock( &indirect ) != 0 )
       {
-	      free_blocks[block_index-FIRST_DATA_BLOCK] = 0; // mark the block as in use
+         return -1;
       }
-
-      int32_t bytes  = fread( data[block_index], BLOCK_SIZE, 1, ifp );
-
-      //save the block in the inode
-      int32_t inode_block = findFreeInodeBlock( inode_index );
-      inodes[inode_index].blocks[inode_block] = block_index;
-
-
-      // If bytes == 0 and we haven't reached the end of the file then something is 
-      // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-      // It means we've reached the end of our input file.
-      if( bytes == 0 && !feof( ifp ) )
+      *indirectSlot( file_inode, k ) = indirect;
+      if ( k >= INDIRECT_BLOCKS )
       {
-        printf("ERROR: An error occured reading from the input file.\n");
-        return;
+         blockWritten( file_inode->double_indirect );
       }
+   }
 
-      // Clear the EOF file flag.
-      clearerr( ifp );
-
-      // Reduce copy_size by the BLOCK_SIZE bytes.
-      copy_size -= BLOCK_SIZE;
-      
-      // Increase the offset into our input file by BLOCK_SIZE.  This will allow
-      // the fseek at the top of the loop to position us to the correct spot.
-      offset    += BLOCK_SIZE;
-      
-      block_index = findFreeBlock();
-    }
-
-    // We are done copying from the input file so close it out.
-    fclose( ifp );
-
-   // find free inodes and place file
+   ( (int32_t *) data[indirect] )[idx % POINTERS_PER_BLOCK] = block_index;
+   blockWritten( indirect );
+   return 0;
 }
 
-// encryption
-void encryption(char *filename, int cipher)
+// Name: trimFileBlocks
+// Parameters: file_inode - file to change, block_count - number of blocks the file keeps,
+//             release - hand the blocks dropped back to the free block map
+// Returns: none
+// Description: Clears every block pointer from block_count on, along with the indirect blocks
+//              that no longer hold any, and the double indirect block if the file no longer
+//              reaches it. An indirect block a snapshot shares is copied before pointers in it
+//              are cleared. fsck clears pointers it can't trust without releasing them, it
+//              rebuilds the block reference map afterwards.
+void trimFileBlocks( struct inode *file_inode, uint32_t block_count, int release )
 {
-   
-   // Verify filename is valid and get the directory_index
-   int directory_index = -1;
+   // Slots in a double indirect block that is going anyway are left alone like the rest of it
+   int keep_double = block_count > DOUBLE_INDIRECT_FIRST;
+   int double_written = 0;
 
-   uint8_t valid= 0;
-   for (int i=0; i< MAX_FILES; i++)
+   for (uint32_t j = block_count; j < DIRECT_BLOCKS; j++)
    {
-    
-      if(strcmp(directory[i].filename, filename) == 0)
+      if ( release && IS_DATA_BLOCK( file_inode->direct[j] ) )
       {
-         directory_index = i;
-         valid = 1;
+         freeBlock( file_inode->direct[j] );
       }
+      file_inode->direct[j] = -1;
    }
-   if(valid == 0)
+
+   for (uint32_t k = 0; k < INDIRECT_SLOTS; k++)
+   {
+      uint32_t first = DIRECT_BLOCKS + k * POINTERS_PER_BLOCK;
+      int32_t  indirect = indirectBlock( file_inode, k );
+      if ( first + POINTERS_PER_BLOCK <= block_count || indirect == -1 )
       {
-         printf("ERROR: Filename does not exist.\n");
-         return;
+         continue;
       }
-  
-   // Verify cipher is valid
-   if (cipher > 256 || cipher < 0)
-   {
-      printf("ERROR: Cipher must be between 0 and 255.\n");
-      return;
-   }
 
+      int32_t *slot = NULL;
+      if ( k < INDIRECT_BLOCKS )
+      {
+         slot = &file_inode->indirect[k];
+      }
+      else if ( keep_double )
+      {
+         if ( release && isShared( file_inode->double_indirect ) )
+         {
+            int32_t copy = copyShared( file_inode->double_indirect );
+            if ( copy == -1 )
+            {
+               break;
+            }
+            file_inode->double_indirect = copy;
+         }
+         slot = indirectSlot( file_inode, k );
+         double_written = 1;
+      }
 
-   // get the inode_index from the directory entry
-   int32_t inode_index = directory[directory_index].inode;
+      if ( !IS_DATA_BLOCK( indirect ) )
+      {
+         if ( slot )
+         {
+            *slot = -1;
+         }
+         continue;
+      }
 
-   // get the file_size from the inode
-   int32_t file_size = inodes[inode_index].file_size;
+      uint32_t keep = block_count > first ? block_count - first : 0;
+      int32_t *pointers = (int32_t *) data[indirect];
+      if ( keep == 0 )
+      {
+         // The whole indirect block goes. Its contents are left alone, a snapshot (or for fsck
+         // another file) may still be using it.
+         if ( release )
+         {
+            for (uint32_t j = 0; j < POINTERS_PER_BLOCK; j++)
+            {
+               if ( IS_DATA_BLOCK( pointers[j] ) )
+               {
+                  freeBlock( pointers[j] );
+               }
+            }
+            freeBlock( indirect );
+         }
+         if ( slot )
+         {
+            *slot = -1;
+         }
+         continue;
+      }
 
+      uint32_t set = keep;
+      while ( set < POINTERS_PER_BLOCK && pointers[set] == -1 )
+      {
+         set++;
+      }
+      if ( set == POINTERS_PER_BLOCK )
+      {
+         // Nothing past the end to clear, don't copy or rewrite the block for nothing
+         continue;
+      }
 
-   // get the number of blocks from the file_size using mod 1024
-   int32_t number_of_blocks = file_size/1024;
-   int leftover = 0;
-   //get the left over bytes from the file_size , then leftover = file_size-(number_of_blocks*1024)
-   if (file_size%1024 != 0)
-   {
-      leftover = file_size - (number_of_blocks*1024);
-   }
+      if ( release && isShared( indirect ) )
+      {
+         indirect = copyShared( indirect );
+         if ( indirect == -1 )
+         {
+            continue;
+         }
+         *slot = indirect;
+         pointers = (int32_t *) data[indirect];
+      }
 
-   
-   for (int i=0; i< number_of_blocks; i++)
-   {
-      for (int j=0; j<1024; j++)
+      for (uint32_t j = keep; j < POINTERS_PER_BLOCK; j++)
       {
-         data[inodes[inode_index].blocks[i]][j] = data[inodes[inode_index].blocks[i]][j] ^ cipher;
+         if ( release && IS_DATA_BLOCK( pointers[j] ) )
+         {
+            freeBlock( pointers[j] );
+         }
+         pointers[j] = -1;
       }
-      
+      blockWritten( indirect );
    }
-   if(leftover != 0)
+
+   if ( double_written )
    {
-      for (int i=0; i< leftover; i++)
+      blockWritten( file_inode->double_indirect );
+   }
+   if ( !keep_double && file_inode->double_indirect != -1 )
+   {
+      if ( release && IS_DATA_BLOCK( file_inode->double_indirect ) )
       {
-         data[inodes[inode_index].blocks[number_of_blocks]][i] = data[inodes[inode_index].blocks[number_of_blocks]][i] ^ cipher;
+         freeBlock( file_inode->double_indirect );
       }
+      file_inode->double_indirect = -1;
    }
 }
 
-// decryption
-void decryption(char *filename, int cipher)
+// Name: walkFileBlocks
+// Parameters: file_inode - file to walk, fn - called with each block number and arg
+// Returns: none
+// Description: Calls fn on every block a file holds, data, indirect and double indirect
+//              blocks, the same ones trimFileBlocks would release.
+void walkFileBlocks( struct inode *file_inode, void (*fn)( int32_t, void * ), void *arg )
 {
-   
-   // Verify filename is valid and get the directory_index
-   int directory_index = -1;
-
-   uint8_t valid= 0;
-   for (int i=0; i< MAX_FILES; i++)
+   for (int j = 0; j < DIRECT_BLOCKS; j++)
    {
-    
-      if(strcmp(directory[i].filename, filename) == 0)
+      if ( IS_DATA_BLOCK( file_inode->direct[j] ) )
       {
-         directory_index = i;
-         valid = 1;
+         fn( file_inode->direct[j], arg );
       }
    }
-   if(valid == 0)
+
+   for (uint32_t k = 0; k < INDIRECT_SLOTS; k++)
+   {
+      int32_t indirect = indirectBlock( file_inode, k );
+      if ( !IS_DATA_BLOCK( indirect ) )
       {
-         printf("ERROR: Filename does not exist.\n");
-         return;
+         continue;
       }
-  
-   // Verify cipher is valid
-   if (cipher > 256 || cipher < 0)
-   {
-      printf("ERROR: Cipher must be between 0 and 255.\n");
-      return;
-   }
 
+      int32_t *pointers = (int32_t *) data[indirect];
+      for (int j = 0; j < POINTERS_PER_BLOCK; j++)
+      {
+         if ( IS_DATA_BLOCK( pointers[j] ) )
+         {
+            fn( pointers[j], arg );
+         }
+      }
+      fn( indirect, arg );
+   }
 
-   // get the inode_index from the directory entry
-   int32_t inode_index = directory[directory_index].inode;
+   if ( IS_DATA_BLOCK( file_inode->double_indirect ) )
+   {
+      fn( file_inode->double_indirect, arg );
+   }
 
-   // get the file_size from the inode
-   int32_t file_size = inodes[inode_index].file_size;
+}
 
+// Name: sharedBlocks
+// Parameters: file_inode - file about to change, first - first block number in the file that
+//             changes, last - one past the last
+// Returns: number of blocks copy on write takes to change them in place: each one a snapshot
+//          shares, and each shared indirect or double indirect block pointing at them
+uint32_t sharedBlocks( struct inode *file_inode, uint32_t first, uint32_t last )
+{
+   uint32_t block_count = BLOCKS_FOR_SIZE( file_inode->file_size );
+   uint32_t shared = 0;
 
-   // get the number of blocks from the file_size using mod 1024
-   int32_t number_of_blocks = file_size/1024;
-   int leftover = 0;
-   //get the left over bytes from the file_size , then leftover = file_size-(number_of_blocks*1024)
-   if (file_size%1024 != 0)
-   {
-      leftover = file_size - (number_of_blocks*1024);
-   }
-
-   
-   for (int i=0; i< number_of_blocks; i++)
+   for (uint32_t j = first; j < last && j < block_count; j++)
    {
-      for (int j=0; j<1024; j++)
+      shared += isShared( fileBlock( file_inode, j ) );
+      if ( j >= DIRECT_BLOCKS && ( j == first || ( j - DIRECT_BLOCKS ) % POINTERS_PER_BLOCK == 0 ) )
       {
-         data[inodes[inode_index].blocks[i]][j] = data[inodes[inode_index].blocks[i]][j] ^ cipher;
+         uint32_t k = ( j - DIRECT_BLOCKS ) / POINTERS_PER_BLOCK;
+         shared += isShared( indirectBlock( file_inode, k ) );
       }
-      
-   }
-   if(leftover != 0)
-   {
-      for (int i=0; i< leftover; i++)
+      if ( j == ( first > DOUBLE_INDIRECT_FIRST ? first : DOUBLE_INDIRECT_FIRST ) )
       {
-         data[inodes[inode_index].blocks[number_of_blocks]][i] = data[inodes[inode_index].blocks[number_of_blocks]][i] ^ cipher;
+         shared += isShared( file_inode->double_indirect );
       }
    }
+   return shared;
 }
 
+// Name: writableFileBlock
+// Parameters: file_inode - file about to change, idx - block number in the file
+// Returns: the block to change in place
+// Description: A block a snapshot shares is copied first and the file moved over to the
+//              copy, so the snapshot keeps the old contents. The caller reserves the blocks
+//              this can take with sharedBlocks.
+int32_t writableFileBlock( struct inode *file_inode, uint32_t idx )
+{
+   int32_t block_index = fileBlock( file_inode, idx );
+   if ( !isShared( block_index ) )
+   {
+      return block_index;
+   }
 
-//-------------------------------------------------------------------------------------------------
-// Main 
-// ------------------------------------------------------------------------------------------------
+   int32_t copy = copyShared( block_index );
+   setFileBlock( file_inode, idx, copy );
+   return copy;
+}
 
-int main()
+// Empties an inode's block map for a new file
+void clearFileBlocks( struct inode *file_inode )
 {
+   for (int j = 0; j < DIRECT_BLOCKS; j++)
+   {
+      file_inode->direct[j] = -1;
+   }
+   for (int k = 0; k < INDIRECT_BLOCKS; k++)
+   {
+      file_inode->indirect[k] = -1;
+   }
+   file_inode->double_indirect = -1;
 
-   char * command_string = ( char* ) malloc( MAX_COMMAND_SIZE );
+}
 
-   fp = NULL;
-   
-   init();
-   
-   while( 1 )
+// FNV-1a hash of the first length bytes of a name, seeded with the directory it is in
+uint32_t nameHash( int32_t parent, const char *name, size_t length )
+{
+   uint32_t hash = ( 2166136261u ^ (uint32_t) parent ) * 16777619u;
+   for (size_t i = 0; i < length; i++)
    {
-      // Print out the msh prompt
-      printf ("mfs> ");
+      hash = ( hash ^ (uint8_t) name[i] ) * 16777619u;
+   }
+   return hash;
 
-       // Read the command from the commandline.  The
-       // maximum command that will be read is MAX_COMMAND_SIZE
-      // This while command will wait here until the user
-      // inputs something since fgets returns NULL when there
-      // is no input
+}
 
-      fflush( stdin );
-      while( !fgets (command_string, MAX_COMMAND_SIZE, stdin) );
-         
-      /* Parse input */
-      char *token[MAX_NUM_ARGUMENTS];
+// Hash of a directory entry's parent and name
+uint32_t entryHash( int32_t directory_index )
+{
+   return nameHash( directory[directory_index].parent, filenames[directory_index],
+                    strnlen( filenames[directory_index], MAX_FILENAME ) );
 
-      for( int i = 0; i < MAX_NUM_ARGUMENTS; i++ )
-      {
-         token[i] = NULL;
-      }
+}
+
+// Adds an in use directory entry to the name index
+void nameIndexAdd( int32_t directory_index )
+{
+   uint32_t slot = entryHash( directory_index ) & name_index_mask;
+   while ( name_index[slot] != -1 )
+   {
+      slot = ( slot + 1 ) & name_index_mask;
+   }
+   name_index[slot] = directory_index;
 
-      int   token_count = 0;                                 
-                                                            
-      // Pointer to point to the token
-      // parsed by strsep
-      char *argument_ptr = NULL;                                         
-                                                            
-      char *working_string  = strdup( command_string );                
+}
 
-      if ((working_string[0] == '\n') || (working_string[0] == '\0') || (working_string == NULL))
+// Takes a directory entry out of the name index, its name must not have changed yet
+void nameIndexRemove( int32_t directory_index )
+{
+   uint32_t slot = entryHash( directory_index ) & name_index_mask;
+   while ( name_index[slot] != directory_index )
+   {
+      if ( name_index[slot] == -1 )
       {
-         continue;
+         return;
       }
-      
-      // we are going to move the working_string pointer so
-      // keep track of its original value so we can deallocate
-      // the correct amount at the end
-      char *head_ptr = working_string;
+      slot = ( slot + 1 ) & name_index_mask;
+   }
 
-      // Tokenize the input strings with whitespace used as the delimiter
-      while ( ((argument_ptr = strsep(&working_string, WHITESPACE))!= NULL) && 
-               (token_count<MAX_NUM_ARGUMENTS))
+   // Move later entries of the same probe run back into the hole, so lookups that passed
+   // through it still find them
+   uint32_t hole = slot;
+   for (uint32_t next = ( hole + 1 ) & name_index_mask; name_index[next] != -1;
+        next = ( next + 1 ) & name_index_mask)
+   {
+      uint32_t home = entryHash( name_index[next] ) & name_index_mask;
+      if ( ( ( next - home ) & name_index_mask ) >= ( ( next - hole ) & name_index_mask ) )
       {
-         token[token_count] = strndup( argument_ptr, MAX_COMMAND_SIZE );
-         if( strlen( token[token_count] ) == 0 )
-         {
-         token[token_count] = NULL;
-         }
-         token_count++;
+         name_index[hole] = name_index[next];
+         hole = next;
       }
+   }
+   name_index[hole] = -1;
 
-      // Process filesystem commands
+}
 
-      // "createfs"
-      if ( token[0] != NULL && !(strcmp(token[0], "createfs")) )
-      {
-         if (token[1] == NULL)
-         {
-            printf("ERROR: No disk image name specified.\n");
-            continue;
-         }
-         createfs( token[1] );
-      }
+// Rebuilds the name index from the directory, sized for the current number of file slots.
+// Whatever changed the directory this much may have moved directories, so the dentry cache
+// is dropped too.
+void nameIndexBuild()
+{
+   dentry_generation++;
 
-      // "savefs"
-      if ( token[0] != NULL && !(strcmp(token[0], "savefs")) )
-      {
-         savefs( );
-      }
-      
-      // "open"
-      if ( token[0] != NULL && !(strcmp(token[0], "open")) )
-      {
-         if (token[1] == NULL)
-         {
-            printf("ERROR: No disk image name specified.\n");
-            continue;
-         }
-         openfs( token[1] );
-      }
+   uint32_t size = 1;
+   while ( size < 2 * file_slots )
+   {
+      size <<= 1;
+   }
+
+   free( name_index );
+   name_index = malloc( size * sizeof(int32_t) );
+   name_index_mask = size - 1;
+   memset( name_index, 0xFF, size * sizeof(int32_t) );
 
-      // "close"
-      if ( token[0] != NULL && !(strcmp(token[0], "close")) )
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( directory[i].in_use )
       {
-         closefs( );
+         nameIndexAdd( i );
       }
+   }
 
-            // "list"
-      if ( token[0] != NULL && !(strcmp(token[0], "list")) )
-      {
-         if ( !image_open )
-         {
-            printf("ERROR: Disk image is not open.\n");
-            continue;
-         }
+}
 
-         if (token[1] == NULL)
-         {
-            list();
-            continue;
-         }
+// Name: takeTableBlocks
+// Parameters: slots - number of directory entries and inodes the tables will hold
+// Returns: 0 on success, -1 if there is no room for the table blocks
+// Description: Takes the extra blocks the tables need to be stored in from the data area and
+//              adds them to the table map.
+int takeTableBlocks( uint32_t slots )
+{
+   int32_t have = TABLE_BLOCKS( file_slots );
+   int32_t need = TABLE_BLOCKS( slots );
 
-         if ( !(strcmp(token[1], "-h")) )
-         {
-            list_hidden();
-            continue;
-         }
+   if ( (uint32_t) ( need - have ) > free_block_count )
+   {
+      return -1;
+   }
 
-         else if ( !( strcmp(token[1], "-a")) )
-         {
-            list_attribute();
-            continue;
-         }
+   for (int32_t b = have; b < need; b++)
+   {
+      table_map[b] = allocBlock();
+      memset( data[table_map[b]], 0, BLOCK_SIZE );
+      blockWritten( table_map[b] );
+   }
+   return 0;
+}
 
-         else
-         {
-            list();
-            continue;
-         }
+// realloc for the tables whose entries are one cache line each, the copy keeps them aligned
+// to one so no entry straddles two
+void *reallocAligned( void *table, size_t old_size, size_t new_size )
+{
+   void *grown = aligned_alloc( CACHE_LINE, new_size );
+   if ( table != NULL )
+   {
+      memcpy( grown, table, old_size < new_size ? old_size : new_size );
+      free( table );
+   }
+   return grown;
+}
+
+// Grows the in memory directory, name table, inode table and free inode map to slots entries,
+// the new entries start out free
+void resizeTables( uint32_t slots )
+{
+   directory   = realloc( directory, slots * sizeof(struct directoryEntry) );
+   filenames   = reallocAligned( filenames, (size_t) file_slots * MAX_FILENAME,
+                                 (size_t) slots * MAX_FILENAME );
+   inodes      = reallocAligned( inodes, (size_t) file_slots * sizeof(struct inode),
+                                 (size_t) slots * sizeof(struct inode) );
+   free_inodes = realloc( free_inodes, slots );
+
+   for (uint32_t i = file_slots; i < slots; i++)
+   {
+      memset( &directory[i], 0, sizeof(struct directoryEntry) );
+      directory[i].inode = -1;
+      directory[i].parent = ROOT_DIRECTORY;
+      memset( filenames[i], 0, MAX_FILENAME );
+
+      memset( &inodes[i], 0, sizeof(struct inode) );
+      clearFileBlocks( &inodes[i] );
+      free_inodes[i] = 1;
+   }
+
+   file_slots = slots;
+   nameIndexBuild();
+}
+
+// Doubles the directory and inode table when every entry is taken, returns -1 if it can't
+int growTables()
+{
+   uint32_t slots = file_slots * 2 < MAX_FILES ? file_slots * 2 : MAX_FILES;
+   if ( file_slots >= MAX_FILES || takeTableBlocks( slots ) != 0 )
+   {
+      return -1;
+   }
+   resizeTables( slots );
+   return 0;
+}
+
+// Name: copyTableBlocks
+// Parameters: map - the table blocks, ino, dir, names and inode_map - the inode table,
+//             directory, name table and free inode map, any of them NULL to skip it,
+//             slots - entries in each, store - 1 to store the tables into the blocks, 0 to load
+//             them
+// Returns: none
+// Description: The inode table, the directory, the name table and the free inode map sit back
+//              to back in the table blocks, in the order map lists the blocks. The live tables
+//              and every snapshot are laid out this way. slots is a multiple of
+//              FIRST_FILE_SLOTS, so the inodes and the names both start on a block boundary and
+//              none of them straddles two blocks.
+void copyTableBlocks( const int32_t *map, struct inode *ino, struct directoryEntry *dir,
+                      char (*names)[MAX_FILENAME], uint8_t *inode_map, uint32_t slots, int store )
+{
+   struct
+   {
+      uint8_t *bytes;
+      size_t   len;
+   } parts[] =
+   {
+      { (uint8_t *) ino,   slots * sizeof(struct inode) },
+      { (uint8_t *) dir,   slots * sizeof(struct directoryEntry) },
+      { (uint8_t *) names, slots * MAX_FILENAME },
+      { inode_map,         slots }
+   };
+   size_t pos = 0;
+
+   for (int p = 0; p < 4; p++)
+   {
+      if ( parts[p].bytes == NULL )
+      {
+         pos += parts[p].len;
+         continue;
       }
 
-      // "attrib"
-      if ( token[0] != NULL && !(strcmp(token[0], "attrib")) )
+      for (size_t done = 0; done < parts[p].len; )
       {
-         if ( !image_open )
+         uint8_t *block = &data[map[pos / BLOCK_SIZE]][pos % BLOCK_SIZE];
+         size_t   n = BLOCK_SIZE - pos % BLOCK_SIZE;
+         if ( n > parts[p].len - done )
          {
-            printf("ERROR: Disk image is not open.\n");
-            continue;
+            n = parts[p].len - done;
          }
 
-         if ( token[1] == NULL)
+         if ( store )
          {
-            printf("ERROR: Attribute not specified.\n");
-            continue;
+            memcpy( block, parts[p].bytes + done, n );
          }
-
-         if ( token[2] == NULL)
+         else
          {
-            printf("ERROR: Filename not specified.\n");
-            continue;
+            memcpy( parts[p].bytes + done, block, n );
          }
-
-         attribute(token[1], token[2]);
+         pos  += n;
+         done += n;
       }
+   }
 
-      // "df"
-      if ( token[0] != NULL && !(strcmp(token[0], "df")) )
+   if ( store )
+   {
+      for (int32_t b = 0; b < TABLE_BLOCKS( slots ); b++)
       {
-         if ( !image_open )
-         {
-            printf("ERROR: Disk image is not open.\n");
-            continue;
-         }
-
-         
-         printf("%d bytes free\n", df() );
+         blockWritten( map[b] );
       }
+   }
 
-       // "quit"
-      if ( token[0] != NULL && !(strcmp(token[0], "quit")) )
-      {
-         _exit(0);
-      }
+}
 
-      // "insert"
-      if ( token[0] != NULL && !(strcmp(token[0], "insert")) )
-      {
-         if ( !image_open)
-         {
-            printf("ERROR: Disk image not open.\n");
-            continue;
-         }
+// Name: copyTables
+// Parameters: store - 1 to store the tables into their blocks in the image, 0 to load them
+// Returns: none
+// Description: Copies the live inode table, directory, name table and free inode map to or
+//              from the blocks the table map lists.
+void copyTables( int store )
+{
+   copyTableBlocks( table_map, inodes, directory, filenames, free_inodes, file_slots, store );
 
-         if (token[1] == NULL)
-         {
-            printf("ERROR: No filename specified.\n");
-            continue;
-         }
+   if ( store )
+   {
+      super->magic      = MFS_MAGIC;
+      super->version    = MFS_VERSION;
+      super->file_slots = file_slots;
+      super->trash_seq  = trash_seq;
+   }
 
-         insert ( token[1] );
-      }
+}
 
-      // "retrieve"
-      if ( token[0] != NULL && !(strcmp(token[0], "retrieve")) )
-      {
-         if ( !image_open)
-         {
-            printf("ERROR: Disk image not open.\n");
-            continue;
-         }
+// Returns 1 if the unused directory entry holds a deleted file that can still be undeleted
+int inTrash( int32_t directory_index )
+{
+   int32_t inode_index = directory[directory_index].inode;
+   return !directory[directory_index].in_use && inode_index >= 0 &&
+          (uint32_t) inode_index < file_slots &&
+          inodes[inode_index].trashed != 0;
 
-         if (token[1] == NULL)
-         {
-            printf("ERROR: No filename specified.\n");
-            continue;
-         }
-	      
-         if (token[2] == NULL)
-         	retrieve ( token[1], token[1] );
-	      
-         else 
-		      retrieve( token[1], token[2] );
-      }
+}
 
-      // "read"
-      if ( token[0] != NULL && !(strcmp(token[0], "read")) )
+// Returns the directory index of the file that has been in the trash longest, or -1
+int32_t oldestTrash()
+{
+   int32_t  oldest = -1;
+   uint32_t oldest_seq = UINT32_MAX;
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( inTrash( i ) && inodes[directory[i].inode].trashed < oldest_seq )
       {
-         if ( !image_open)
-         {
-            printf("ERROR: Disk image not open.\n");
-            continue;
-         }
-
-         if (token[1] == NULL)
-         {
-            printf("ERROR: No filename specified.\n");
-            continue;
-         }
-	 
-         if (token[2] == NULL)
-         {
-            printf("ERROR: No start byte specified.\n");
-            continue;
-         }
-      
-         if (token[3] == NULL)
-         {
-            printf("ERROR: No start byte specified.\n");
-            continue;
-         }
-         
-         readDisk(token[1], atoi(token[2]), atoi(token[3]));
+         oldest = i;
+         oldest_seq = inodes[directory[i].inode].trashed;
       }
+   }
+   return oldest;
 
-      // encryption
-      if ( token[0] != NULL && !(strcmp(token[0], "encrypt")) )
-      {
-         if ( !image_open)
-         {
-            printf("ERROR: Disk image not open.\n");
-            continue;
-         }
-
-         if (token[1] == NULL)
-         {
-            printf("ERROR: No filename specified.\n");
-            continue;
-         }
-         printf("%s\n", token[1]);
+}
 
-         if (token[2] == NULL)
-         {
-            printf("ERROR: No cipher specified.\n");
-            continue;
-         }
+// walkFileBlocks callback counting the blocks that nothing but this file refers to
+void countOwnBlock( int32_t block_index, void *count )
+{
+   *(uint32_t *) count += block_refs[block_index - FIRST_DATA_BLOCK] == 1;
 
-         int cipher = atoi(token[2]);
-         encryption( token[1], cipher );
-      }
+}
 
-      // decryption
-      if ( token[0] != NULL && !(strcmp(token[0], "decrypt")) )
+// Returns the number of bytes of data blocks that reclaiming the trash would free. Blocks a
+// snapshot still holds stay in use.
+uint32_t reclaimable()
+{
+   uint32_t blocks = 0;
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( inTrash( i ) )
       {
-         if ( !image_open)
-         {
-            printf("ERROR: Disk image not open.\n");
-            continue;
-         }
+         walkFileBlocks( &inodes[directory[i].inode], countOwnBlock, &blocks );
+      }
+   }
+   return blocks * BLOCK_SIZE;
 
-         if (token[1] == NULL)
-         {
-            printf("ERROR: No filename specified.\n");
-            continue;
-         }
-         printf("%s\n", token[1]);
+}
 
-         if (token[2] == NULL)
-         {
-            printf("ERROR: No cipher specified.\n");
-            continue;
-         }
-         int cipher = atoi(token[2]);
-         decryption( token[1], cipher );
-      }
+// Permanently frees one deleted file: its data blocks, its inode and its directory entry
+void reclaimEntry( int32_t directory_index )
+{
+   struct inode *file_inode = &inodes[directory[directory_index].inode];
 
-      // "delete"
-      if ( token[0] != NULL && !(strcmp(token[0], "delete")) )
-      {
-         if ( !image_open)
-         {
-            printf("ERROR: Disk image not open.\n");
-            continue;
-         }
+   trimFileBlocks( file_inode, 0, 1 );
+   file_inode->file_size = 0;
+   file_inode->trashed = 0;
+   free_inodes[directory[directory_index].inode] = 1;
 
-         if (token[1] == NULL)
-         {
-            printf("ERROR: No filename specified.\n");
-            continue;
-         }
+   directory[directory_index].inode = -1;
+   memset( filenames[directory_index], 0, MAX_FILENAME );
 
-         delete ( token[1] );
-      }
+}
 
-      // "undel"
-      if ( token[0] != NULL && !(strcmp(token[0], "undel")) )
-      {
-         if ( !image_open)
-         {
-            printf("ERROR: Disk image not open.\n");
-            continue;
-         }
+// Name: reclaimTrash
+// Parameters: min_blocks - data blocks to free before stopping
+// Returns: number of files reclaimed
+// Description: Permanently frees deleted files, oldest first, until at least min_blocks data
+//              blocks have come back or the trash is empty. At least one file is reclaimed so
+//              the call also frees up a directory entry and an inode.
+int32_t reclaimTrash( uint32_t min_blocks )
+{
+   uint32_t freed = 0;
+   int32_t  files = 0;
+   int32_t  directory_index;
 
-         if (token[1] == NULL)
-         {
-            printf("ERROR: No filename specified.\n");
-            continue;
-         }
+   while ( ( files == 0 || freed < min_blocks ) && ( directory_index = oldestTrash() ) != -1 )
+   {
+      uint32_t free_before = free_block_count;
+      reclaimEntry( directory_index );
+      freed += free_block_count - free_before;
+      files++;
+   }
+   return files;
 
-         undel ( token[1] );
-      } 
+}
 
-      // Cleanup allocated memory
-      for( int i = 0; i < MAX_NUM_ARGUMENTS; i++ )
+// Returns a free inode, growing the inode table if they are all taken, or -1. Like the block
+// search it starts from the last one found.
+int32_t findFreeInode()
+{
+   for (uint32_t n = 0; n < file_slots; n++)
+   {
+      int32_t i = ( inode_hint + n ) % file_slots;
+      if ( free_inodes[i] )
       {
-         if( token[i] != NULL )
-         {
-         free( token[i] );
-         }
+         inode_hint = i;
+         return i;
       }
-
-      free( head_ptr );
-
    }
 
-  free( command_string );
+   uint32_t first_new = file_slots;
+   return growTables() == 0 ? (int32_t) first_new : -1;
 
-  return 0;
-  // e2520ca2-76f3-90d6-0242ac120003
 }
+
+// Returns the directory index of the in use entry in the directory parent whose name is the
+// first length bytes of name, or -1
+int32_t findChild( int32_t parent, const char *name, size_t length )
+{
+   if ( length == 0 || length >= MAX_FILENAME )
+   {
+      return -1;
+   }
+
+   for (uint32_t slot = nameHash( parent, name, length ) & name_index_mask;
+        name_index[slot] != -1; slot = ( slot + 1 ) & name_index_mask)
+   {
+      char *entry_name = filenames[name_index[slot]];
+      if ( directory[name_index[slot]].parent == parent && !memcmp( entry_name, name, length ) &&
+           entry_name[length] == 0 )
+      {
+         return name_index[slot];
+      }
+   }
+   return -1;
+
+}
+
+// Returns 1 if the directory entry is a directory rather than a file
+int isDirectory( int32_t directory_index )
+{
+   return ( inodes[directory[directory_index].inode].attribute & DIRECTORY ) != 0;
+
+}
+
+// Name: resolveParent
+// Parameters: path - slash separated path of a file or directory, leaf - set to the part of
+//             the path after the last slash
+// Returns: directory index of the directory the leaf is in, ROOT_DIRECTORY for the top of the
+//          tree, or NO_DIRECTORY if a directory on the way does not exist
+// Description: Walks the directory part of the path one component at a time through the name
+//              index, then remembers where it ended in the dentry cache. The next path in the
+//              same directory, however deep, costs one cache probe instead of a walk. Leading
+//              and repeated slashes are ignored.
+int32_t resolveParent( const char *path, const char **leaf )
+{
+   while ( *path == '/' )
+   {
+      path++;
+   }
+
+   const char *slash = strrchr( path, '/' );
+   if ( slash == NULL )
+   {
+      *leaf = path;
+      return ROOT_DIRECTORY;
+   }
+   *leaf = slash + 1;
+
+   size_t length = slash - path;
+   struct dentry *cached = &dentry_cache[nameHash( ROOT_DIRECTORY, path, length ) &
+                                         ( DENTRY_CACHE_SIZE - 1 )];
+   METRIC_ADD( path_lookups, 1 );
+   if ( cached->generation == dentry_generation && cached->length == length &&
+        !memcmp( cached->path, path, length ) )
+   {
+      METRIC_ADD( cache_hits, 1 );
+      return cached->directory_index;
+   }
+
+   int32_t parent = ROOT_DIRECTORY;
+   for (const char *name = path; name < slash; )
+   {
+      const char *end = memchr( name, '/', slash - name );
+      if ( end == NULL )
+      {
+         end = slash;
+      }
+
+      if ( end > name )
+      {
+         parent = findChild( parent, name, end - name );
+         if ( parent == -1 || !isDirectory( parent ) )
+         {
+            return NO_DIRECTORY;
+         }
+      }
+      name = end + 1;
+   }
+
+   if ( length < DENTRY_PATH_MAX )
+   {
+      cached->generation = dentry_generation;
+      cached->directory_index = parent;
+      cached->length = length;
+      memcpy( cached->path, path, length );
+   }
+   return parent;
+
+}
+
+// Returns the directory index of the in use file or directory at path, or -1
+int32_t findDirectoryEntry( char *filename )
+{
+   TRACE_START( trace_start );
+   const char *leaf;
+   int32_t parent = resolveParent( filename, &leaf );
+   int32_t directory_index = parent == NO_DIRECTORY ? -1 : findChild( parent, leaf, strlen( leaf ) );
+   TRACE_END( "lookup", trace_start );
+   return directory_index;
+
+}
+
+// Returns the directory index of the in use file at path, or -1 if there is none or it is a
+// directory
+int32_t findFile( char *path )
+{
+   int32_t directory_index = findDirectoryEntry( path );
+   return directory_index != -1 && !isDirectory( directory_index ) ? directory_index : -1;
+
+}
+
+// Name: checkNewPath
+// Parameters: path - where a new file or directory is to go, leaf - set to its name
+// Returns: directory index of the directory it goes in, ROOT_DIRECTORY for the top of the
+//          tree, or NO_DIRECTORY after printing why nothing can be created there
+int32_t checkNewPath( char *path, const char **leaf )
+{
+   int32_t parent = resolveParent( path, leaf );
+   size_t  length = strlen( *leaf );
+
+   if ( length >= MAX_FILENAME )
+   {
+      printf("insert error: File name too long.\n");
+      return NO_DIRECTORY;
+   }
+   if ( parent == NO_DIRECTORY )
+   {
+      printf("ERROR: The directory for %s does not exist.\n", path);
+      return NO_DIRECTORY;
+   }
+   if ( length == 0 )
+   {
+      printf("ERROR: %s does not end in a name.\n", path);
+      return NO_DIRECTORY;
+   }
+   if ( findChild( parent, *leaf, length ) != -1 )
+   {
+      printf("ERROR: %s already exists.\n", path);
+      return NO_DIRECTORY;
+   }
+   return parent;
+
+}
+
+// Returns a free directory entry, growing the directory if they are all taken, or -1
+int32_t findFreeDirectoryEntry()
+{
+   for (uint32_t n = 0; n < file_slots; n++)
+   {
+      int32_t i = ( entry_hint + n ) % file_slots;
+      if ( directory[i].in_use == 0 && !inTrash( i ) )
+      {
+         entry_hint = i;
+         return i;
+      }
+   }
+
+   uint32_t first_new = file_slots;
+   return growTables() == 0 ? (int32_t) first_new : -1;
+
+}
+
+// Name: mapAnonymous
+// Parameters: image_size - bytes to map, a multiple of HUGE_PAGE_SIZE
+// Returns: the zero filled mapping, or MAP_FAILED
+// Description: Inserts and retrieves touch the image all over, so with 4 KiB pages most block
+//              accesses miss the TLB. With huge_pages set this first tries hugetlb pages, which
+//              only works if the administrator has reserved some, and otherwise maps the image
+//              on a huge page boundary with MADV_HUGEPAGE so transparent huge pages can back it.
+//              With huge_pages clear the image is kept on 4 KiB pages.
+void *mapAnonymous( size_t image_size )
+{
+   int prot = PROT_READ | PROT_WRITE;
+
+   if ( huge_pages )
+   {
+      void *image = mmap( NULL, image_size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                          -1, 0 );
+      METRIC_SYSCALL();
+      if ( image != MAP_FAILED )
+      {
+         image_pages = IMAGE_PAGES_HUGETLB;
+         return image;
+      }
+   }
+
+   // Map a huge page more than needed and trim both ends so the image starts on a boundary
+   size_t   span = image_size + HUGE_PAGE_SIZE;
+   uint8_t *region = mmap( NULL, span, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+   METRIC_SYSCALL();
+   if ( region == MAP_FAILED )
+   {
+      return MAP_FAILED;
+   }
+
+   uint8_t *image = (uint8_t *) ( ( (uintptr_t) region + HUGE_PAGE_SIZE - 1 ) &
+                                  ~( (uintptr_t) HUGE_PAGE_SIZE - 1 ) );
+   if ( image > region )
+   {
+      munmap( region, image - region );
+   }
+   munmap( image + image_size, region + span - ( image + image_size ) );
+
+   int advised = madvise( image, image_size, huge_pages ? MADV_HUGEPAGE : MADV_NOHUGEPAGE );
+   METRIC_ADD( syscalls, 3 );
+   image_pages = huge_pages && advised == 0 ? IMAGE_PAGES_TRANSPARENT : IMAGE_PAGES_SMALL;
+   return image;
+}
+
+// Name: mapImage
+// Parameters: fd - image file to map, or -1 for an empty image
+// Returns: 0 on success, -1 if the image could not be mapped or read (errno is left set)
+// Description: Replaces data with a new mapping of the whole image. A full size image file is
+//              mapped privately so its blocks are read in as they are first touched, and
+//              writes to them never reach the file. A short file can't be mapped without
+//              faulting past its end, so it is read into a zero filled anonymous mapping, which
+//              is on huge pages if huge_pages is set.
+int mapImage( int fd )
+{
+   size_t      image_size = (size_t) NUM_BLOCKS * BLOCK_SIZE;
+   struct stat st;
+   void       *image = MAP_FAILED;
+   uint8_t     mapped = 0;
+
+   if ( fd >= 0 && fstat( fd, &st ) == 0 && st.st_size >= (off_t) image_size )
+   {
+      image  = mmap( NULL, image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+      mapped = image != MAP_FAILED;
+      image_pages = IMAGE_PAGES_FILE;
+      METRIC_ADD( syscalls, 2 );
+   }
+   if ( image == MAP_FAILED )
+   {
+      image = mapAnonymous( image_size );
+   }
+   if ( image == MAP_FAILED )
+   {
+      return -1;
+   }
+
+   for ( size_t offset = 0; fd >= 0 && !mapped && offset < image_size; )
+   {
+      ssize_t got = read( fd, (uint8_t *) image + offset, image_size - offset );
+      METRIC_SYSCALL();
+      if ( got < 0 && errno == EINTR )
+      {
+         continue;
+      }
+      if ( got <= 0 )
+      {
+         break;
+      }
+      offset += got;
+   }
+
+   if ( data != NULL )
+   {
+      munmap( data, image_size );
+      METRIC_SYSCALL();
+   }
+   data         = image;
+   image_mapped = mapped;
+
+   //Pointing the Pointers to the right spot in our disk image
+   super	= (struct superblock *) &data[SUPER_BLOCK][0];
+   table_map	= (int32_t *) &data[TABLE_MAP_BLOCK][0];
+   block_refs 	= (uint8_t *) &data[BLOCK_REF_MAP_BLOCK][0];
+   block_crcs	= (uint32_t *) &data[CHECKSUM_BLOCK][0];
+
+   // Nothing read from the old image carries over
+   for (int s = 0; s < READAHEAD_STREAMS; s++)
+   {
+      readahead_streams[s].inode_index = -1;
+   }
+   return 0;
+}
+
+void init( )
+{
+   page_size = sysconf( _SC_PAGESIZE );
+   if ( mapImage( -1 ) != 0 )
+   {
+      perror("ERROR: Could not allocate disk image");
+      exit( 1 );
+   }
+
+   // Build the software CRC32C table, and use the CRC32 instruction instead if we have it
+   for (uint32_t i = 0; i < 256; i++)
+   {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++)
+      {
+         crc = ( crc >> 1 ) ^ ( 0x82F63B78 & -( crc & 1 ) );
+      }
+      crc32c_table[i] = crc;
+   }
+#if defined(__x86_64__)
+   if ( __builtin_cpu_supports( "sse4.2" ) )
+   {
+      crc32c = crc32c_hw;
+   }
+   if ( __builtin_cpu_supports( "avx2" ) )
+   {
+      findPattern = findPatternAvx2;
+   }
+#endif
+
+   memset( image_name, 0, sizeof(image_name) ); // Initializing the disk image name to zero
+   image_open = 0;		// Disk image is not open 
+
+   // Build the byte to hex table used by the read command
+   for (int i = 0; i < 256; i++)
+   {
+      hex_pairs[i][0] = hex_digits[i >> 4];
+      hex_pairs[i][1] = hex_digits[i & 0xF];
+   }
+
+   // The tables are set up by createfs or openfs
+   file_slots = 0;
+
+}
+
+uint32_t df()
+{
+   // allocBlock and freeBlock keep count of the free data blocks
+   return free_block_count * BLOCK_SIZE;
+}
+
+// Name: reserveBlocks
+// Parameters: blocks - data and indirect blocks about to be allocated
+// Returns: 1 if that many blocks are now free, 0 if they can't be
+// Description: Reclaims deleted files when the free space alone isn't enough. At least
+//              RECLAIM_BATCH_BLOCKS are reclaimed at a time so a run of small writes under
+//              pressure doesn't empty the trash one file per write.
+int reserveBlocks( uint32_t blocks )
+{
+   if ( blocks <= free_block_count )
+   {
+      return 1;
+   }
+   if ( (uint64_t) blocks * BLOCK_SIZE > (uint64_t) df() + reclaimable() )
+   {
+      return 0;
+   }
+
+   uint32_t needed = blocks - free_block_count;
+   reclaimTrash( needed > RECLAIM_BATCH_BLOCKS ? needed : RECLAIM_BATCH_BLOCKS );
+   return 1;
+}
+
+void createfs( char* diskName )
+{
+   // savefs names its temp file and the rename after the image, so a cut short name would
+   // save somewhere else
+   if ( strlen( diskName ) >= sizeof(image_name) )
+   {
+      printf("ERROR: Disk image name is too long.\n");
+      return;
+   }
+
+   fp = fopen ( diskName, "w" );
+   if ( fp == NULL )
+   {
+      perror("ERROR: Could not create disk image");
+      return;
+   }
+
+   memset( image_name, 0, sizeof(image_name) );
+   strncpy( image_name, diskName, sizeof(image_name) - 1 );	// Copying diskname to our image_name variable
+
+   if ( mapImage( -1 ) != 0 )					// Start from an all zero image
+   {
+      perror("ERROR: Could not allocate disk image");
+      fclose ( fp );
+      return;
+   }
+
+   image_open = 1;	// Disk Image is now Open
+
+   // Clearing the image left every block with no references, that is free
+   countFreeBlocks();
+
+   // Start with room for FIRST_FILE_SLOTS files, every one of them free
+   file_slots = 0;
+   trash_seq  = 0;
+   entry_hint = inode_hint = 0;
+   takeTableBlocks( FIRST_FILE_SLOTS );
+   resizeTables( FIRST_FILE_SLOTS );
+   copyTables( 1 );
+
+   fclose ( fp ); 	// This makes the closefs pointless
+}
+
+// Name: write_all
+// Parameters: fd - descriptor to write to, buf - bytes to write, len - number of bytes
+// Returns: 0 on success, -1 on a write error (errno is left set)
+// Description: write() can return short counts, so keep writing until the whole buffer is out.
+int write_all( int fd, const uint8_t *buf, size_t len )
+{
+   while ( len > 0 )
+   {
+      ssize_t written = write( fd, buf, len );
+      METRIC_SYSCALL();
+      if ( written < 0 )
+      {
+         if ( errno == EINTR )
+         {
+            continue;
+         }
+         return -1;
+      }
+      buf += written;
+      len -= written;
+   }
+   return 0;
+}
+
+// Name: sync_directory
+// Parameters: path - path of a file whose parent directory should be flushed
+// Returns: 0 on success, -1 on failure
+// Description: After a rename the new directory entry is only durable once the directory
+//              itself has been fsync'd.
+int sync_directory( char *path )
+{
+   char dir_path[sizeof(image_name)];
+   strncpy( dir_path, path, sizeof(dir_path) - 1 );
+   dir_path[sizeof(dir_path) - 1] = '\0';
+
+   int dir_fd = open( dirname( dir_path ), O_RDONLY | O_DIRECTORY );
+   METRIC_SYSCALL();
+   if ( dir_fd < 0 )
+   {
+      return -1;
+   }
+
+   int ret = fsync( dir_fd );
+   close( dir_fd );
+   METRIC_ADD( syscalls, 2 );
+   return ret;
+}
+
+// Name: savefs
+// Parameters: none
+// Returns: 0 once the image is saved, -1 if it wasn't
+// Description: Atomically writes the open image back to its file. The image goes to a temp
+//              file next to the original in SAVE_CHUNK_SIZE writes, is flushed according to
+//              fsync_policy, then renamed over the original so readers never see a torn image.
+int savefs()
+{
+   if ( image_open == 0 )
+   {
+      printf("ERROR: Disk image is not open.\n");
+      return -1;
+   }
+
+   METRIC_BEGIN();
+
+   // The temp file has to live in the same directory as the image or rename is not atomic
+   char temp_name[sizeof(image_name) + 8];
+   snprintf( temp_name, sizeof(temp_name), "%s.XXXXXX", image_name );
+
+   int temp_fd = mkstemp( temp_name );
+   METRIC_SYSCALL();
+   if ( temp_fd < 0 )
+   {
+      perror("ERROR: Could not create temporary image");
+      return -1;
+   }
+
+   // The tables are only kept in memory while the image is open, put them in their blocks
+   copyTables( 1 );
+
+   // Stream the whole image out in large chunks instead of one fwrite per block. Blocks not
+   // read since openfs still have to come in from the old file, and they come in order.
+   uint8_t *image = &data[0][0];
+   size_t   image_size = (size_t) NUM_BLOCKS * BLOCK_SIZE;
+   int      failed = 0;
+
+   TRACE_START( copy_start );
+   adviseImage( FIRST_DATA_BLOCK, DATA_BLOCKS, MADV_SEQUENTIAL );
+   for ( size_t offset = 0; offset < image_size && !failed; offset += SAVE_CHUNK_SIZE )
+   {
+      failed = write_all( temp_fd, image + offset, SAVE_CHUNK_SIZE );
+   }
+   adviseImage( FIRST_DATA_BLOCK, DATA_BLOCKS, MADV_RANDOM );
+   TRACE_END( "copy", copy_start );
+
+   TRACE_START( flush_start );
+   if ( !failed && fsync_policy == FSYNC_DATA )
+   {
+      failed = fdatasync( temp_fd );
+      METRIC_SYSCALL();
+   }
+   else if ( !failed && fsync_policy == FSYNC_FULL )
+   {
+      failed = fsync( temp_fd );
+      METRIC_SYSCALL();
+   }
+
+   if ( failed )
+   {
+      perror("ERROR: Could not write disk image");
+      close( temp_fd );
+      unlink( temp_name );
+      return -1;
+   }
+
+   close( temp_fd );
+
+   // mkstemp creates the file 0600, give it the usual permissions before it replaces the image
+   chmod( temp_name, 0644 );
+   METRIC_ADD( syscalls, 3 );
+
+   if ( rename( temp_name, image_name ) != 0 )
+   {
+      perror("ERROR: Could not replace disk image");
+      unlink( temp_name );
+      return -1;
+   }
+
+   if ( fsync_policy == FSYNC_FULL && sync_directory( image_name ) != 0 )
+   {
+      perror("ERROR: Could not sync disk image directory");
+      return -1;
+   }
+   TRACE_END( "flush", flush_start );
+
+   METRIC_END( OP_SAVEFS, image_size );
+   return 0;
+}
+
+// Name: set_fsync_policy
+// Parameters: policy - "none", "data" or "full", or NULL to print the current policy
+// Returns: none
+// Description: Chooses how durable savefs makes the image before renaming it into place.
+void set_fsync_policy( char *policy )
+{
+   const char *names[] = { "none", "data", "full" };
+
+   if ( policy == NULL )
+   {
+      printf("fsync policy: %s\n", names[fsync_policy]);
+      return;
+   }
+
+   for ( int i = FSYNC_NONE; i <= FSYNC_FULL; i++ )
+   {
+      if ( !strcmp( policy, names[i] ) )
+      {
+         fsync_policy = i;
+         return;
+      }
+   }
+
+   printf("ERROR: fsync policy must be none, data or full.\n");
+}
+
+// Name: checkImage
+// Parameters: fd - the image file, diskName - its name for the error messages
+// Returns: 0 if it is an mfs image this mfs can open, -1 if not
+// Description: Reads the super block, the table map and the block reference map straight from
+//              the file, so an image that is turned away never replaces the one that is open.
+//              Bytes past the end of a short file read as zero, the same as mapImage leaves
+//              them.
+int checkImage( int fd, const char *diskName )
+{
+   size_t   header_size = (size_t) CHECKSUM_BLOCK * BLOCK_SIZE;
+   uint8_t *header = calloc( header_size, 1 );
+   if ( header == NULL )
+   {
+      printf("ERROR: Not enough memory to open %s.\n", diskName);
+      return -1;
+   }
+
+   for ( size_t offset = 0; offset < header_size; )
+   {
+      ssize_t got = pread( fd, header + offset, header_size - offset, offset );
+      METRIC_SYSCALL();
+      if ( got < 0 && errno == EINTR )
+      {
+         continue;
+      }
+      if ( got <= 0 )
+      {
+         break;
+      }
+      offset += got;
+   }
+
+   struct superblock *header_super = (struct superblock *) &header[SUPER_BLOCK * BLOCK_SIZE];
+   int32_t *header_map  = (int32_t *) &header[TABLE_MAP_BLOCK * BLOCK_SIZE];
+   uint8_t *header_refs = &header[BLOCK_REF_MAP_BLOCK * BLOCK_SIZE];
+
+   if ( header_super->magic == MFS_MAGIC && header_super->version != MFS_VERSION )
+   {
+      printf("ERROR: %s is in image format %"PRIu32", this mfs reads format %d.\n", diskName,
+             header_super->version, MFS_VERSION);
+      free( header );
+      return -1;
+   }
+
+   // Check the tables are where the table map says before loading them
+   int valid = header_super->magic == MFS_MAGIC && header_super->file_slots >= FIRST_FILE_SLOTS &&
+               header_super->file_slots <= MAX_FILES;
+   for (int32_t b = 0; valid && b < TABLE_BLOCKS( header_super->file_slots ); b++)
+   {
+      valid = IS_DATA_BLOCK( header_map[b] ) &&
+              header_refs[header_map[b] - FIRST_DATA_BLOCK] != 0;
+   }
+   free( header );
+
+   if ( !valid )
+   {
+      printf("ERROR: %s is not an mfs disk image.\n", diskName);
+      return -1;
+   }
+   return 0;
+}
+
+void openfs( char* diskName )
+{
+   if ( strlen( diskName ) >= sizeof(image_name) )
+   {
+      printf("ERROR: Disk image name is too long.\n");
+      return;
+   }
+
+   fp = fopen ( diskName, "r");
+   
+   if (fp == NULL)
+   {
+	   printf("ERROR: Disk image does not exist\n");
+   }
+   else
+   {
+   	// Turn a bad image away while the open one, if any, is still in place
+   	if ( checkImage( fileno( fp ), diskName ) != 0 )
+   	{
+   	   fclose ( fp );
+   	   return;
+   	}
+
+   	int mapped = mapImage( fileno( fp ) );	// Map the disk image in as our data structure
+
+   	fclose ( fp );		// Again makes closefs pointless, the mapping keeps the file
+   	if ( mapped != 0 )
+   	{
+   	   perror("ERROR: Could not map disk image");
+   	   return;
+   	}
+
+   	memset( image_name, 0, sizeof(image_name) );
+   	strncpy( image_name, diskName, sizeof(image_name) - 1 );	// Copy the disk image name to our image name variable
+
+   	// The metadata is all read at once below, so start reading it in now. File data is
+   	// read in as files are read, with readAhead prefetching what is read sequentially.
+   	adviseImage( 0, FIRST_DATA_BLOCK, MADV_WILLNEED );
+   	adviseImage( FIRST_DATA_BLOCK, DATA_BLOCKS, MADV_RANDOM );
+
+   	countFreeBlocks();
+   	file_slots = 0;
+   	trash_seq  = super->trash_seq;
+   	entry_hint = inode_hint = 0;
+   	resizeTables( super->file_slots );
+   	copyTables( 0 );
+   	nameIndexBuild();
+
+   	image_open = 1;		// Mark the disk image as open 
+   }
+}
+
+void closefs()
+{
+   if ( image_open == 0 )
+   {
+      printf("ERROR: Disk image is not open.\n");
+      return;
+   }
+
+   image_open = 0;		// Mark the disk image as closed 
+   memset( image_name, 0, sizeof(image_name) );	// Zeroing out Disk Image name becuase not using it
+}
+
+// Deleted files go in the trash: the directory entry, the inode and the data blocks are all
+// kept as they are so undel only has to flip them back. reclaimTrash frees them for real,
+// oldest first, once something needs the space.
+void delete( char *filename )
+{
+   int32_t  counter;             // This is also the index for directory
+   int32_t  inode_index;         // needed to trash correct inode
+
+   METRIC_BEGIN();
+
+   counter = findDirectoryEntry( filename );
+   if ( counter == -1 )
+   {
+      printf("delete: File not found\n");
+   }
+   else if ( isDirectory( counter ) )
+   {
+      printf("delete: %s is a directory, use rmdir.\n", filename);
+   }
+   else
+   {
+      inode_index = directory[counter].inode;   // obtaining the location of inode
+
+      inodes[inode_index].in_use    = 0;        // inode is no longer in use
+      inodes[inode_index].trashed   = ++trash_seq;	// but it and its blocks are held in the trash
+
+      nameIndexRemove( counter );
+      directory[counter].in_use     = 0;        // directory is no longer in use
+
+      METRIC_END( OP_DELETE, 0 );
+   }
+
+}
+
+void undel( char *filename )
+{
+   int32_t  counter = -1;                // This is also the index for directory
+   int32_t  inode_index;                 // needed to restore correct inode
+   uint32_t newest  = 0;
+   const char *leaf;
+   int32_t  parent  = resolveParent( filename, &leaf );
+
+   if ( parent != NO_DIRECTORY && findChild( parent, leaf, strlen( leaf ) ) != -1 )
+   {
+      printf("undelete: %s already exists.\n", filename);
+      return;
+   }
+
+   // The same name may have been deleted more than once, bring back the latest
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( inTrash( i ) && directory[i].parent == parent &&
+           !strcmp( filenames[i], leaf ) &&
+           inodes[directory[i].inode].trashed > newest )
+      {
+         counter = i;
+         newest = inodes[directory[i].inode].trashed;
+      }
+   }
+
+   if ( counter == -1 )
+   {
+      // file does not exist
+      printf("undelete: can not find the file.\n");
+   }
+   else
+   {
+      directory[counter].in_use     = 1;        // directory is in use
+      nameIndexAdd( counter );
+
+      inode_index = directory[counter].inode;   // obtaining inode location
+            
+      inodes[inode_index].in_use    = 1;        // inode is now in use
+      inodes[inode_index].trashed   = 0;        // and out of the trash
+   }
+
+}
+
+// Name: createEntry
+// Parameters: parent - directory to create it in, leaf - its name, attribute - DIRECTORY for a
+//             directory, 0 for a file
+// Returns: directory index of the new, empty entry, or -1 if the tables are full
+// Description: Takes a free directory entry and inode, reclaiming deleted files if it has to.
+//              The caller has already checked the name with checkNewPath.
+int32_t createEntry( int32_t parent, const char *leaf, uint8_t attribute )
+{
+   int32_t directory_entry = findFreeDirectoryEntry();
+   if ( directory_entry == -1 && reclaimTrash( 0 ) )
+   {
+      directory_entry = findFreeDirectoryEntry();
+   }
+   if ( directory_entry == -1 )
+   {
+      printf("ERROR: Could not find a free directory entry.\n");
+      return -1;
+   }
+
+   int32_t inode_index = findFreeInode();
+   if ( inode_index == -1 && reclaimTrash( 0 ) )
+   {
+      inode_index = findFreeInode();
+   }
+   if ( inode_index == -1 )
+   {
+      printf("ERROR: Cannont find free inode.\n");
+      return -1;
+   }
+
+   time_t t;
+   clearFileBlocks( &inodes[inode_index] );
+   inodes[inode_index].attribute = attribute;
+   inodes[inode_index].file_size = 0;
+   inodes[inode_index].trashed = 0;
+   inodes[inode_index].in_use = 1;
+   inodes[inode_index].t = time(&t);
+   free_inodes[inode_index] = 0;
+
+   directory[directory_entry].in_use = 1;
+   directory[directory_entry].inode = inode_index;
+   directory[directory_entry].parent = parent;
+   memset( filenames[directory_entry], 0, MAX_FILENAME );
+   strncpy( filenames[directory_entry], leaf, MAX_FILENAME - 1 );
+   nameIndexAdd( directory_entry );
+   return directory_entry;
+}
+
+// Takes back an entry from createEntry when the file can't be finished, along with any blocks
+// it was given
+void discardEntry( int32_t directory_index )
+{
+   nameIndexRemove( directory_index );
+   directory[directory_index].in_use = 0;
+   inodes[directory[directory_index].inode].in_use = 0;
+   reclaimEntry( directory_index );
+}
+
+// Name: makeDirectory
+// Parameters: path - directory to create, the directories above it must already exist
+// Returns: none
+// Description: A directory is a directory entry and an inode with the DIRECTORY attribute and
+//              no blocks. The entries inside it are found by hashing its directory index
+//              together with their name, so it keeps no list of them.
+void makeDirectory( char *path )
+{
+   const char *leaf;
+   int32_t parent = checkNewPath( path, &leaf );
+   if ( parent != NO_DIRECTORY )
+   {
+      createEntry( parent, leaf, DIRECTORY );
+   }
+}
+
+// Name: removeDirectory
+// Parameters: path - directory to remove
+// Returns: none
+// Description: Only empty directories can be removed. Deleted files still in the trash under
+//              it are reclaimed first, since undel could not put them back anywhere.
+void removeDirectory( char *path )
+{
+   int32_t directory_index = findDirectoryEntry( path );
+   if ( directory_index == -1 )
+   {
+      printf("rmdir: Directory not found\n");
+      return;
+   }
+   if ( !isDirectory( directory_index ) )
+   {
+      printf("rmdir: %s is not a directory.\n", path);
+      return;
+   }
+
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( directory[i].in_use && directory[i].parent == directory_index )
+      {
+         printf("rmdir: %s is not empty.\n", path);
+         return;
+      }
+   }
+
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( inTrash( i ) && directory[i].parent == directory_index )
+      {
+         reclaimEntry( i );
+      }
+   }
+
+   int32_t inode_index = directory[directory_index].inode;
+   inodes[inode_index].in_use = 0;
+   inodes[inode_index].attribute = 0;
+   free_inodes[inode_index] = 1;
+
+   nameIndexRemove( directory_index );
+   directory[directory_index].in_use = 0;
+   directory[directory_index].inode = -1;
+   memset( filenames[directory_index], 0, MAX_FILENAME );
+
+   // Cached paths may lead through the directory index that is now free
+   dentry_generation++;
+}
+
+// walkFileBlocks callback adding a reference to each block
+void shareFileBlock( int32_t block_index, void *unused )
+{
+   shareBlock( block_index );
+
+}
+
+// walkFileBlocks callback dropping a reference to each block
+void releaseFileBlock( int32_t block_index, void *unused )
+{
+   freeBlock( block_index );
+
+}
+
+// Returns the snapshot with this name, or NULL
+struct snapshot *findSnapshot( const char *name )
+{
+   for (int s = 0; s < MAX_SNAPSHOTS; s++)
+   {
+      if ( super->snapshots[s].in_use &&
+           !strncmp( super->snapshots[s].name, name, SNAPSHOT_NAME_MAX ) )
+      {
+         return &super->snapshots[s];
+      }
+   }
+   return NULL;
+
+}
+
+// Returns the number of map blocks listing the table blocks of a snapshot with slots entries
+int32_t snapshotMapBlocks( uint32_t slots )
+{
+   return ( TABLE_BLOCKS( slots ) + SNAPSHOT_MAP_POINTERS - 1 ) / SNAPSHOT_MAP_POINTERS;
+
+}
+
+// Name: snapshotTableMap
+// Parameters: snap - snapshot to read, map - filled in with its table blocks, chain - filled
+//             in with its map blocks
+// Returns: 0 on success, -1 if its size or any of those blocks is out of range
+int snapshotTableMap( struct snapshot *snap, int32_t *map, int32_t *chain )
+{
+   if ( snap->file_slots < FIRST_FILE_SLOTS || snap->file_slots > MAX_FILES )
+   {
+      return -1;
+   }
+
+   int32_t map_block = snap->map;
+   for (int32_t b = 0; b < TABLE_BLOCKS( snap->file_slots ); b++)
+   {
+      if ( b % SNAPSHOT_MAP_POINTERS == 0 )
+      {
+         if ( b > 0 )
+         {
+            map_block = ( (int32_t *) data[map_block] )[SNAPSHOT_MAP_POINTERS];
+         }
+         if ( !IS_DATA_BLOCK( map_block ) )
+         {
+            return -1;
+         }
+         chain[b / SNAPSHOT_MAP_POINTERS] = map_block;
+      }
+
+      map[b] = ( (int32_t *) data[map_block] )[b % SNAPSHOT_MAP_POINTERS];
+      if ( !IS_DATA_BLOCK( map[b] ) )
+      {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+// Name: walkSnapshot
+// Parameters: snap - snapshot to walk, fn - called with each block number and arg
+// Returns: 0 on success, -1 without calling fn if the snapshot's map leads outside the data
+//          area
+// Description: Calls fn on every block a snapshot holds: the data and indirect blocks of its
+//              files, the ones in its trash too, then its table blocks and map blocks.
+int walkSnapshot( struct snapshot *snap, void (*fn)( int32_t, void * ), void *arg )
+{
+   if ( snap->file_slots < FIRST_FILE_SLOTS || snap->file_slots > MAX_FILES )
+   {
+      return -1;
+   }
+
+   int32_t  table_blocks = TABLE_BLOCKS( snap->file_slots );
+   int32_t  map_blocks = snapshotMapBlocks( snap->file_slots );
+   int32_t *map = malloc( table_blocks * sizeof(int32_t) );
+   int32_t *chain = malloc( map_blocks * sizeof(int32_t) );
+   int      result = snapshotTableMap( snap, map, chain );
+
+   if ( result == 0 )
+   {
+      struct inode *snap_inodes = malloc( snap->file_slots * sizeof(struct inode) );
+      copyTableBlocks( map, snap_inodes, NULL, NULL, NULL, snap->file_slots, 0 );
+      for (uint32_t i = 0; i < snap->file_slots; i++)
+      {
+         if ( snap_inodes[i].in_use || snap_inodes[i].trashed )
+         {
+            walkFileBlocks( &snap_inodes[i], fn, arg );
+         }
+      }
+      free( snap_inodes );
+
+      for (int32_t b = 0; b < table_blocks; b++)
+      {
+         fn( map[b], arg );
+      }
+      for (int32_t c = 0; c < map_blocks; c++)
+      {
+         fn( chain[c], arg );
+      }
+   }
+
+   free( chain );
+   free( map );
+   return result;
+}
+
+// Name: takeSnapshot
+// Parameters: name - name for the snapshot
+// Returns: none
+// Description: Freezes the directory, inode table and free inode map as they are now. Only
+//              the tables are copied, into table blocks of the snapshot's own. Every block of
+//              every file, trash included, gains a reference instead of being copied, and
+//              whichever side changes one of them later gets a copy of it.
+void takeSnapshot( char *name )
+{
+   struct snapshot *snap = NULL;
+
+   if ( strlen( name ) >= SNAPSHOT_NAME_MAX )
+   {
+      printf("snapshot: Name is too long.\n");
+      return;
+   }
+   if ( findSnapshot( name ) != NULL )
+   {
+      printf("snapshot: %s already exists.\n", name);
+      return;
+   }
+
+   for (int s = 0; s < MAX_SNAPSHOTS && snap == NULL; s++)
+   {
+      if ( !super->snapshots[s].in_use )
+      {
+         snap = &super->snapshots[s];
+      }
+   }
+   if ( snap == NULL )
+   {
+      printf("snapshot: All %d snapshots are in use, delete one first.\n", MAX_SNAPSHOTS);
+      return;
+   }
+
+   int32_t table_blocks = TABLE_BLOCKS( file_slots );
+   int32_t map_blocks = snapshotMapBlocks( file_slots );
+   if ( !reserveBlocks( table_blocks + map_blocks ) )
+   {
+      printf("snapshot: Not enough free disk space.\n");
+      return;
+   }
+
+   // Each map block is linked to the next as the chain grows
+   int32_t *map = malloc( table_blocks * sizeof(int32_t) );
+   int32_t  first = -1;
+   int32_t  map_block = -1;
+   for (int32_t b = 0; b < table_blocks; b++)
+   {
+      if ( b % SNAPSHOT_MAP_POINTERS == 0 )
+      {
+         int32_t next = allocBlock();
+         memset( data[next], 0xFF, BLOCK_SIZE );
+         if ( map_block == -1 )
+         {
+            first = next;
+         }
+         else
+         {
+            ( (int32_t *) data[map_block] )[SNAPSHOT_MAP_POINTERS] = next;
+            blockWritten( map_block );
+         }
+         map_block = next;
+      }
+
+      map[b] = allocBlock();
+      memset( data[map[b]], 0, BLOCK_SIZE );
+      ( (int32_t *) data[map_block] )[b % SNAPSHOT_MAP_POINTERS] = map[b];
+   }
+   blockWritten( map_block );
+   copyTableBlocks( map, inodes, directory, filenames, free_inodes, file_slots, 1 );
+   free( map );
+
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( inodes[i].in_use || inodes[i].trashed )
+      {
+         walkFileBlocks( &inodes[i], shareFileBlock, NULL );
+      }
+   }
+
+   time_t t;
+   memset( snap, 0, sizeof(struct snapshot) );
+   strncpy( snap->name, name, SNAPSHOT_NAME_MAX - 1 );
+   snap->in_use     = 1;
+   snap->map        = first;
+   snap->file_slots = file_slots;
+   snap->trash_seq  = trash_seq;
+   snap->t          = time(&t);
+
+   printf("Snapshot %s taken, its tables use %"PRId32" bytes\n", name,
+          ( table_blocks + map_blocks ) * BLOCK_SIZE );
+}
+
+// Name: listSnapshots
+// Parameters: none
+// Returns: none
+// Description: Lists every snapshot with when it was taken and the bytes only it holds, the
+//              space deleting it would give back.
+void listSnapshots()
+{
+   int count = 0;
+
+   printf("%-31s %-24s %12s\n", "snapshot", "taken", "own_bytes");
+   for (int s = 0; s < MAX_SNAPSHOTS; s++)
+   {
+      struct snapshot *snap = &super->snapshots[s];
+      if ( !snap->in_use )
+      {
+         continue;
+      }
+
+      char      time_text[32];
+      struct tm tm;
+      time_t    taken = snap->t;
+      localtime_r( &taken, &tm );
+      strftime( time_text, sizeof(time_text), "%a %b %e %H:%M:%S %Y", &tm );
+
+      uint32_t own = 0;
+      if ( walkSnapshot( snap, countOwnBlock, &own ) == 0 )
+      {
+         printf("%-31.*s %-24s %12"PRIu64"\n", SNAPSHOT_NAME_MAX, snap->name, time_text,
+                (uint64_t) own * BLOCK_SIZE );
+      }
+      else
+      {
+         printf("%-31.*s %-24s %12s\n", SNAPSHOT_NAME_MAX, snap->name, time_text, "damaged");
+      }
+      count++;
+   }
+   printf("%d of %d snapshots\n", count, MAX_SNAPSHOTS);
+}
+
+// Name: rollbackSnapshot
+// Parameters: name - snapshot to go back to
+// Returns: none
+// Description: Puts the directory, inode table and free inode map back the way they were when
+//              the snapshot was taken. The live files' blocks lose a reference and the
+//              snapshot's files' blocks gain one, so only the tables are copied. The snapshot
+//              is kept and can be rolled back to again.
+void rollbackSnapshot( char *name )
+{
+   struct snapshot *snap = findSnapshot( name );
+   if ( snap == NULL )
+   {
+      printf("snapshot: %s not found.\n", name);
+      return;
+   }
+
+   // Tables never shrink, so the snapshot's fit in the live table blocks
+   int32_t *map = malloc( TABLE_BLOCKS( MAX_FILES ) * sizeof(int32_t) );
+   int32_t *chain = malloc( snapshotMapBlocks( MAX_FILES ) * sizeof(int32_t) );
+   if ( snapshotTableMap( snap, map, chain ) != 0 || snap->file_slots > file_slots )
+   {
+      printf("snapshot: %s is damaged, run fsck.\n", name);
+      free( chain );
+      free( map );
+      return;
+   }
+
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( inodes[i].in_use || inodes[i].trashed )
+      {
+         trimFileBlocks( &inodes[i], 0, 1 );
+      }
+   }
+
+   // Entries past the end of the snapshot's tables come back free when they are grown again
+   uint32_t slots = file_slots;
+   file_slots = snap->file_slots;
+   copyTableBlocks( map, inodes, directory, filenames, free_inodes, file_slots, 0 );
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( inodes[i].in_use || inodes[i].trashed )
+      {
+         walkFileBlocks( &inodes[i], shareFileBlock, NULL );
+      }
+   }
+
+   trash_seq  = snap->trash_seq;
+   entry_hint = inode_hint = 0;
+   resizeTables( slots );
+
+   free( chain );
+   free( map );
+   printf("Rolled back to snapshot %s\n", name);
+}
+
+// Name: deleteSnapshot
+// Parameters: name - snapshot to delete
+// Returns: none
+// Description: Drops the snapshot's reference to every block it holds. Its tables are freed,
+//              and so is every data block no longer in the live file system or another
+//              snapshot.
+void deleteSnapshot( char *name )
+{
+   struct snapshot *snap = findSnapshot( name );
+   if ( snap == NULL )
+   {
+      printf("snapshot: %s not found.\n", name);
+      return;
+   }
+
+   uint32_t free_before = free_block_count;
+   if ( walkSnapshot( snap, releaseFileBlock, NULL ) != 0 )
+   {
+      printf("snapshot: %s is damaged, run fsck.\n", name);
+      return;
+   }
+   memset( snap, 0, sizeof(struct snapshot) );
+
+   printf("Deleted snapshot %s, %"PRIu64" bytes freed\n", name,
+          (uint64_t) ( free_block_count - free_before ) * BLOCK_SIZE );
+}
+
+// Name: snapshotCommand
+// Parameters: action - list, rollback or delete, otherwise the name of a new snapshot (NULL
+//             lists them), name - the snapshot to roll back to or delete
+// Returns: none
+// Description: Implements the snapshot command.
+void snapshotCommand( char *action, char *name )
+{
+   if ( action == NULL || !strcmp( action, "list" ) )
+   {
+      listSnapshots();
+   }
+   else if ( !strcmp( action, "rollback" ) || !strcmp( action, "delete" ) )
+   {
+      if ( name == NULL )
+      {
+         printf("ERROR: Usage: snapshot %s <name>\n", action);
+      }
+      else if ( !strcmp( action, "rollback" ) )
+      {
+         rollbackSnapshot( name );
+      }
+      else
+      {
+         deleteSnapshot( name );
+      }
+   }
+   else
+   {
+      takeSnapshot( action );
+   }
+}
+
+// Orders the list command can sort by
+enum list_sort
+{
+   LIST_UNSORTED,			// Directory order
+   LIST_BY_NAME,
+   LIST_BY_SIZE,
+   LIST_BY_TIME
+};
+
+// What the list command should show and how
+struct list_options
+{
+   enum list_sort sort;
+   int            reverse;
+   int            show_hidden;
+   int            show_attributes;
+   uint8_t        require;		// Only files with all of these attributes
+   char          *pattern;		// Directory to list and a glob its names must match, or NULL
+   uint32_t       page_size;		// Most files to show, 0 for all of them
+   char          *cursor;		// Start after this position, from a previous page, or NULL
+};
+
+// One file picked for a listing. Every sort order compares (key, name), so a page cursor is
+// just the key and name of the last file shown.
+struct list_entry
+{
+   int64_t key;
+   int32_t directory_index;
+};
+
+int list_reverse;			// qsort has no context argument, compareListEntries reads this
+
+// Compares two (key, name) positions in the listing order
+int compareListKeys( int64_t key_a, const char *name_a, int64_t key_b, const char *name_b )
+{
+   int order = ( key_a > key_b ) - ( key_a < key_b );
+   if ( order == 0 )
+   {
+      order = strncmp( name_a, name_b, MAX_FILENAME );
+   }
+   return list_reverse ? -order : order;
+}
+
+int compareListEntries( const void *a, const void *b )
+{
+   const struct list_entry *entry_a = a;
+   const struct list_entry *entry_b = b;
+   return compareListKeys( entry_a->key, filenames[entry_a->directory_index],
+                           entry_b->key, filenames[entry_b->directory_index] );
+}
+
+// Returns the sort key of a directory entry, the directory index when unsorted
+int64_t listKey( enum list_sort sort, int32_t directory_index )
+{
+   struct inode *file_inode = &inodes[directory[directory_index].inode];
+   switch ( sort )
+   {
+      case LIST_BY_NAME: return 0;
+      case LIST_BY_SIZE: return file_inode->file_size;
+      case LIST_BY_TIME: return file_inode->t;
+      default:           return directory_index;
+   }
+}
+
+// Output for the list command is formatted into one buffer and written out in large pieces
+struct list_writer
+{
+   char   buf[LIST_BUFFER_SIZE];
+   size_t len;
+};
+
+void listFlush( struct list_writer *w )
+{
+   fwrite( w->buf, 1, w->len, stdout );
+   w->len = 0;
+}
+
+void listWrite( struct list_writer *w, const char *format, ... )
+{
+   if ( LIST_BUFFER_SIZE - w->len < LIST_LINE_MAX )
+   {
+      listFlush( w );
+   }
+
+   va_list args;
+   va_start( args, format );
+   int n = vsnprintf( &w->buf[w->len], LIST_BUFFER_SIZE - w->len, format, args );
+   va_end( args );
+
+   if ( n > 0 )
+   {
+      w->len += (size_t) n < LIST_BUFFER_SIZE - w->len ? (size_t) n : LIST_BUFFER_SIZE - w->len - 1;
+   }
+}
+
+// Name: listFiles
+// Parameters: options - which files to list, in what order and how many
+// Returns: none
+// Description: Picks the files in one directory that pass the filters and come after the
+//              cursor, sorts them, and writes one page of them. Files inserted together share a
+//              timestamp, so the last formatted time is reused rather than converted again for
+//              every line. When there are more files than fit on the page, the cursor for the
+//              next page is printed after it.
+void listFiles( struct list_options *options )
+{
+   struct list_entry *entries = malloc( file_slots * sizeof(struct list_entry) );
+   int64_t  cursor_key = 0;
+   char    *cursor_name = NULL;
+   int32_t  count = 0;
+   int32_t  parent = ROOT_DIRECTORY;
+   const char *pattern = options->pattern;
+
+   // "docs/*.txt" lists the files in docs matching *.txt, "docs/" everything in docs
+   if ( pattern && strchr( pattern, '/' ) )
+   {
+      parent = resolveParent( pattern, &pattern );
+      if ( parent == NO_DIRECTORY )
+      {
+         printf("ERROR: Directory not found.\n");
+         free( entries );
+         return;
+      }
+      if ( *pattern == 0 )
+      {
+         pattern = NULL;
+      }
+   }
+
+   if ( options->cursor )
+   {
+      cursor_key = strtoll( options->cursor, &cursor_name, 10 );
+      if ( *cursor_name != ':' )
+      {
+         printf("ERROR: Bad page cursor %s.\n", options->cursor);
+         free( entries );
+         return;
+      }
+      cursor_name++;
+   }
+
+   list_reverse = options->reverse;
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( !directory[i].in_use || directory[i].parent != parent )
+      {
+         continue;
+      }
+
+      uint8_t attribute = inodes[directory[i].inode].attribute;
+      if ( ( attribute & HIDDEN ) && !options->show_hidden && !( options->require & HIDDEN ) )
+      {
+         continue;
+      }
+      if ( ( attribute & options->require ) != options->require )
+      {
+         continue;
+      }
+      if ( pattern && fnmatch( pattern, filenames[i], 0 ) != 0 )
+      {
+         continue;
+      }
+
+      int64_t key = listKey( options->sort, i );
+      if ( cursor_name &&
+           compareListKeys( key, filenames[i], cursor_key, cursor_name ) <= 0 )
+      {
+         continue;
+      }
+
+      entries[count].key = key;
+      entries[count].directory_index = i;
+      count++;
+   }
+
+   if ( count == 0 )
+   {
+      printf("ERROR: No files found.\n");
+      free( entries );
+      return;
+   }
+
+   qsort( entries, count, sizeof(struct list_entry), compareListEntries );
+
+   int32_t shown = options->page_size && options->page_size < (uint32_t) count ?
+                   (int32_t) options->page_size : count;
+
+   struct list_writer *w = malloc( sizeof(struct list_writer) );
+   time_t last_time = -1;
+   char   time_text[64] = "";
+   w->len = 0;
+
+   for (int i = 0; i < shown; i++)
+   {
+      struct directoryEntry *entry = &directory[entries[i].directory_index];
+      struct inode *file_inode = &inodes[entry->inode];
+
+      if ( file_inode->t != last_time )
+      {
+         struct tm tm;
+         last_time = file_inode->t;
+         localtime_r( &last_time, &tm );
+         strftime( time_text, sizeof(time_text), "%a %b %e %H:%M:%S %Y", &tm );
+      }
+
+      // Directories are shown with a slash after the name
+      char name[MAX_FILENAME + 2];
+      snprintf( name, sizeof(name), "%.*s%s", MAX_FILENAME,
+                filenames[entries[i].directory_index],
+                file_inode->attribute & DIRECTORY ? "/" : "" );
+
+      listWrite( w, "%10s %8"PRIu32" B     %s", name, file_inode->file_size, time_text );
+      if ( options->show_attributes )
+      {
+         char bits[9];
+         for (int b = 0; b < 8; b++)
+         {
+            bits[b] = ( file_inode->attribute >> ( 7 - b ) ) & 1 ? '1' : '0';
+         }
+         bits[8] = 0;
+         listWrite( w, "  %s", bits );
+      }
+      listWrite( w, "\n" );
+   }
+
+   if ( shown < count )
+   {
+      struct list_entry *last = &entries[shown - 1];
+      listWrite( w, "Next page: -c %"PRId64":%.*s\n", last->key, MAX_FILENAME,
+                 filenames[last->directory_index] );
+   }
+
+   listFlush( w );
+   free( w );
+   free( entries );
+}
+
+void attribute(char* attribute, char* filename)
+{
+   uint8_t found = 0;
+   struct inode * file_inode;
+	int32_t directory_index = findDirectoryEntry( filename );
+	if( directory_index != -1 )
+	{
+		found = 1;
+		file_inode = &inodes[directory[directory_index].inode];
+   }
+
+   if (found == 0)
+   {
+      printf("ERROR: No matching file found.\n");
+      return;
+   }
+
+   if ( !strcmp(attribute, "+h") )
+   {
+      file_inode->attribute |= HIDDEN;
+   }
+
+   else if (!strcmp(attribute, "-h"))
+   {
+      file_inode->attribute &= ~HIDDEN;
+   }
+
+   else if (!strcmp(attribute, "+r"))
+   {
+      file_inode->attribute |= READONLY;
+   }
+
+   else if (!strcmp(attribute, "-r"))
+   {
+      file_inode->attribute &= ~READONLY;
+   }
+
+   else
+   {
+      printf("ERROR: Incorrect attribute specified.\n");
+   }
+}
+
+//-------------------------------------------------------------------------------------------------
+// Heavy Functions: Insert, Retrieve, Read, Encrypt, & Decrypt
+// ------------------------------------------------------------------------------------------------
+// Name: hexdump_line
+// Parameters: out - where to format the line, line_offset - file offset of the first byte,
+//             bytes - the bytes on this line, count - how many bytes (1 to HEXDUMP_WIDTH)
+// Returns: number of characters written to out
+// Description: Formats one xxd style line, "oooooooo: hhhh hhhh ...  ascii", using the
+//              hex_pairs table instead of a printf per byte.
+size_t hexdump_line( char *out, uint32_t line_offset, const uint8_t *bytes, int count )
+{
+   char *p = out;
+
+   // The offset is 8 hex digits, most significant nibble first
+   for ( int shift = 28; shift >= 0; shift -= 4 )
+   {
+      *p++ = hex_digits[( line_offset >> shift ) & 0xF];
+   }
+   *p++ = ':';
+   *p++ = ' ';
+
+   // Hex column, two bytes per group, padded out so the ASCII column always lines up
+   for ( int i = 0; i < HEXDUMP_WIDTH; i++ )
+   {
+      if ( i < count )
+      {
+         memcpy( p, hex_pairs[bytes[i]], 2 );
+      }
+      else
+      {
+         memset( p, ' ', 2 );
+      }
+      p += 2;
+
+      if ( i & 1 )
+      {
+         *p++ = ' ';
+      }
+   }
+   *p++ = ' ';
+
+   for ( int i = 0; i < count; i++ )
+   {
+      *p++ = ( bytes[i] >= 0x20 && bytes[i] < 0x7F ) ? bytes[i] : '.';
+   }
+   *p++ = '\n';
+
+   return p - out;
+}
+
+// Name: readDisk
+// Parameters: filename - file in the image, start_byte - first byte to print,
+//             num_bytes - how many bytes to print, raw - write the bytes unformatted
+// Returns: none
+// Description: Implements the read command. The range is printed as an xxd style hex dump,
+//              or with raw set copied byte for byte to stdout. Hex lines are built in a large
+//              buffer that is only handed to stdio when it fills, so multi megabyte ranges
+//              don't cost a formatted print per byte.
+void readDisk( char* filename, uint32_t start_byte, uint32_t num_bytes, int raw )
+{
+	METRIC_BEGIN();
+
+	int32_t directory_index = findFile( filename );
+	if ( directory_index == -1 )
+	{
+		printf("ERROR: File not found.\n"); 
+		return;
+	}
+
+	struct inode *file_inode = &inodes[directory[directory_index].inode];
+
+	if ( start_byte >= file_inode->file_size )
+	{
+		printf("ERROR: Start byte is past the end of the file.\n");
+		return;
+	}
+
+	// Never read past the end of the file
+	if ( num_bytes > file_inode->file_size - start_byte )
+	{
+		num_bytes = file_inode->file_size - start_byte;
+	}
+
+	uint32_t offset = start_byte;
+	uint32_t end = start_byte + num_bytes;
+
+	readAhead( directory[directory_index].inode, start_byte / BLOCK_SIZE,
+	           BLOCKS_FOR_SIZE( end ) );
+	int32_t bad_block = verifyFileBlocks( file_inode, start_byte / BLOCK_SIZE,
+	                                      BLOCKS_FOR_SIZE( end ) );
+	if ( bad_block != -1 )
+	{
+		printf("ERROR: Checksum mismatch in block %"PRId32" of %s.\n", bad_block, filename );
+		return;
+	}
+
+	if ( raw )
+	{
+		// The bytes go out exactly as they are stored, a block (or part of one) at a time
+		while ( offset < end )
+		{
+			uint32_t block_offset = offset % BLOCK_SIZE;
+			uint32_t chunk = BLOCK_SIZE - block_offset;
+			if ( chunk > end - offset )
+			{
+				chunk = end - offset;
+			}
+			fwrite( &data[fileBlock( file_inode, offset / BLOCK_SIZE )][block_offset], 1, chunk,
+			        stdout );
+			offset += chunk;
+		}
+		fflush( stdout );
+		METRIC_END( OP_READ, num_bytes );
+		return;
+	}
+
+	char   *out = malloc( HEXDUMP_BUFFER_SIZE );
+	size_t  used = 0;
+	uint8_t line[HEXDUMP_WIDTH];
+	int     line_count = 0;
+	uint32_t line_offset = start_byte;
+
+	// Walk the range a block at a time, cutting it into HEXDUMP_WIDTH byte lines. A line can
+	// start in one block and finish in the next.
+	while ( offset < end )
+	{
+		uint32_t block_offset = offset % BLOCK_SIZE;
+		uint32_t chunk = BLOCK_SIZE - block_offset;
+		if ( chunk > end - offset )
+		{
+			chunk = end - offset;
+		}
+		uint8_t *bytes = &data[fileBlock( file_inode, offset / BLOCK_SIZE )][block_offset];
+		offset += chunk;
+
+		while ( chunk > 0 )
+		{
+			uint32_t take = HEXDUMP_WIDTH - line_count;
+			if ( take > chunk )
+			{
+				take = chunk;
+			}
+			memcpy( &line[line_count], bytes, take );
+			line_count += take;
+			bytes += take;
+			chunk -= take;
+
+			if ( line_count == HEXDUMP_WIDTH || ( offset == end && chunk == 0 ) )
+			{
+				used += hexdump_line( out + used, line_offset, line, line_count );
+				line_offset += line_count;
+				line_count = 0;
+
+				if ( used > HEXDUMP_BUFFER_SIZE - HEXDUMP_LINE_MAX )
+				{
+					fwrite( out, 1, used, stdout );
+					used = 0;
+				}
+			}
+		}
+	}
+
+	fwrite( out, 1, used, stdout );
+	free( out );
+	METRIC_END( OP_READ, num_bytes );
+}
+
+// Name: writev_all
+// Parameters: fd - descriptor to write to, iov - buffers to write, iovcnt - number of buffers
+// Returns: 0 on success, -1 on a write error (errno is left set)
+// Description: writev() can stop part way through any buffer, so keep advancing the iovec
+//              array past what was written until everything is out. iov is modified.
+int writev_all( int fd, struct iovec *iov, int iovcnt )
+{
+   while ( iovcnt > 0 )
+   {
+      ssize_t written = writev( fd, iov, iovcnt );
+      METRIC_SYSCALL();
+      if ( written < 0 )
+      {
+         if ( errno == EINTR )
+         {
+            continue;
+         }
+         if ( errno == EAGAIN || errno == EWOULDBLOCK )
+         {
+            // A non-blocking socket is full, wait until the other end makes room
+            struct pollfd writable = { .fd = fd, .events = POLLOUT };
+            poll( &writable, 1, -1 );
+            continue;
+         }
+         return -1;
+      }
+
+      // Skip the buffers that went out whole, then trim the one that was cut short
+      while ( iovcnt > 0 && (size_t) written >= iov->iov_len )
+      {
+         written -= iov->iov_len;
+         iov++;
+         iovcnt--;
+      }
+
+      if ( iovcnt > 0 )
+      {
+         iov->iov_base = (uint8_t *) iov->iov_base + written;
+         iov->iov_len -= written;
+      }
+   }
+   return 0;
+}
+
+// Name: retrieve_fd
+// Parameters: inode_index - inode of the file to copy out, fd - descriptor to write it to
+// Returns: 0 on success, -1 on a write error, -2 if a block fails its checksum
+// Description: Writes a whole file to any descriptor (file, pipe, socket, stdout). The iovecs
+//              point straight at the file's blocks in data[] so nothing is copied on the way.
+//              Each batch of blocks is checked against its checksums just before it is sent,
+//              after readAhead has started reading it and the blocks past it in.
+int retrieve_fd( int32_t inode_index, int fd )
+{
+   struct iovec iov[IOV_MAX];
+   uint32_t     remaining = inodes[inode_index].file_size;
+   int32_t      inode_block_idx = 0;
+
+   while ( remaining > 0 )
+   {
+      // Gather as many blocks as one writev will take
+      int32_t first_block = inode_block_idx;
+      int iovcnt = 0;
+      while ( remaining > 0 && iovcnt < IOV_MAX )
+      {
+         uint32_t num_bytes = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
+         int32_t  block_index = fileBlock( &inodes[inode_index], inode_block_idx++ );
+
+         iov[iovcnt].iov_base = data[block_index];
+         iov[iovcnt].iov_len  = num_bytes;
+         iovcnt++;
+         remaining -= num_bytes;
+      }
+
+      readAhead( inode_index, first_block, inode_block_idx );
+      if ( verifyFileBlocks( &inodes[inode_index], first_block, inode_block_idx ) != -1 )
+      {
+         return -2;
+      }
+
+      TRACE_START( copy_start );
+      int failed = writev_all( fd, iov, iovcnt );
+      TRACE_END( "copy", copy_start );
+      if ( failed )
+      {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+// Name: retrieve
+// Parameters: filename - file in the image, newFilename - host file to create, or "-"
+// Returns: none
+// Description: Copies a file out of the image. A newFilename of "-" streams it to stdout.
+void retrieve(char* filename, char* newFilename)
+{
+	METRIC_BEGIN();
+
+	int32_t directory_index = findFile( filename );
+	if ( directory_index == -1 )
+	{
+		printf("ERROR: File not found.\n"); 
+		return;
+	}
+
+	int32_t inode_index = directory[directory_index].inode;
+
+	// Streaming to stdout: anything we already printf'd has to go out first, and we can't
+	// print a status message without it ending up in the middle of the file
+	if ( !strcmp( newFilename, "-" ) )
+	{
+		fflush( stdout );
+		int failed = retrieve_fd( inode_index, STDOUT_FILENO );
+		if ( failed == -2 )
+		{
+			fprintf( stderr, "ERROR: Checksum mismatch in %s.\n", filename );
+			return;
+		}
+		if ( failed )
+		{
+			perror("ERROR: Writing to stdout returned");
+			return;
+		}
+		METRIC_END( OP_RETRIEVE, inodes[inode_index].file_size );
+		return;
+	}
+
+	// Now, open the output file that we are going to write the data to.
+	int fd = open( newFilename, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	METRIC_SYSCALL();
+	if( fd < 0 )
+	{
+		printf("Could not open output file: %s\n", newFilename );
+		perror("Opening output file returned");
+		return;
+	}
+
+	printf("Writing %d bytes to %s\n", (int) inodes[inode_index].file_size, newFilename );
+
+	int failed = retrieve_fd( inode_index, fd );
+	if ( failed == -2 )
+	{
+		printf("ERROR: Checksum mismatch in %s, the output file is incomplete.\n", filename );
+	}
+	else if ( failed )
+	{
+		perror("ERROR: Writing output file returned");
+	}
+
+	// Close the output file, we're done. 
+	close( fd );
+	METRIC_SYSCALL();
+
+	if ( !failed )
+	{
+		METRIC_END( OP_RETRIEVE, inodes[inode_index].file_size );
+	}
+}
+
+// Name: entryPath
+// Parameters: prefix - host directory the image's root maps to, or NULL for none,
+//             directory_index - entry to name, path - filled in with the entry's path,
+//             size - size of path
+// Returns: 0 on success, -1 if the path doesn't fit
+// Description: Joins the prefix and the names of the directories leading down to the entry
+//              with "/". The path is filled in from the end, the entry's own name first.
+int entryPath( const char *prefix, int32_t directory_index, char *path, size_t size )
+{
+   size_t length = prefix ? strlen( prefix ) + 1 : 0;
+   for (int32_t d = directory_index; d >= 0 && length <= size; d = directory[d].parent)
+   {
+      length += strnlen( filenames[d], MAX_FILENAME ) + 1;
+   }
+   if ( length > size )
+   {
+      return -1;
+   }
+
+   size_t end = length - 1;
+   path[end] = '\0';
+   for (int32_t d = directory_index; d >= 0; d = directory[d].parent)
+   {
+      size_t name_length = strnlen( filenames[d], MAX_FILENAME );
+      end -= name_length;
+      memcpy( path + end, filenames[d], name_length );
+      if ( end > 0 )
+      {
+         path[--end] = '/';
+      }
+   }
+   if ( prefix )
+   {
+      memcpy( path, prefix, end );
+   }
+   return 0;
+}
+
+// Creates a host directory and any directories above it that are missing, like mkdir -p
+int makeHostDirectories( char *path )
+{
+   for (char *slash = strchr( path + 1, '/' ); ; slash = strchr( slash + 1, '/' ))
+   {
+      if ( slash )
+      {
+         *slash = '\0';
+      }
+      int failed = mkdir( path, 0755 ) != 0 && errno != EEXIST;
+      METRIC_SYSCALL();
+      if ( slash )
+      {
+         *slash = '/';
+      }
+
+      if ( failed || slash == NULL )
+      {
+         return failed ? -1 : 0;
+      }
+   }
+}
+
+// Work shared by the retrieve -a threads. Each one takes the next file off the list until
+// none are left, so a few large files don't hold up one thread while the rest sit idle.
+struct retrieve_work
+{
+   int32_t  *files;				// Directory entries of the files to retrieve
+   uint32_t  count;
+   uint32_t *next;				// Index in files of the next file to take, shared
+   char     *host_dir;
+   uint32_t  retrieved;				// Files this thread wrote out whole
+   uint64_t  bytes;
+};
+
+// retrieve -a thread: writes files out under the host directory until the list is done
+void *retrieveFiles( void *arg )
+{
+   struct retrieve_work *work = arg;
+   char host_path[PATH_MAX];
+
+   for (;;)
+   {
+      uint32_t f = __atomic_fetch_add( work->next, 1, __ATOMIC_RELAXED );
+      if ( f >= work->count )
+      {
+         break;
+      }
+
+      int32_t directory_index = work->files[f];
+      int32_t inode_index = directory[directory_index].inode;
+      if ( entryPath( work->host_dir, directory_index, host_path, PATH_MAX ) != 0 )
+      {
+         printf("ERROR: Path of %s is too long.\n", filenames[directory_index]);
+         continue;
+      }
+
+      int fd = open( host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+      METRIC_SYSCALL();
+      if ( fd < 0 )
+      {
+         printf("ERROR: Could not open %s: %s\n", host_path, strerror( errno ));
+         continue;
+      }
+
+      int failed = retrieve_fd( inode_index, fd );
+      if ( failed == -2 )
+      {
+         printf("ERROR: Checksum mismatch in %s, the output file is incomplete.\n", host_path);
+      }
+      else if ( failed )
+      {
+         printf("ERROR: Writing %s returned: %s\n", host_path, strerror( errno ));
+      }
+      else
+      {
+         work->retrieved++;
+         work->bytes += inodes[inode_index].file_size;
+      }
+
+      close( fd );
+      METRIC_SYSCALL();
+   }
+   return NULL;
+}
+
+// Name: retrieveAll
+// Parameters: host_dir - host directory to write the files under, pattern - fnmatch pattern
+//             the file names must match, or NULL for every file
+// Returns: none
+// Description: Copies files out of the image under host_dir, keeping the directories they
+//              are in, with a pool of threads writing one file each at a time. The host
+//              directories are all made before the threads start. Without a pattern empty
+//              directories are made too, so the whole tree comes out. Counts as one retrieve
+//              of all the bytes written in stats.
+void retrieveAll( char *host_dir, char *pattern )
+{
+   METRIC_BEGIN();
+
+   char     host_path[PATH_MAX];
+   int32_t *files = malloc( file_slots * sizeof(int32_t) );
+   uint32_t count = 0;
+   int32_t  made_parent = ROOT_DIRECTORY;
+
+   if ( makeHostDirectories( host_dir ) != 0 )
+   {
+      printf("ERROR: Could not create %s: %s\n", host_dir, strerror( errno ));
+      free( files );
+      return;
+   }
+
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( !directory[i].in_use )
+      {
+         continue;
+      }
+
+      // Without a pattern the whole tree comes out, empty directories included. Otherwise
+      // only the directories holding files that match are made.
+      int32_t make = -1;
+      if ( isDirectory( i ) )
+      {
+         make = pattern ? -1 : (int32_t) i;
+      }
+      else if ( !pattern || fnmatch( pattern, filenames[i], 0 ) == 0 )
+      {
+         files[count++] = i;
+
+         // Files in the same directory tend to sit together, only make it once for them
+         make = directory[i].parent != made_parent ? directory[i].parent : -1;
+         made_parent = directory[i].parent;
+      }
+
+      if ( make >= 0 && ( entryPath( host_dir, make, host_path, PATH_MAX ) != 0 ||
+                          makeHostDirectories( host_path ) != 0 ) )
+      {
+         printf("ERROR: Could not create the directory for %s.\n", filenames[make]);
+      }
+   }
+
+   if ( count == 0 )
+   {
+      printf("ERROR: No files found.\n");
+      free( files );
+      return;
+   }
+
+   struct retrieve_work work[MAX_THREADS];
+   uint32_t next = 0;
+   int threads = workerThreads() < (int) count ? workerThreads() : (int) count;
+   for (int t = 0; t < threads; t++)
+   {
+      work[t].files     = files;
+      work[t].count     = count;
+      work[t].next      = &next;
+      work[t].host_dir  = host_dir;
+      work[t].retrieved = 0;
+      work[t].bytes     = 0;
+   }
+
+   fflush( stdout );
+   runThreads( retrieveFiles, work, sizeof(struct retrieve_work), threads );
+
+   uint32_t retrieved = 0;
+   uint64_t bytes = 0;
+   for (int t = 0; t < threads; t++)
+   {
+      retrieved += work[t].retrieved;
+      bytes     += work[t].bytes;
+   }
+   printf("Retrieved %"PRIu32" of %"PRIu32" files, %"PRIu64" bytes, to %s\n",
+          retrieved, count, bytes, host_dir);
+
+   free( files );
+   METRIC_END( OP_RETRIEVE, bytes );
+}
+
+// Name: parseGrepPattern
+// Parameters: text - the pattern as typed, pattern - filled in with its bytes and shift table
+// Returns: 0 on success, -1 if the pattern is empty, too long or has a bad escape
+// Description: Words on the command line can't hold spaces or arbitrary bytes, so the pattern
+//              can use \s for a space, \t, \n, \\ and \xHH for any byte.
+int parseGrepPattern( const char *text, struct grep_pattern *pattern )
+{
+   uint32_t m = 0;
+
+   for (const char *c = text; *c; c++)
+   {
+      if ( m == GREP_PATTERN_MAX )
+      {
+         return -1;
+      }
+
+      if ( *c != '\\' )
+      {
+         pattern->bytes[m++] = *c;
+         continue;
+      }
+
+      c++;
+      if ( *c == 's' || *c == 't' || *c == 'n' || *c == '\\' )
+      {
+         pattern->bytes[m++] = *c == 's' ? ' ' : *c == 't' ? '\t' : *c == 'n' ? '\n' : '\\';
+      }
+      else if ( *c == 'x' && isxdigit( (unsigned char) c[1] ) &&
+                isxdigit( (unsigned char) c[2] ) )
+      {
+         char hex[3] = { c[1], c[2], 0 };
+         pattern->bytes[m++] = (uint8_t) strtoul( hex, NULL, 16 );
+         c += 2;
+      }
+      else
+      {
+         return -1;
+      }
+   }
+
+   if ( m == 0 )
+   {
+      return -1;
+   }
+
+   pattern->length = m;
+   for (int b = 0; b < 256; b++)
+   {
+      pattern->shift[b] = m;
+   }
+   for (uint32_t i = 0; i + 1 < m; i++)
+   {
+      pattern->shift[pattern->bytes[i]] = m - 1 - i;
+   }
+   return 0;
+}
+
+// The matches grep found in one file
+struct grep_result
+{
+   uint32_t count;
+   int32_t  status;				// 0, or -2 if a block failed its checksum
+   uint32_t offsets[GREP_MAX_LISTED];		// The first matches, in order
+};
+
+// Name: grepText
+// Parameters: pattern - what to look for, text - len bytes of the file starting at offset
+//             base, from - matches before this offset are skipped, moved past each match,
+//             limit - matches starting here or later are left for the next call,
+//             result - where the matches are counted
+// Returns: none
+// Description: Records the matches in part of a file. Moving from past each match keeps
+//              matches from overlapping, across calls too.
+void grepText( const struct grep_pattern *pattern, const uint8_t *text, uint32_t len,
+               uint32_t base, uint32_t *from, uint32_t limit, struct grep_result *result )
+{
+   while ( *from < base + len )
+   {
+      uint32_t skip = *from > base ? *from - base : 0;
+      const uint8_t *match = findPattern( pattern, text + skip, len - skip );
+      if ( match == NULL || base + ( match - text ) >= limit )
+      {
+         return;
+      }
+
+      uint32_t offset = base + ( match - text );
+      if ( result->count < GREP_MAX_LISTED )
+      {
+         result->offsets[result->count] = offset;
+      }
+      result->count++;
+      *from = offset + pattern->length;
+   }
+}
+
+// Name: grepFile
+// Parameters: pattern - what to look for, inode_index - file to search, result - filled in
+// Returns: none
+// Description: Searches a file's data where it sits in the image. Blocks that follow each
+//              other on disk are searched as one run. Only a match that starts in one run and
+//              ends in the next needs copying: the last length - 1 bytes of the run before and
+//              the first length - 1 of this one are searched together first.
+void grepFile( const struct grep_pattern *pattern, int32_t inode_index,
+               struct grep_result *result )
+{
+   struct inode  *file_inode = &inodes[inode_index];
+   uint32_t       size = file_inode->file_size;
+   uint32_t       blocks = BLOCKS_FOR_SIZE( size );
+   uint32_t       m = pattern->length;
+   uint32_t       from = 0;
+   uint8_t        seam[2 * GREP_PATTERN_MAX];
+   const uint8_t *run_end = NULL;		// Just past the run before in the image
+
+   for (uint32_t first = 0; first < blocks; )
+   {
+      int32_t  start_block = fileBlock( file_inode, first );
+      uint32_t last = first + 1;
+      while ( last < blocks &&
+              fileBlock( file_inode, last ) == start_block + (int32_t) ( last - first ) )
+      {
+         last++;
+      }
+
+      readAhead( inode_index, first, last );
+      if ( verifyFileBlocks( file_inode, first, last ) != -1 )
+      {
+         result->status = -2;
+         return;
+      }
+
+      // Every run but the last is whole blocks, longer than any pattern
+      uint32_t       run_offset = first * BLOCK_SIZE;
+      uint32_t       run_length = ( last == blocks ? size : last * BLOCK_SIZE ) - run_offset;
+      const uint8_t *run = data[start_block];
+      if ( run_end != NULL && m > 1 )
+      {
+         uint32_t head = run_length < m - 1 ? run_length : m - 1;
+         memcpy( seam, run_end - ( m - 1 ), m - 1 );
+         memcpy( seam + m - 1, run, head );
+         grepText( pattern, seam, m - 1 + head, run_offset - ( m - 1 ), &from, run_offset,
+                   result );
+      }
+      grepText( pattern, run, run_length, run_offset, &from, UINT32_MAX, result );
+
+      run_end = run + run_length;
+      first = last;
+   }
+}
+
+// Work shared by the grep threads, they take files off the list the way retrieve -a does
+struct grep_work
+{
+   int32_t                   *files;		// Directory entries of the files to search
+   uint32_t                   count;
+   uint32_t                  *next;		// Index in files of the next file to take, shared
+   const struct grep_pattern *pattern;
+   struct grep_result        *results;		// One for each file, in the same order
+   uint64_t                   bytes;		// Bytes this thread searched
+};
+
+// grep thread: searches files until the list is done
+void *grepFiles( void *arg )
+{
+   struct grep_work *work = arg;
+
+   for (;;)
+   {
+      uint32_t f = __atomic_fetch_add( work->next, 1, __ATOMIC_RELAXED );
+      if ( f >= work->count )
+      {
+         break;
+      }
+
+      int32_t inode_index = directory[work->files[f]].inode;
+      grepFile( work->pattern, inode_index, &work->results[f] );
+      work->bytes += inodes[inode_index].file_size;
+   }
+   return NULL;
+}
+
+// Name: grepCommand
+// Parameters: text - byte pattern to look for, see parseGrepPattern, glob - fnmatch pattern
+//             the file names must match, or NULL for every file
+// Returns: none
+// Description: Lists the files holding the pattern and the offsets it is found at, searching
+//              their blocks in the image directly with a pool of threads. Files are listed in
+//              directory order whichever thread searched them.
+void grepCommand( char *text, char *glob )
+{
+   METRIC_BEGIN();
+
+   struct grep_pattern pattern;
+   if ( parseGrepPattern( text, &pattern ) != 0 )
+   {
+      printf("ERROR: Pattern must be 1 to %d bytes, escapes are \\s \\t \\n \\\\ and \\xHH.\n",
+             GREP_PATTERN_MAX);
+      return;
+   }
+
+   int32_t *files = malloc( file_slots * sizeof(int32_t) );
+   uint32_t count = 0;
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( directory[i].in_use && !isDirectory( i ) &&
+           ( !glob || fnmatch( glob, filenames[i], 0 ) == 0 ) )
+      {
+         files[count++] = i;
+      }
+   }
+
+   if ( count == 0 )
+   {
+      printf("ERROR: No files found.\n");
+      free( files );
+      return;
+   }
+
+   struct grep_result *results = calloc( count, sizeof(struct grep_result) );
+   struct grep_work    work[MAX_THREADS];
+   uint32_t next = 0;
+   int threads = workerThreads() < (int) count ? workerThreads() : (int) count;
+   for (int t = 0; t < threads; t++)
+   {
+      work[t].files   = files;
+      work[t].count   = count;
+      work[t].next    = &next;
+      work[t].pattern = &pattern;
+      work[t].results = results;
+      work[t].bytes   = 0;
+   }
+   runThreads( grepFiles, work, sizeof(struct grep_work), threads );
+
+   uint64_t bytes = 0;
+   for (int t = 0; t < threads; t++)
+   {
+      bytes += work[t].bytes;
+   }
+
+   char     path[PATH_MAX];
+   uint64_t matches = 0;
+   uint32_t matched_files = 0;
+   for (uint32_t f = 0; f < count; f++)
+   {
+      struct grep_result *result = &results[f];
+      if ( result->count == 0 && result->status == 0 )
+      {
+         continue;
+      }
+      if ( entryPath( NULL, files[f], path, sizeof(path) ) != 0 )
+      {
+         snprintf( path, sizeof(path), "%.*s", MAX_FILENAME, filenames[files[f]] );
+      }
+      if ( result->status != 0 )
+      {
+         printf("ERROR: Checksum mismatch in %s, the rest of it was not searched.\n", path);
+      }
+      if ( result->count == 0 )
+      {
+         continue;
+      }
+
+      matches += result->count;
+      matched_files++;
+      printf("%s: %"PRIu32" %s at", path, result->count, result->count == 1 ? "match" : "matches");
+      for (uint32_t i = 0; i < result->count && i < GREP_MAX_LISTED; i++)
+      {
+         printf("%s %"PRIu32, i ? "," : "", result->offsets[i]);
+      }
+      printf("%s\n", result->count > GREP_MAX_LISTED ? ", ..." : "");
+   }
+   printf("%"PRIu64" %s in %"PRIu32" of %"PRIu32" files\n", matches,
+          matches == 1 ? "match" : "matches", matched_files, count);
+
+   free( results );
+   free( files );
+   METRIC_END( OP_GREP, bytes );
+}
+
+// Name: insert_stream
+// Parameters: ifp - open stream to copy from, filename - name to give the file in the image
+// Returns: none
+// Description: Copies a stream of unknown length (stdin, a FIFO, a socket) into the image.
+//              Blocks are allocated one at a time as data arrives and the file size is only
+//              known once EOF is reached. If the data does not fit the file is backed out.
+void insert_stream( FILE *ifp, char *filename )
+{
+   METRIC_BEGIN();
+
+   const char *leaf;
+   int32_t parent = checkNewPath( filename, &leaf );
+   if ( parent == NO_DIRECTORY )
+   {
+      return;
+   }
+
+   int32_t directory_entry = createEntry( parent, leaf, 0 );
+   if ( directory_entry == -1 )
+   {
+      return;
+   }
+   int32_t inode_index = directory[directory_entry].inode;
+
+   // Let stdio pull the input in large reads even though we hand it out a block at a time
+   if ( ifp != stdin )
+   {
+      setvbuf( ifp, NULL, _IOFBF, STREAM_BUFFER_SIZE );
+   }
+
+   uint32_t file_size = 0;
+   int32_t  block_count = 0;
+   int      error = 0;
+
+   // The data area is smaller than MAX_FILE_SIZE, so running out of blocks also keeps the file
+   // within its size limit
+   while ( !error )
+   {
+      int32_t block_index = allocBlock();
+      if ( block_index == -1 && reclaimTrash( RECLAIM_BATCH_BLOCKS ) )
+      {
+         block_index = allocBlock();
+      }
+      if ( block_index == -1 )
+      {
+         // Only an error if there is still more to read
+         int c = fgetc( ifp );
+         if ( c != EOF )
+         {
+            printf("ERROR: Not enough free disk sapce.\n");
+            error = 1;
+         }
+         break;
+      }
+
+      // Read straight into the data block, fread keeps reading short pipe reads until the
+      // block is full or the writer closes its end
+      TRACE_START( copy_start );
+      size_t bytes = fread( data[block_index], 1, BLOCK_SIZE, ifp );
+      TRACE_END( "copy", copy_start );
+      if ( bytes == 0 )
+      {
+         freeBlock( block_index );
+         if ( ferror( ifp ) )
+         {
+            printf("ERROR: An error occured reading from the input file.\n");
+            error = 1;
+         }
+         break;
+      }
+
+      blockWritten( block_index );
+      if ( setFileBlock( &inodes[inode_index], block_count, block_index ) != 0 )
+      {
+         freeBlock( block_index );
+         printf("ERROR: Not enough free disk sapce.\n");
+         error = 1;
+         break;
+      }
+      block_count++;
+      file_size += bytes;
+
+      if ( bytes < BLOCK_SIZE )
+      {
+         break;
+      }
+   }
+
+   // Leave stdin usable for the next command after the user ends the data with ^D
+   clearerr( ifp );
+
+   if ( error )
+   {
+      // Hand back the entry and every block we took so a failed insert leaves the image
+      // unchanged
+      discardEntry( directory_entry );
+      return;
+   }
+
+   printf("Read %"PRIu32" bytes into %s\n", file_size, filename );
+
+   // The file is timed from when its data finished arriving
+   time_t t;
+   inodes[inode_index].file_size = file_size;
+   inodes[inode_index].t = time(&t);
+
+   METRIC_END( OP_INSERT, file_size );
+}
+
+void insert( char* filename)
+{
+   METRIC_BEGIN();
+
+   // Verify filename isn't null
+   if (filename == NULL)
+   {
+      printf("ERROR: Filename is NULL.\n");
+      return;
+   }
+
+   // verify the file exists
+   // read man page for stat for more details
+   struct stat buf;
+   int ret = stat( filename, &buf );
+
+   if ( ret == -1 )
+   {
+      printf("ERROR: File does not exist.\n");
+      return;
+   }
+
+   // Verify file isn't too big (10MB Limit)
+   if ( buf.st_size > MAX_FILE_SIZE )
+   {
+      printf("ERROR: File size is too large.\n");
+      return;
+   }
+
+   // Pipes, FIFOs and sockets have no size up front, so copy them until EOF instead
+   if ( !S_ISREG( buf.st_mode ) )
+   {
+      FILE *ifp = fopen( filename, "r" );
+      if ( ifp == NULL )
+      {
+         printf("ERROR: Could not open %s.\n", filename);
+         return;
+      }
+      insert_stream( ifp, filename );
+      fclose( ifp );
+      return;
+   }
+
+   // The file keeps its path, the directories in it must already be in the image
+   const char *leaf;
+   int32_t parent = checkNewPath( filename, &leaf );
+   if ( parent == NO_DIRECTORY )
+   {
+      return;
+   }
+
+   // Take the directory entry and inode before reserving the file's blocks, growing the
+   // tables for them uses data blocks from the same free space
+   int32_t directory_entry = createEntry( parent, leaf, 0 );
+   if ( directory_entry == -1 )
+   {
+      return;
+   }
+   int32_t inode_index = directory[directory_entry].inode;
+
+   // Verify the is enough space, deleted files are reclaimed to make room if they have to be
+   if ( !reserveBlocks( FILE_BLOCKS( buf.st_size ) ) )
+   {
+      printf("ERROR: Not enough free disk sapce.\n");
+      discardEntry( directory_entry );
+      return;
+   }
+
+   // Open the input file read-only 
+    FILE *ifp = fopen ( filename, "r" ); 
+    if ( ifp == NULL )
+    {
+       printf("ERROR: Could not open %s.\n", filename);
+       discardEntry( directory_entry );
+       return;
+    }
+    printf("Reading %d bytes from %s\n", (int) buf . st_size, filename );
+ 
+    // Save off the size of the input file since we'll use it in a couple of places and 
+    // also initialize our index variables to zero. 
+    int32_t copy_size   = buf . st_size;
+
+    // We want to copy and write in chunks of BLOCK_SIZE. So to do this 
+    // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
+    // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
+    int32_t offset      = 0;               
+
+    // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
+    // memory pool. Why? We are simulating the way the file system stores file data in
+    // blocks of space on the disk. block_index will keep us pointing to the area of
+    // the area that we will read from or write to.
+    int32_t block_index = -1;
+
+   // mark the file size of the file, createEntry set up the rest of the inode
+   inodes[inode_index].file_size = buf.st_size;
+
+   // copy_size is initialized to the size of the input file so each loop iteration we
+   // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
+   // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
+   // we have copied all the data from the input file.
+   while( copy_size > 0 )
+   {
+      fseek( ifp, offset, SEEK_SET );
+ 
+      // Read BLOCK_SIZE number of bytes from the input file and store them in our
+      // data array. 
+
+      // Find a free block
+      block_index = allocBlock();
+
+      // Every failure from here on takes the half copied file back out of the image
+      if ( block_index == -1 )
+      {
+         printf("ERROR: Cannont find free block.\n");
+         fclose( ifp );
+         discardEntry( directory_entry );
+         return;
+      }
+
+      TRACE_START( copy_start );
+      int32_t bytes  = fread( data[block_index], BLOCK_SIZE, 1, ifp );
+      TRACE_END( "copy", copy_start );
+      blockWritten( block_index );
+
+      //save the block in the inode, space for its indirect blocks was reserved up front
+      if ( setFileBlock( &inodes[inode_index], offset / BLOCK_SIZE, block_index ) != 0 )
+      {
+         printf("ERROR: Cannont find free block.\n");
+         freeBlock( block_index );
+         fclose( ifp );
+         discardEntry( directory_entry );
+         return;
+      }
+
+
+      // If bytes == 0 and we haven't reached the end of the file then something is 
+      // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
+      // It means we've reached the end of our input file.
+      if( bytes == 0 && !feof( ifp ) )
+      {
+        printf("ERROR: An error occured reading from the input file.\n");
+        fclose( ifp );
+        discardEntry( directory_entry );
+        return;
+      }
+
+      // Clear the EOF file flag.
+      clearerr( ifp );
+
+      // Reduce copy_size by the BLOCK_SIZE bytes.
+      copy_size -= BLOCK_SIZE;
+      
+      // Increase the offset into our input file by BLOCK_SIZE.  This will allow
+      // the fseek at the top of the loop to position us to the correct spot.
+      offset    += BLOCK_SIZE;
+    }
+
+    // We are done copying from the input file so close it out.
+    fclose( ifp );
+
+   METRIC_END( OP_INSERT, buf.st_size );
+
+   // find free inodes and place file
+}
+
+// ustar header, the 512 byte record in front of every file and directory in a tar archive.
+// The numbers in it are written as octal text.
+struct tar_header
+{
+   char name[100];
+   char mode[8];
+   char uid[8];
+   char gid[8];
+   char size[12];
+   char mtime[12];
+   char checksum[8];
+   char typeflag;				// '0' for a file, '5' for a directory
+   char linkname[100];
+   char magic[6];				// "ustar" and a NUL, GNU tar puts "ustar " here
+   char version[2];
+   char uname[32];
+   char gname[32];
+   char devmajor[8];
+   char devminor[8];
+   char prefix[155];				// Leading directories of a path too long for name
+   char pad[12];
+};
+
+// Used to write the two records that end an archive and to pad file data out to a record
+const uint8_t tar_zeros[2 * TAR_BLOCK_SIZE];
+
+// Adds up the bytes of a header with the checksum field counted as spaces, the way tar does
+int64_t tarChecksum( struct tar_header *header )
+{
+   uint8_t *bytes = (uint8_t *) header;
+   int64_t  sum = 8 * ' ';
+
+   for (size_t i = 0; i < sizeof(struct tar_header); i++)
+   {
+      sum += bytes[i];
+   }
+   for (size_t i = 0; i < sizeof(header->checksum); i++)
+   {
+      sum -= (uint8_t) header->checksum[i];
+   }
+   return sum;
+}
+
+// Reads an octal number field, which may be padded with spaces or NULs, or returns -1 if it
+// holds something else
+int64_t tarNumber( const char *field, size_t size )
+{
+   int64_t value = 0;
+   size_t  i = 0;
+
+   while ( i < size && field[i] == ' ' )
+   {
+      i++;
+   }
+   for ( ; i < size && field[i] >= '0' && field[i] <= '7'; i++ )
+   {
+      value = value * 8 + ( field[i] - '0' );
+   }
+   return i == size || field[i] == ' ' || field[i] == '\0' ? value : -1;
+}
+
+// Name: tarHeader
+// Parameters: header - filled in, directory_index - file or directory it describes
+// Returns: 0 on success, -1 if the path is too long for a ustar header
+// Description: A path longer than the name field is split at a "/" between prefix and name.
+//              Read only files are given mode 0444 and the rest 0644, directories 0755.
+int tarHeader( struct tar_header *header, int32_t directory_index )
+{
+   struct inode *entry_inode = &inodes[directory[directory_index].inode];
+   int           is_directory = isDirectory( directory_index );
+   char          path[TAR_PATH_MAX];
+
+   memset( header, 0, sizeof(struct tar_header) );
+   if ( entryPath( NULL, directory_index, path, sizeof(path) - 1 ) != 0 )
+   {
+      return -1;
+   }
+
+   size_t length = strlen( path );
+   if ( is_directory )
+   {
+      path[length++] = '/';
+      path[length] = '\0';
+   }
+
+   const char *name = path;
+   if ( length > sizeof(header->name) )
+   {
+      char *split = strchr( path + length - sizeof(header->name) - 1, '/' );
+      if ( split == NULL || split == path + length - 1 ||
+           (size_t) ( split - path ) > sizeof(header->prefix) )
+      {
+         return -1;
+      }
+      memcpy( header->prefix, path, split - path );
+      name = split + 1;
+   }
+   memcpy( header->name, name, strlen( name ) );
+
+   int mode = is_directory ? 0755 : ( entry_inode->attribute & READONLY ) ? 0444 : 0644;
+   snprintf( header->mode, sizeof(header->mode), "%07o", mode );
+   snprintf( header->uid, sizeof(header->uid), "%07o", 0 );
+   snprintf( header->gid, sizeof(header->gid), "%07o", 0 );
+   snprintf( header->size, sizeof(header->size), "%011"PRIo32,
+             is_directory ? 0 : entry_inode->file_size );
+   snprintf( header->mtime, sizeof(header->mtime), "%011llo",
+             (unsigned long long) entry_inode->t );
+   header->typeflag = is_directory ? '5' : '0';
+   memcpy( header->magic, "ustar", 6 );
+   memcpy( header->version, "00", 2 );
+
+   snprintf( header->checksum, sizeof(header->checksum), "%06o", (int) tarChecksum( header ) );
+   header->checksum[7] = ' ';
+   return 0;
+}
+
+// State of an export as it works through the directory
+struct tar_export
+{
+   int       fd;
+   FILE     *messages;				// stderr when the archive is going to stdout
+   uint8_t  *written;				// Set for every directory entry already handled
+   uint32_t  files;
+   uint32_t  directories;
+   uint64_t  bytes;
+};
+
+// Name: exportEntry
+// Parameters: export - export in progress, directory_index - file or directory to write
+// Returns: 0 on success, -1 if writing failed, -2 if a block failed its checksum
+// Description: Writes the header and, for a file, the data straight from the image blocks
+//              padded out to a whole record. The directories above the entry go first if they
+//              haven't been written yet, so everything comes after the directory it is in.
+int exportEntry( struct tar_export *export, int32_t directory_index )
+{
+   if ( export->written[directory_index] )
+   {
+      return 0;
+   }
+   export->written[directory_index] = 1;
+
+   int32_t parent = directory[directory_index].parent;
+   int failed = parent >= 0 && (uint32_t) parent < file_slots ? exportEntry( export, parent ) : 0;
+   if ( failed )
+   {
+      return failed;
+   }
+
+   struct tar_header header;
+   if ( tarHeader( &header, directory_index ) != 0 )
+   {
+      fprintf( export->messages, "ERROR: The path of %s is too long for tar, it is left out.\n",
+               filenames[directory_index] );
+      return 0;
+   }
+   if ( write_all( export->fd, (uint8_t *) &header, sizeof(header) ) != 0 )
+   {
+      return -1;
+   }
+   if ( isDirectory( directory_index ) )
+   {
+      export->directories++;
+      return 0;
+   }
+
+   int32_t  inode_index = directory[directory_index].inode;
+   uint32_t size = inodes[inode_index].file_size;
+   failed = retrieve_fd( inode_index, export->fd );
+   if ( failed == -2 )
+   {
+      fprintf( export->messages, "ERROR: Checksum mismatch in %s.\n",
+               filenames[directory_index] );
+      return failed;
+   }
+   uint32_t padding = ( TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE ) % TAR_BLOCK_SIZE;
+   if ( failed || write_all( export->fd, tar_zeros, padding ) != 0 )
+   {
+      return -1;
+   }
+
+   export->files++;
+   export->bytes += size;
+   return 0;
+}
+
+// Name: exportTar
+// Parameters: tar_name - host file to write the archive to, or "-" for stdout
+// Returns: none
+// Description: Writes every file and directory in the image to a ustar archive in one pass
+//              over the directory, without staging anything on disk. Files in the trash are
+//              left out. A file that can't be written whole leaves no archive behind.
+void exportTar( char *tar_name )
+{
+   METRIC_BEGIN();
+
+   struct tar_export export = { 0 };
+   int to_stdout = !strcmp( tar_name, "-" );
+
+   export.messages = to_stdout ? stderr : stdout;
+   if ( to_stdout )
+   {
+      // Anything already printed has to go out before the archive
+      fflush( stdout );
+      export.fd = STDOUT_FILENO;
+   }
+   else
+   {
+      export.fd = open( tar_name, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+      METRIC_SYSCALL();
+      if ( export.fd < 0 )
+      {
+         printf("ERROR: Could not create %s: %s\n", tar_name, strerror( errno ));
+         return;
+      }
+   }
+
+   export.written = calloc( file_slots, 1 );
+   int failed = 0;
+   for (uint32_t i = 0; i < file_slots && !failed; i++)
+   {
+      if ( directory[i].in_use )
+      {
+         failed = exportEntry( &export, i );
+      }
+   }
+   if ( !failed )
+   {
+      failed = write_all( export.fd, tar_zeros, sizeof(tar_zeros) );
+   }
+   free( export.written );
+
+   if ( failed == -1 )
+   {
+      fprintf( export.messages, "ERROR: Writing %s returned: %s\n", tar_name, strerror( errno ) );
+   }
+   if ( !to_stdout )
+   {
+      close( export.fd );
+      METRIC_SYSCALL();
+      if ( failed )
+      {
+         unlink( tar_name );
+         return;
+      }
+      printf("Exported %"PRIu32" files and %"PRIu32" directories, %"PRIu64" bytes, to %s\n",
+             export.files, export.directories, export.bytes, tar_name);
+   }
+
+   if ( !failed )
+   {
+      METRIC_END( OP_RETRIEVE, export.bytes );
+   }
+}
+
+// Reads past n bytes of an archive, it may be a pipe so seeking is no use. Returns 0, or -1
+// if the archive ends first.
+int tarSkip( FILE *ifp, uint64_t n )
+{
+   uint8_t buffer[TAR_BLOCK_SIZE];
+
+   while ( n > 0 )
+   {
+      size_t chunk = n < sizeof(buffer) ? n : sizeof(buffer);
+      if ( fread( buffer, 1, chunk, ifp ) != chunk )
+      {
+         return -1;
+      }
+      n -= chunk;
+   }
+   return 0;
+}
+
+// Puts the path an archive entry names into path: prefix and name joined, without any
+// leading "/" or "./" or trailing "/". The prefix is only used in POSIX ustar headers, GNU
+// tar keeps other fields there.
+void tarPath( struct tar_header *header, char *path )
+{
+   char full[TAR_PATH_MAX];
+
+   if ( header->prefix[0] != '\0' && !memcmp( header->magic, "ustar", 6 ) )
+   {
+      snprintf( full, sizeof(full), "%.155s/%.100s", header->prefix, header->name );
+   }
+   else
+   {
+      snprintf( full, sizeof(full), "%.100s", header->name );
+   }
+
+   char *start = full;
+   while ( start[0] == '/' || ( start[0] == '.' && start[1] == '/' ) )
+   {
+      start += start[0] == '/' ? 1 : 2;
+   }
+
+   size_t length = strlen( start );
+   while ( length > 0 && start[length - 1] == '/' )
+   {
+      start[--length] = '\0';
+   }
+   if ( !strcmp( start, "." ) )
+   {
+      start[0] = '\0';
+   }
+   memcpy( path, start, strlen( start ) + 1 );
+}
+
+// Makes each directory along a path that isn't in the image yet, the last name in the path
+// is left for the caller
+void importParents( char *path )
+{
+   for (char *slash = strchr( path, '/' ); slash != NULL; slash = strchr( slash + 1, '/' ))
+   {
+      *slash = '\0';
+      if ( findDirectoryEntry( path ) == -1 )
+      {
+         makeDirectory( path );
+      }
+      *slash = '/';
+   }
+}
+
+// Name: importFile
+// Parameters: ifp - archive, positioned at the file's data, path - where the file goes,
+//             size - bytes of data, attribute - attributes to give it, t - modification time
+// Returns: 0 if the file was added, 1 if it was left out, -1 if the archive ended early
+// Description: Reads the data straight into newly allocated blocks. A file that can't be
+//              added has its data read past so the next header can be found, and one the
+//              archive ends in the middle of is taken out again.
+int importFile( FILE *ifp, char *path, uint64_t size, uint8_t attribute, time_t t )
+{
+   const char *leaf;
+   int32_t parent = checkNewPath( path, &leaf );
+   if ( parent == NO_DIRECTORY )
+   {
+      return tarSkip( ifp, size ) == 0 ? 1 : -1;
+   }
+
+   if ( size > MAX_FILE_SIZE )
+   {
+      printf("ERROR: Not enough free disk space for %s.\n", path);
+      return tarSkip( ifp, size ) == 0 ? 1 : -1;
+   }
+
+   // The entry comes first, growing the tables for it uses data blocks from the same free
+   // space the file's blocks are reserved from
+   int32_t directory_entry = createEntry( parent, leaf, 0 );
+   if ( directory_entry == -1 )
+   {
+      return tarSkip( ifp, size ) == 0 ? 1 : -1;
+   }
+
+   if ( !reserveBlocks( FILE_BLOCKS( size ) ) )
+   {
+      printf("ERROR: Not enough free disk space for %s.\n", path);
+      discardEntry( directory_entry );
+      return tarSkip( ifp, size ) == 0 ? 1 : -1;
+   }
+
+   struct inode *file_inode = &inodes[directory[directory_entry].inode];
+   for (uint32_t j = 0; j < BLOCKS_FOR_SIZE( size ); j++)
+   {
+      uint32_t bytes = size - (uint64_t) j * BLOCK_SIZE < BLOCK_SIZE ?
+                       size - (uint64_t) j * BLOCK_SIZE : BLOCK_SIZE;
+      int32_t  block_index = allocBlock();
+      if ( block_index != -1 && setFileBlock( file_inode, j, block_index ) != 0 )
+      {
+         freeBlock( block_index );
+         block_index = -1;
+      }
+      if ( block_index == -1 )
+      {
+         // The reservation should have covered this, leave the file out rather than write
+         // outside the data blocks
+         printf("ERROR: Not enough free disk space for %s.\n", path);
+         discardEntry( directory_entry );
+         return tarSkip( ifp, size - (uint64_t) j * BLOCK_SIZE ) == 0 ? 1 : -1;
+      }
+
+      size_t got = fread( data[block_index], 1, bytes, ifp );
+      memset( data[block_index] + got, 0, BLOCK_SIZE - got );
+      blockWritten( block_index );
+
+      if ( got < bytes )
+      {
+         discardEntry( directory_entry );
+         return -1;
+      }
+   }
+
+   file_inode->file_size = size;
+   file_inode->attribute = attribute;
+   file_inode->t = t;
+   return 0;
+}
+
+// Name: importTar
+// Parameters: tar_name - host file holding a tar archive, or "-" for stdin
+// Returns: none
+// Description: Adds the files and directories in a ustar, GNU or pax archive to the image,
+//              reading it front to back with nothing staged on disk, so it can come down a
+//              pipe. Directories the archive leaves out are made for the files in them.
+//              Links, devices and files whose names are taken or not allowed are skipped.
+//              Each file counts as an insert in stats.
+void importTar( char *tar_name )
+{
+   FILE *ifp = strcmp( tar_name, "-" ) ? fopen( tar_name, "r" ) : stdin;
+   if ( ifp == NULL )
+   {
+      printf("ERROR: Could not open %s.\n", tar_name);
+      return;
+   }
+   if ( ifp != stdin )
+   {
+      setvbuf( ifp, NULL, _IOFBF, STREAM_BUFFER_SIZE );
+   }
+
+   struct tar_header header;
+   char     path[TAR_PATH_MAX];
+   uint32_t files = 0;
+   uint32_t directories = 0;
+   uint32_t skipped = 0;
+   uint64_t bytes = 0;
+   int      result = 0;
+
+   // The archive ends with an all zero record, or just stops
+   while ( result >= 0 && fread( &header, sizeof(header), 1, ifp ) == 1 && header.name[0] )
+   {
+      METRIC_BEGIN();
+
+      int64_t size  = tarNumber( header.size, sizeof(header.size) );
+      int64_t mode  = tarNumber( header.mode, sizeof(header.mode) );
+      int64_t mtime = tarNumber( header.mtime, sizeof(header.mtime) );
+      if ( size < 0 || mode < 0 || mtime < 0 ||
+           tarNumber( header.checksum, sizeof(header.checksum) ) != tarChecksum( &header ) )
+      {
+         printf("ERROR: %s is not a tar archive or is damaged.\n", tar_name);
+         break;
+      }
+
+      tarPath( &header, path );
+      uint64_t padding = ( TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE ) % TAR_BLOCK_SIZE;
+
+      if ( path[0] == '\0' )
+      {
+         // The archive's own top directory
+         result = tarSkip( ifp, size + padding );
+      }
+      else if ( header.typeflag == '5' )
+      {
+         int32_t existing = findDirectoryEntry( path );
+         if ( existing == -1 )
+         {
+            const char *leaf;
+            importParents( path );
+            int32_t parent = checkNewPath( path, &leaf );
+            if ( parent != NO_DIRECTORY && createEntry( parent, leaf, DIRECTORY ) != -1 )
+            {
+               directories++;
+            }
+            else
+            {
+               skipped++;
+            }
+         }
+         else if ( !isDirectory( existing ) )
+         {
+            printf("ERROR: %s already exists.\n", path);
+            skipped++;
+         }
+         result = tarSkip( ifp, size + padding );
+      }
+      else if ( header.typeflag == '0' || header.typeflag == '\0' || header.typeflag == '7' )
+      {
+         importParents( path );
+         result = importFile( ifp, path, size, mode & 0222 ? 0 : READONLY, mtime );
+         if ( result == 0 )
+         {
+            files++;
+            bytes += size;
+            METRIC_END( OP_INSERT, size );
+         }
+         skipped += result == 1;
+         result = result < 0 ? result : tarSkip( ifp, padding );
+      }
+      else
+      {
+         // Links and devices, and the extended headers pax and GNU tar put before entries
+         if ( !strchr( "xgLK", header.typeflag ) )
+         {
+            printf("import: %s is not a file or directory, skipping it.\n", path);
+            skipped++;
+         }
+         result = tarSkip( ifp, size + padding );
+      }
+
+      if ( result < 0 )
+      {
+         printf("ERROR: %s ends in the middle of %s.\n", tar_name, path);
+      }
+   }
+
+   // Leave stdin usable for the next command
+   clearerr( ifp );
+   if ( ifp != stdin )
+   {
+      fclose( ifp );
+   }
+
+   printf("Imported %"PRIu32" files and %"PRIu32" directories, %"PRIu64" bytes, %"PRIu32
+          " skipped\n", files, directories, bytes, skipped);
+}
+
+// Name: file_truncate
+// Parameters: inode_index - file to resize, size - new size in bytes
+// Returns: 0 on success, -1 if the new size does not fit
+// Description: Grows or shrinks a file in place. Shrinking drops the tail blocks, growing
+//              allocates new blocks. Bytes added to the file read as zero, the same as a
+//              truncate on a host filesystem. The last block kept and the indirect block
+//              holding it are copied first if a snapshot shares them.
+int file_truncate( int32_t inode_index, uint32_t size )
+{
+   struct inode *file_inode = &inodes[inode_index];
+   uint32_t old_size   = file_inode->file_size;
+   uint32_t old_blocks = BLOCKS_FOR_SIZE( old_size );
+   uint32_t new_blocks = BLOCKS_FOR_SIZE( size );
+
+   if ( size > MAX_FILE_SIZE )
+   {
+      printf("ERROR: File size is too large.\n");
+      return -1;
+   }
+
+   uint32_t needed = new_blocks > old_blocks ? FILE_BLOCKS( size ) - FILE_BLOCKS( old_size ) : 0;
+   uint32_t edge = new_blocks < old_blocks ? new_blocks : old_blocks;
+   if ( edge > 0 )
+   {
+      needed += sharedBlocks( file_inode, edge - 1, edge );
+   }
+
+   if ( needed > 0 && !reserveBlocks( needed ) )
+   {
+      printf("ERROR: Not enough free disk space.\n");
+      return -1;
+   }
+
+   // Whatever sits after the old end of file in its last block is garbage, clear it so it
+   // does not reappear as file data when the file grows
+   if ( size > old_size && old_size % BLOCK_SIZE != 0 )
+   {
+      uint32_t tail = old_size % BLOCK_SIZE;
+      int32_t last_block = writableFileBlock( file_inode, old_blocks - 1 );
+      memset( &data[last_block][tail], 0, BLOCK_SIZE - tail );
+      blockWritten( last_block );
+   }
+
+   for ( uint32_t i = old_blocks; i < new_blocks; i++ )
+   {
+      int32_t block_index = allocBlock();
+      memset( data[block_index], 0, BLOCK_SIZE );
+      blockWritten( block_index );
+      setFileBlock( file_inode, i, block_index );
+   }
+
+   trimFileBlocks( file_inode, new_blocks, 1 );
+
+   time_t t;
+   file_inode->file_size = size;
+   file_inode->t = time(&t);
+   return 0;
+}
+
+// Name: file_pwrite
+// Parameters: inode_index - file to write, buf - bytes to write, len - number of bytes,
+//             offset - byte offset in the file to write at
+// Returns: 0 on success, -1 if the write would not fit
+// Description: Overwrites part of a file in place, only touching the blocks that cover
+//              [offset, offset + len). Writing past the end grows the file first, and a gap
+//              between the old end and offset reads back as zeros.
+int file_pwrite( int32_t inode_index, const uint8_t *buf, uint32_t len, uint32_t offset )
+{
+   struct inode *file_inode = &inodes[inode_index];
+
+   if ( (uint64_t) offset + len > MAX_FILE_SIZE )
+   {
+      printf("ERROR: File size is too large.\n");
+      return -1;
+   }
+
+   if ( offset + len > file_inode->file_size && file_truncate( inode_index, offset + len ) )
+   {
+      return -1;
+   }
+
+   // Blocks a snapshot shares are copied before they are written
+   if ( !reserveBlocks( sharedBlocks( file_inode, offset / BLOCK_SIZE,
+                                      BLOCKS_FOR_SIZE( offset + len ) ) ) )
+   {
+      printf("ERROR: Not enough free disk space.\n");
+      return -1;
+   }
+
+   TRACE_START( copy_start );
+   while ( len > 0 )
+   {
+      uint32_t block_offset = offset % BLOCK_SIZE;
+      uint32_t num_bytes = BLOCK_SIZE - block_offset;
+      if ( num_bytes > len )
+      {
+         num_bytes = len;
+      }
+
+      int32_t block_index = writableFileBlock( file_inode, offset / BLOCK_SIZE );
+      memcpy( &data[block_index][block_offset], buf, num_bytes );
+      blockWritten( block_index );
+
+      buf    += num_bytes;
+      offset += num_bytes;
+      len    -= num_bytes;
+   }
+   TRACE_END( "copy", copy_start );
+
+   time_t t;
+   file_inode->t = time(&t);
+   return 0;
+}
+
+// Looks up a file that is about to be modified, printing why if it can't be
+int32_t findWritableFile( char *filename )
+{
+   int32_t directory_index = findFile( filename );
+   if ( directory_index == -1 )
+   {
+      printf("ERROR: File not found.\n");
+      return -1;
+   }
+
+   int32_t inode_index = directory[directory_index].inode;
+   if ( inodes[inode_index].attribute & READONLY )
+   {
+      printf("ERROR: File is read-only.\n");
+      return -1;
+   }
+   return inode_index;
+}
+
+// Name: writeFile
+// Parameters: filename - file in the image, offset - where to write, or -1 to append,
+//             hostfile - host file holding the bytes to write
+// Returns: none
+// Description: Implements the write and append commands by copying hostfile into the file
+//              with file_pwrite in WRITE_CHUNK_SIZE pieces.
+void writeFile( char *filename, int64_t offset, char *hostfile )
+{
+   METRIC_BEGIN();
+
+   int32_t inode_index = findWritableFile( filename );
+   if ( inode_index == -1 )
+   {
+      return;
+   }
+
+   if ( offset < 0 )
+   {
+      offset = inodes[inode_index].file_size;
+   }
+
+   FILE *ifp = fopen( hostfile, "r" );
+   if ( ifp == NULL )
+   {
+      printf("ERROR: File does not exist.\n");
+      return;
+   }
+
+   // Check the whole write up front when we can, so it doesn't fail half way through
+   struct stat buf;
+   if ( fstat( fileno( ifp ), &buf ) == 0 && S_ISREG( buf.st_mode ) )
+   {
+      uint64_t end = (uint64_t) offset + buf.st_size;
+      uint32_t size = inodes[inode_index].file_size;
+
+      if ( end > MAX_FILE_SIZE )
+      {
+         printf("ERROR: File size is too large.\n");
+         fclose( ifp );
+         return;
+      }
+
+      if ( end > size && 
+           !reserveBlocks( FILE_BLOCKS( end ) - FILE_BLOCKS( size ) ) )
+      {
+         printf("ERROR: Not enough free disk space.\n");
+         fclose( ifp );
+         return;
+      }
+   }
+
+   uint8_t *buffer = malloc( WRITE_CHUNK_SIZE );
+   uint64_t written = 0;
+   size_t   bytes;
+
+   while ( ( bytes = fread( buffer, 1, WRITE_CHUNK_SIZE, ifp ) ) > 0 )
+   {
+      if ( file_pwrite( inode_index, buffer, bytes, offset + written ) )
+      {
+         break;
+      }
+      written += bytes;
+   }
+
+   printf("Wrote %"PRIu64" bytes to %s\n", written, filename );
+
+   free( buffer );
+   fclose( ifp );
+   METRIC_END( OP_WRITE, written );
+}
+
+// Name: truncateFile
+// Parameters: filename - file in the image, size - new size in bytes
+// Returns: none
+// Description: Implements the truncate command.
+void truncateFile( char *filename, int64_t size )
+{
+   METRIC_BEGIN();
+
+   int32_t inode_index = findWritableFile( filename );
+   if ( inode_index == -1 )
+   {
+      return;
+   }
+
+   if ( size < 0 )
+   {
+      printf("ERROR: Size must not be negative.\n");
+      return;
+   }
+
+   if ( size > MAX_FILE_SIZE )
+   {
+      printf("ERROR: File size is too large.\n");
+      return;
+   }
+
+   if ( file_truncate( inode_index, size ) == 0 )
+   {
+      METRIC_END( OP_TRUNCATE, 0 );
+   }
+}
+
+// Name: defragFiles
+// Parameters: owner - filled in with the owner of every data block, indexed from
+//             FIRST_DATA_BLOCK, files - filled in with the inodes that own blocks
+// Returns: number of inodes put in files
+// Description: Builds the reverse block map defrag works from. Files in the trash own their
+//              blocks too, so they are moved like any other file and can still be undeleted. A
+//              block claimed twice is marked OWNER_CONFLICT so that neither claim is moved, and
+//              so is a block a snapshot shares, since the snapshot would still point at it.
+int32_t defragFiles( int64_t *owner, int32_t *files )
+{
+   uint8_t *seen = calloc( file_slots, 1 );
+   int32_t file_count = 0;
+
+   for (int i = 0; i < DATA_BLOCKS; i++)
+   {
+      owner[i] = OWNER_NONE;
+   }
+
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      int32_t inode_index = directory[i].inode;
+      if ( inode_index < 0 || (uint32_t) inode_index >= file_slots || seen[inode_index] )
+      {
+         continue;
+      }
+
+      if ( !directory[i].in_use && !inTrash( i ) )
+      {
+         continue;
+      }
+      seen[inode_index] = 1;
+
+      uint32_t block_count = BLOCKS_FOR_SIZE( inodes[inode_index].file_size );
+      for (uint32_t j = 0; j < block_count && j < BLOCKS_PER_FILE; j++)
+      {
+         int32_t block_index = fileBlock( &inodes[inode_index], j );
+         if ( block_index < FIRST_DATA_BLOCK || block_index >= NUM_BLOCKS )
+         {
+            continue;
+         }
+
+         int32_t rel = block_index - FIRST_DATA_BLOCK;
+         owner[rel] = owner[rel] == OWNER_NONE && !isShared( block_index ) ?
+                      OWNER_ID( inode_index, j ) : OWNER_CONFLICT;
+      }
+
+      if ( block_count > 0 )
+      {
+         files[file_count++] = inode_index;
+      }
+   }
+
+   free( seen );
+   return file_count;
+}
+
+// qsort comparison putting files in the order their first blocks sit on disk
+int compareFirstBlock( const void *a, const void *b )
+{
+   int32_t first_a = inodes[*(const int32_t *) a].direct[0];
+   int32_t first_b = inodes[*(const int32_t *) b].direct[0];
+   return ( first_a > first_b ) - ( first_a < first_b );
+}
+
+// Name: defrag
+// Parameters: budget - most blocks to move in this call, or -1 for no limit,
+//             complete - set to 1 if every file is laid out, 0 if the budget ran out first
+// Returns: number of blocks moved
+// Description: Lays files out one after another in contiguous runs from the start of the data
+//              area, in the order they already sit on disk, so free space ends up in one run
+//              at the end. Each block goes to the next target slot: if the slot is free the
+//              block is moved there, if another file's block is in the way the two are
+//              swapped. Blocks already in place cost nothing, so calling this repeatedly with
+//              a small budget makes steady progress and needs no saved state between calls.
+//              Indirect blocks and table blocks stay where they are and are stepped over.
+int32_t defrag( int32_t budget, int *complete )
+{
+   int64_t *owner = malloc( DATA_BLOCKS * sizeof(int64_t) );
+   int32_t *files = malloc( file_slots * sizeof(int32_t) );
+   int32_t  file_count = defragFiles( owner, files );
+   int32_t  moved = 0;
+   int32_t  target = 0;
+   uint8_t  swap_buffer[BLOCK_SIZE];
+
+   qsort( files, file_count, sizeof(int32_t), compareFirstBlock );
+
+   *complete = 1;
+   for (int f = 0; f < file_count && *complete; f++)
+   {
+      struct inode *file_inode = &inodes[files[f]];
+      uint32_t block_count = BLOCKS_FOR_SIZE( file_inode->file_size );
+
+      for (uint32_t j = 0; j < block_count; j++)
+      {
+         int32_t cur = fileBlock( file_inode, j ) - FIRST_DATA_BLOCK;
+         if ( cur < 0 || cur >= DATA_BLOCKS || owner[cur] != OWNER_ID( files[f], j ) )
+         {
+            // Out of range or shared with another file, leave it where it is
+            continue;
+         }
+
+         // Blocks nobody owns but that are not free can't be moved, step over them
+         while ( target < DATA_BLOCKS && owner[target] != OWNER_ID( files[f], j ) &&
+                 ( owner[target] == OWNER_CONFLICT ||
+                   ( owner[target] == OWNER_NONE && block_refs[target] != 0 ) ) )
+         {
+            target++;
+         }
+
+         if ( cur == target )
+         {
+            target++;
+            continue;
+         }
+
+         // A move costs one block of budget and a swap two
+         int32_t cost = owner[target] == OWNER_NONE ? 1 : 2;
+         if ( budget >= 0 && moved + cost > budget )
+         {
+            *complete = 0;
+            break;
+         }
+
+         // Changing a block pointer can need an indirect block copied or taken, and with the
+         // disk full that fails. The block is then put back and the pass stops there.
+         if ( owner[target] == OWNER_NONE )
+         {
+            // Free slot, move the block into it. The slot is marked used first so an indirect
+            // block taken for the new pointer can't land on it.
+            copyBlock( target + FIRST_DATA_BLOCK, cur + FIRST_DATA_BLOCK );
+            block_refs[target] = 1;
+            if ( setFileBlock( file_inode, j, target + FIRST_DATA_BLOCK ) != 0 )
+            {
+               block_refs[target] = 0;
+               printf("ERROR: Not enough disk space to move blocks, defrag stopped.\n");
+               *complete = 0;
+               break;
+            }
+            block_refs[cur] = 0;
+            owner[target] = owner[cur];
+            owner[cur] = OWNER_NONE;
+            moved++;
+         }
+         else
+         {
+            // Another file's block is in the way, trade places with it. Both pointers are
+            // changed before the data so a failure leaves the blocks as they were.
+            int32_t other_inode = owner[target] / BLOCKS_PER_FILE;
+            int32_t other_idx   = owner[target] % BLOCKS_PER_FILE;
+
+            if ( setFileBlock( &inodes[other_inode], other_idx, cur + FIRST_DATA_BLOCK ) != 0 )
+            {
+               printf("ERROR: Not enough disk space to move blocks, defrag stopped.\n");
+               *complete = 0;
+               break;
+            }
+            if ( setFileBlock( file_inode, j, target + FIRST_DATA_BLOCK ) != 0 )
+            {
+               // The other file's indirect block is its own now, pointing back can't fail
+               setFileBlock( &inodes[other_inode], other_idx, target + FIRST_DATA_BLOCK );
+               printf("ERROR: Not enough disk space to move blocks, defrag stopped.\n");
+               *complete = 0;
+               break;
+            }
+
+            uint32_t swap_crc = block_crcs[target + FIRST_DATA_BLOCK];
+            memcpy( swap_buffer, data[target + FIRST_DATA_BLOCK], BLOCK_SIZE );
+            copyBlock( target + FIRST_DATA_BLOCK, cur + FIRST_DATA_BLOCK );
+            memcpy( data[cur + FIRST_DATA_BLOCK], swap_buffer, BLOCK_SIZE );
+            block_crcs[cur + FIRST_DATA_BLOCK] = swap_crc;
+
+            owner[cur] = owner[target];
+            owner[target] = OWNER_ID( files[f], j );
+            moved += 2;
+         }
+
+         target++;
+      }
+   }
+
+   free( files );
+   free( owner );
+   return moved;
+}
+
+// Name: defragReport
+// Parameters: none
+// Returns: none
+// Description: Prints how many extents (runs of consecutive blocks) each file is split into,
+//              and how the free space is laid out. Directories have no blocks, they are only
+//              counted so they don't water down the share of files that are fragmented.
+void defragReport()
+{
+   int32_t total_extents = 0;
+   int32_t fragmented = 0;
+   int32_t file_count = 0;
+   int32_t directory_count = 0;
+
+   printf("%-20s %8s %8s\n", "file", "blocks", "extents");
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( !directory[i].in_use )
+      {
+         continue;
+      }
+      if ( isDirectory( i ) )
+      {
+         directory_count++;
+         continue;
+      }
+
+      struct inode *file_inode = &inodes[directory[i].inode];
+      uint32_t block_count = BLOCKS_FOR_SIZE( file_inode->file_size );
+      int32_t  extents = block_count > 0 ? 1 : 0;
+
+      for (uint32_t j = 1; j < block_count; j++)
+      {
+         if ( fileBlock( file_inode, j ) != fileBlock( file_inode, j - 1 ) + 1 )
+         {
+            extents++;
+         }
+      }
+
+      printf("%-20s %8"PRIu32" %8"PRId32"\n", filenames[i], block_count, extents );
+      total_extents += extents;
+      fragmented += extents > 1;
+      file_count++;
+   }
+
+   int32_t free_count = 0;
+   int32_t free_runs = 0;
+   int32_t largest_run = 0;
+   int32_t run = 0;
+
+   for (int i = 0; i < DATA_BLOCKS; i++)
+   {
+      if ( block_refs[i] == 0 )
+      {
+         free_count++;
+         free_runs += run == 0;
+         run++;
+         largest_run = run > largest_run ? run : largest_run;
+      }
+      else
+      {
+         run = 0;
+      }
+   }
+
+   printf("%"PRId32" files, %"PRId32" extents, %"PRId32" fragmented, %"PRId32" directories\n",
+          file_count, total_extents, fragmented, directory_count );
+   printf("%"PRId32" free blocks in %"PRId32" runs, largest free run %"PRId32" blocks\n",
+          free_count, free_runs, largest_run );
+}
+
+// Per inode findings of the parallel fsck scan
+struct fsck_inode
+{
+   uint8_t  live;				// In use or in the trash, and named by a directory entry
+   uint32_t first_bad;				// First block number in the file that is out of range
+   uint32_t out_of_range;			// Block pointers inside the file that are out of range
+   uint32_t stray;				// Block pointers set past the end of the file
+};
+
+// Work handed to one fsck thread, a range of inodes and a range of data blocks
+struct fsck_work
+{
+   int32_t  first_inode;
+   int32_t  last_inode;
+   int32_t  first_block;
+   int32_t  last_block;
+   uint32_t leaked;				// Marked used but referenced by no file
+   uint32_t multiple;				// Referenced by more than one file
+   uint32_t marked_free;			// Referenced by a file but marked free
+   uint32_t miscounted;				// Referenced, but not as many times as its count says
+};
+
+struct fsck_inode *fsck_inodes;			// One for each inode
+uint16_t          *fsck_refs;			// Live references to each data block
+uint16_t          *fsck_snapshot_refs;		// References to each data block from snapshots
+
+// Counts a reference to a data block, from any thread
+void fsckRef( int32_t block_index )
+{
+   __atomic_fetch_add( &fsck_refs[block_index - FIRST_DATA_BLOCK], 1, __ATOMIC_RELAXED );
+}
+
+// The table blocks are referenced by the table map rather than by a file
+void fsckRefTables()
+{
+   for (int32_t b = 0; b < TABLE_BLOCKS( file_slots ); b++)
+   {
+      if ( IS_DATA_BLOCK( table_map[b] ) )
+      {
+         fsckRef( table_map[b] );
+      }
+   }
+}
+
+// fsck thread, pass one: count the references each live inode makes to the data blocks, its
+// indirect blocks included
+void *fsckScanInodes( void *arg )
+{
+   struct fsck_work *work = arg;
+
+   for (int32_t i = work->first_inode; i < work->last_inode; i++)
+   {
+      if ( !fsck_inodes[i].live )
+      {
+         continue;
+      }
+
+      struct inode *file_inode = &inodes[i];
+      uint32_t size = file_inode->file_size < MAX_FILE_SIZE ? file_inode->file_size : MAX_FILE_SIZE;
+      uint32_t block_count = BLOCKS_FOR_SIZE( size );
+
+      for (uint32_t j = 0; j < block_count; j++)
+      {
+         if ( j == DOUBLE_INDIRECT_FIRST && IS_DATA_BLOCK( file_inode->double_indirect ) )
+         {
+            fsckRef( file_inode->double_indirect );
+         }
+         if ( j >= DIRECT_BLOCKS && ( j - DIRECT_BLOCKS ) % POINTERS_PER_BLOCK == 0 )
+         {
+            int32_t indirect = indirectBlock( file_inode,
+                                              ( j - DIRECT_BLOCKS ) / POINTERS_PER_BLOCK );
+            if ( IS_DATA_BLOCK( indirect ) )
+            {
+               fsckRef( indirect );
+            }
+         }
+
+         // fileBlock gives -1 for blocks behind a bad indirect pointer too
+         int32_t block_index = fileBlock( file_inode, j );
+         if ( !IS_DATA_BLOCK( block_index ) )
+         {
+            if ( fsck_inodes[i].out_of_range++ == 0 )
+            {
+               fsck_inodes[i].first_bad = j;
+            }
+            continue;
+         }
+         fsckRef( block_index );
+      }
+
+      for (uint32_t j = block_count; j < DIRECT_BLOCKS; j++)
+      {
+         fsck_inodes[i].stray += file_inode->direct[j] != -1;
+      }
+      // Slots in a double indirect block the file doesn't reach aren't looked at, the double
+      // indirect pointer is the stray one
+      int reaches_double = block_count > DOUBLE_INDIRECT_FIRST;
+      fsck_inodes[i].stray += !reaches_double && file_inode->double_indirect != -1;
+      for (uint32_t k = 0; k < ( reaches_double ? INDIRECT_SLOTS : INDIRECT_BLOCKS ); k++)
+      {
+         uint32_t first = DIRECT_BLOCKS + k * POINTERS_PER_BLOCK;
+         int32_t  indirect = indirectBlock( file_inode, k );
+         if ( first >= block_count )
+         {
+            fsck_inodes[i].stray += indirect != -1;
+         }
+         else if ( IS_DATA_BLOCK( indirect ) )
+         {
+            for (uint32_t j = block_count - first; j < POINTERS_PER_BLOCK; j++)
+            {
+               fsck_inodes[i].stray += ( (int32_t *) data[indirect] )[j] != -1;
+            }
+         }
+      }
+   }
+   return NULL;
+}
+
+// walkSnapshot callback counting a snapshot's references, snapshots are walked one at a time
+void fsckSnapshotRef( int32_t block_index, void *unused )
+{
+   fsck_snapshot_refs[block_index - FIRST_DATA_BLOCK]++;
+}
+
+// fsck thread, pass two: compare the reference counts against the block reference map
+void *fsckScanBlocks( void *arg )
+{
+   struct fsck_work *work = arg;
+
+   for (int32_t b = work->first_block; b < work->last_block; b++)
+   {
+      uint32_t refs = fsck_refs[b] + fsck_snapshot_refs[b];
+      work->leaked      += refs == 0 && block_refs[b] != 0;
+      work->multiple    += fsck_refs[b] > 1;
+      work->marked_free += refs > 0 && block_refs[b] == 0;
+      work->miscounted  += fsck_refs[b] <= 1 && block_refs[b] != 0 && refs > 0 &&
+                           block_refs[b] != refs;
+   }
+   return NULL;
+}
+
+// Runs one fsck pass over every inode and data block, spread across threads
+void fsckParallel( void *(*pass)( void * ), struct fsck_work *work, int threads )
+{
+   for (int t = 0; t < threads; t++)
+   {
+      work[t].first_inode = (int64_t) file_slots * t / threads;
+      work[t].last_inode  = (int64_t) file_slots * ( t + 1 ) / threads;
+      work[t].first_block = (int64_t) DATA_BLOCKS * t / threads;
+      work[t].last_block  = (int64_t) DATA_BLOCKS * ( t + 1 ) / threads;
+      work[t].leaked = work[t].multiple = work[t].marked_free = work[t].miscounted = 0;
+   }
+
+   runThreads( pass, work, sizeof(struct fsck_work), threads );
+}
+
+// qsort comparison putting directory indexes in (parent, file name) order, then index order
+int compareEntryNames( const void *a, const void *b )
+{
+   int32_t index_a = *(const int32_t *) a;
+   int32_t index_b = *(const int32_t *) b;
+   int32_t parent_a = directory[index_a].parent;
+   int32_t parent_b = directory[index_b].parent;
+   int order = ( parent_a > parent_b ) - ( parent_a < parent_b );
+   if ( order == 0 )
+   {
+      order = strncmp( filenames[index_a], filenames[index_b], MAX_FILENAME );
+   }
+   return order ? order : ( index_a > index_b ) - ( index_a < index_b );
+}
+
+// Returns 1 if fsck has found the directory entry sound and it is a directory
+int fsckIsDirectory( int32_t directory_index, int32_t *dir_for_inode )
+{
+   if ( directory_index < 0 || (uint32_t) directory_index >= file_slots ||
+        !directory[directory_index].in_use )
+   {
+      return 0;
+   }
+
+   int32_t inode_index = directory[directory_index].inode;
+   return inode_index >= 0 && (uint32_t) inode_index < file_slots &&
+          dir_for_inode[inode_index] == directory_index &&
+          ( inodes[inode_index].attribute & DIRECTORY ) != 0;
+}
+
+// Name: fsckRebuildRefs
+// Parameters: work, threads - for the parallel inode scan
+// Returns: none
+// Description: Counts the live references to every data block again and rebuilds the block
+//              reference map from them and the snapshots' references.
+void fsckRebuildRefs( struct fsck_work *work, int threads )
+{
+   memset( fsck_refs, 0, DATA_BLOCKS * sizeof(uint16_t) );
+   fsckRefTables();
+   fsckParallel( fsckScanInodes, work, threads );
+   for (int32_t b = 0; b < DATA_BLOCKS; b++)
+   {
+      uint32_t refs = fsck_refs[b] + fsck_snapshot_refs[b];
+      block_refs[b] = refs < UINT8_MAX ? refs : UINT8_MAX;
+   }
+   countFreeBlocks();
+}
+
+// Copies a block shared with another file, returns the copy or -1 if the disk is full
+int32_t fsckCopy( int32_t block_index )
+{
+   int32_t copy = allocBlock();
+   if ( copy != -1 )
+   {
+      copyBlock( copy, block_index );
+      fsck_refs[copy - FIRST_DATA_BLOCK]++;
+   }
+   return copy;
+}
+
+// Name: fsck
+// Parameters: repair - fix what is found instead of only reporting it
+// Returns: number of problems found
+// Description: Cross checks the directory, the inodes, the free inode map and the block
+//              reference map. Directory entries must name in use inodes, in use inodes must be
+//              named by exactly one entry, every entry must be in a directory that leads up to
+//              the top of the tree, and every block inside a file must be in the data area.
+//              Files in the trash are checked the same way and own their blocks. Each data
+//              block must be referenced by at most one live file, indirect and table blocks
+//              included, and its reference count must match the references to it from the
+//              live files and every snapshot: used but unreferenced blocks are leaked,
+//              referenced but free blocks would be handed out twice. The inode and block scans
+//              are split across threads.
+//
+//              Repair drops broken directory entries, orphaned inodes and snapshots whose
+//              tables can't be found, moves entries whose directory is missing or inside itself
+//              to the top of the tree, cuts files off at their first bad block, gives every
+//              file after the first that shares a block its own copy, and rebuilds the free
+//              inode map and the block reference map.
+int32_t fsck( int repair )
+{
+   int32_t  problems = 0;
+   int32_t *dir_for_inode = malloc( file_slots * sizeof(int32_t) );
+   int32_t *named = malloc( file_slots * sizeof(int32_t) );
+   int32_t  named_count = 0;
+
+   fsck_inodes = calloc( file_slots, sizeof(struct fsck_inode) );
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      dir_for_inode[i] = -1;
+   }
+
+   // Check the directory here before starting the threads
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( !directory[i].in_use && !inTrash( i ) )
+      {
+         continue;
+      }
+
+      int32_t inode_index = directory[i].inode;
+      const char *problem = NULL;
+
+      if ( memchr( filenames[i], 0, MAX_FILENAME ) == NULL ||
+           filenames[i][0] == 0 )
+      {
+         problem = "has a bad file name";
+      }
+      else if ( inode_index < 0 || (uint32_t) inode_index >= file_slots )
+      {
+         problem = "points at an inode that does not exist";
+      }
+      else if ( directory[i].in_use && !inodes[inode_index].in_use )
+      {
+         problem = "points at a free inode";
+      }
+      else if ( inodes[inode_index].in_use && inodes[inode_index].trashed )
+      {
+         problem = "points at an inode that is both in use and in the trash";
+      }
+      else if ( dir_for_inode[inode_index] != -1 )
+      {
+         problem = "shares its inode with another entry";
+      }
+
+      if ( problem )
+      {
+         printf("fsck: directory entry %d %s\n", i, problem);
+         problems++;
+         if ( repair )
+         {
+            directory[i].in_use = 0;
+            directory[i].inode = -1;
+            memset( filenames[i], 0, MAX_FILENAME );
+         }
+         continue;
+      }
+
+      dir_for_inode[inode_index] = i;
+      fsck_inodes[inode_index].live = 1;
+      if ( directory[i].in_use )
+      {
+         named[named_count++] = i;
+      }
+   }
+
+   // Every entry has to be in a directory that exists, repair moves the ones that aren't to
+   // the top of the tree
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      int32_t inode_index = directory[i].inode;
+      int32_t parent = directory[i].parent;
+      if ( ( !directory[i].in_use && !inTrash( i ) ) || inode_index < 0 ||
+           (uint32_t) inode_index >= file_slots || dir_for_inode[inode_index] != (int32_t) i ||
+           parent == ROOT_DIRECTORY || fsckIsDirectory( parent, dir_for_inode ) )
+      {
+         continue;
+      }
+
+      printf("fsck: directory entry %d is in a directory that does not exist\n", i);
+      problems++;
+      if ( repair )
+      {
+         directory[i].parent = ROOT_DIRECTORY;
+      }
+   }
+
+   // Following the parents up from a directory has to reach the top of the tree rather than
+   // go round a loop. walked is 1 along the current walk and 2 once a directory is known to
+   // lead somewhere already checked, so each directory is followed once.
+   uint8_t *walked = calloc( file_slots, 1 );
+   for (uint32_t d = 0; d < file_slots; d++)
+   {
+      if ( walked[d] || !fsckIsDirectory( d, dir_for_inode ) )
+      {
+         continue;
+      }
+
+      int32_t p = d;
+      while ( p != ROOT_DIRECTORY && fsckIsDirectory( p, dir_for_inode ) && walked[p] != 2 )
+      {
+         if ( walked[p] == 1 )
+         {
+            printf("fsck: directory %.*s is inside itself\n", MAX_FILENAME, filenames[p]);
+            problems++;
+            if ( repair )
+            {
+               directory[p].parent = ROOT_DIRECTORY;
+            }
+            break;
+         }
+         walked[p] = 1;
+         p = directory[p].parent;
+      }
+
+      for (p = d; p != ROOT_DIRECTORY && fsckIsDirectory( p, dir_for_inode ) && walked[p] == 1;
+           p = directory[p].parent)
+      {
+         walked[p] = 2;
+      }
+   }
+   free( walked );
+
+   // Sorting the names puts any duplicates in a directory next to each other, the first one
+   // keeps its name
+   qsort( named, named_count, sizeof(int32_t), compareEntryNames );
+   for (int32_t n = 1; n < named_count; n++)
+   {
+      int32_t i = named[n];
+      if ( directory[named[n - 1]].parent != directory[i].parent ||
+           strncmp( filenames[named[n - 1]], filenames[i], MAX_FILENAME ) )
+      {
+         continue;
+      }
+
+      printf("fsck: directory entry %d has the same name as another entry\n", i);
+      problems++;
+      if ( repair )
+      {
+         dir_for_inode[directory[i].inode] = -1;
+         fsck_inodes[directory[i].inode].live = 0;
+         directory[i].in_use = 0;
+         directory[i].inode = -1;
+         memset( filenames[i], 0, MAX_FILENAME );
+      }
+   }
+   free( named );
+
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      if ( ( inodes[i].in_use || inodes[i].trashed ) && dir_for_inode[i] == -1 )
+      {
+         printf("fsck: inode %d is %s but not in the directory\n", i,
+                inodes[i].in_use ? "in use" : "in the trash");
+         problems++;
+         if ( repair )
+         {
+            inodes[i].in_use = 0;
+            inodes[i].trashed = 0;
+         }
+      }
+
+      uint8_t inode_free = !inodes[i].in_use && !inodes[i].trashed;
+      if ( free_inodes[i] != inode_free )
+      {
+         printf("fsck: inode %d is marked %s in the free inode map\n", i,
+                free_inodes[i] ? "free" : "used");
+         problems++;
+         if ( repair )
+         {
+            free_inodes[i] = inode_free;
+         }
+      }
+
+      if ( fsck_inodes[i].live && inodes[i].file_size > MAX_FILE_SIZE )
+      {
+         printf("fsck: %s is larger than the largest file\n", filenames[dir_for_inode[i]]);
+         problems++;
+         if ( repair )
+         {
+            inodes[i].file_size = MAX_FILE_SIZE;
+         }
+      }
+   }
+
+   // Sharing blocks with snapshots is fine, so their references are counted apart from the
+   // live files'. A snapshot whose tables can't be found holds nothing.
+   fsck_snapshot_refs = calloc( DATA_BLOCKS, sizeof(uint16_t) );
+   for (int s = 0; s < MAX_SNAPSHOTS; s++)
+   {
+      struct snapshot *snap = &super->snapshots[s];
+      if ( snap->in_use && walkSnapshot( snap, fsckSnapshotRef, NULL ) != 0 )
+      {
+         printf("fsck: snapshot %.*s is damaged\n", SNAPSHOT_NAME_MAX, snap->name);
+         problems++;
+         if ( repair )
+         {
+            memset( snap, 0, sizeof(struct snapshot) );
+         }
+      }
+   }
+
+   // Count references to every data block from the table map and the live files, then check
+   // them against the block reference map
+   struct fsck_work work[MAX_THREADS];
+   int threads = workerThreads();
+
+   fsck_refs = calloc( DATA_BLOCKS, sizeof(uint16_t) );
+   fsckRefTables();
+   fsckParallel( fsckScanInodes, work, threads );
+   fsckParallel( fsckScanBlocks, work, threads );
+
+   uint32_t leaked = 0;
+   uint32_t multiple = 0;
+   uint32_t marked_free = 0;
+   uint32_t miscounted = 0;
+   for (int t = 0; t < threads; t++)
+   {
+      leaked      += work[t].leaked;
+      multiple    += work[t].multiple;
+      marked_free += work[t].marked_free;
+      miscounted  += work[t].miscounted;
+   }
+
+   for (uint32_t i = 0; i < file_slots; i++)
+   {
+      char *filename = fsck_inodes[i].live ? filenames[dir_for_inode[i]] : NULL;
+
+      if ( fsck_inodes[i].out_of_range )
+      {
+         printf("fsck: %s has %"PRIu32" block pointers outside the data area, "
+                "the first at block %"PRIu32"\n",
+                filename, fsck_inodes[i].out_of_range, fsck_inodes[i].first_bad );
+         problems++;
+      }
+
+      if ( fsck_inodes[i].stray )
+      {
+         printf("fsck: %s has %"PRIu32" block pointers past its end\n",
+                filename, fsck_inodes[i].stray );
+         problems++;
+      }
+   }
+
+   int listed = 0;
+   for (int32_t b = 0; b < DATA_BLOCKS && listed < FSCK_MAX_LISTED; b++)
+   {
+      if ( fsck_refs[b] > 1 )
+      {
+         printf("fsck: block %"PRId32" is used by %d files\n", b + FIRST_DATA_BLOCK, fsck_refs[b]);
+         listed++;
+      }
+   }
+
+   if ( multiple )
+   {
+      printf("fsck: %"PRIu32" blocks are used by more than one file\n", multiple);
+   }
+   if ( marked_free )
+   {
+      printf("fsck: %"PRIu32" blocks in use are marked free\n", marked_free);
+   }
+   if ( leaked )
+   {
+      printf("fsck: %"PRIu32" blocks (%"PRIu32" bytes) are leaked\n", leaked, leaked * BLOCK_SIZE);
+   }
+   if ( miscounted )
+   {
+      printf("fsck: %"PRIu32" blocks have the wrong reference count\n", miscounted);
+   }
+   problems += multiple + marked_free + leaked + miscounted;
+
+   if ( repair && problems )
+   {
+      // Cut each file off at its first bad block and clear everything past its end
+      for (uint32_t i = 0; i < file_slots; i++)
+      {
+         if ( !fsck_inodes[i].live )
+         {
+            continue;
+         }
+
+         if ( fsck_inodes[i].out_of_range )
+         {
+            inodes[i].file_size = fsck_inodes[i].first_bad * BLOCK_SIZE;
+         }
+         trimFileBlocks( &inodes[i], BLOCKS_FOR_SIZE( inodes[i].file_size ), 0 );
+      }
+
+      // Count the references again now that the files are cut, and rebuild the block
+      // reference map from them
+      fsckRebuildRefs( work, threads );
+
+      // The first file to claim a shared block keeps it, the others get a copy
+      memset( fsck_refs, 0, DATA_BLOCKS * sizeof(uint16_t) );
+      fsckRefTables();
+      for (uint32_t i = 0; i < file_slots; i++)
+      {
+         if ( !fsck_inodes[i].live )
+         {
+            continue;
+         }
+
+         uint32_t block_count = BLOCKS_FOR_SIZE( inodes[i].file_size );
+         for (uint32_t j = 0; j < block_count; j++)
+         {
+            int32_t copy = 0;
+            if ( j == DOUBLE_INDIRECT_FIRST &&
+                 fsck_refs[inodes[i].double_indirect - FIRST_DATA_BLOCK]++ > 0 )
+            {
+               // A shared double indirect block is copied before the indirect blocks in it
+               copy = fsckCopy( inodes[i].double_indirect );
+               if ( copy != -1 )
+               {
+                  inodes[i].double_indirect = copy;
+               }
+            }
+            if ( copy != -1 && j >= DIRECT_BLOCKS &&
+                 ( j - DIRECT_BLOCKS ) % POINTERS_PER_BLOCK == 0 )
+            {
+               // A shared indirect block is copied first so the pointers in it can change
+               uint32_t k = ( j - DIRECT_BLOCKS ) / POINTERS_PER_BLOCK;
+               int32_t *indirect = indirectSlot( &inodes[i], k );
+               if ( fsck_refs[*indirect - FIRST_DATA_BLOCK]++ > 0 )
+               {
+                  copy = fsckCopy( *indirect );
+                  if ( copy != -1 )
+                  {
+                     *indirect = copy;
+                     if ( k >= INDIRECT_BLOCKS )
+                     {
+                        blockWritten( inodes[i].double_indirect );
+                     }
+                  }
+               }
+            }
+
+            int32_t block_index = fileBlock( &inodes[i], j );
+            if ( copy != -1 && fsck_refs[block_index - FIRST_DATA_BLOCK]++ > 0 )
+            {
+               copy = fsckCopy( block_index );
+               if ( copy != -1 )
+               {
+                  setFileBlock( &inodes[i], j, copy );
+               }
+            }
+
+            if ( copy == -1 )
+            {
+               // No room for a copy, the file has to end before the shared block
+               inodes[i].file_size = j * BLOCK_SIZE;
+               trimFileBlocks( &inodes[i], j, 0 );
+               break;
+            }
+         }
+      }
+
+      // The blocks that were copied have lost references
+      fsckRebuildRefs( work, threads );
+
+      // Unused entries that are not in the trash have no blocks left to undelete
+      for (uint32_t i = 0; i < file_slots; i++)
+      {
+         if ( !directory[i].in_use && !inTrash( i ) && filenames[i][0] != 0 )
+         {
+            memset( filenames[i], 0, MAX_FILENAME );
+            directory[i].inode = -1;
+         }
+      }
+
+      nameIndexBuild();
+   }
+
+   free( fsck_refs );
+   fsck_refs = NULL;
+   free( fsck_snapshot_refs );
+   fsck_snapshot_refs = NULL;
+   free( fsck_inodes );
+   fsck_inodes = NULL;
+   free( dir_for_inode );
+
+   if ( problems == 0 )
+   {
+      printf("fsck: image is consistent\n");
+   }
+   else
+   {
+      printf("fsck: %"PRId32" problems %s\n", problems,
+             repair ? "repaired" : "found, run fsck -r to repair");
+   }
+   return problems;
+}
+
+// Work handed to one scrub thread
+struct scrub_work
+{
+   int32_t  first_block;
+   int32_t  last_block;
+   uint32_t checked;
+   uint32_t bad;
+};
+
+uint8_t *scrub_bad;				// Set for every block that fails its checksum
+
+// scrub thread: checks every used data block in its range against its checksum
+void *scrubBlocks( void *arg )
+{
+   struct scrub_work *work = arg;
+
+   for (int32_t b = work->first_block; b < work->last_block; b++)
+   {
+      if ( block_refs[b - FIRST_DATA_BLOCK] == 0 )
+      {
+         continue;
+      }
+
+      work->checked++;
+      if ( crc32c( data[b], BLOCK_SIZE ) != block_crcs[b] )
+      {
+         scrub_bad[b - FIRST_DATA_BLOCK] = 1;
+         work->bad++;
+      }
+   }
+   return NULL;
+}
+
+// Name: scrub
+// Parameters: none
+// Returns: number of blocks that failed their checksum
+// Description: Verifies every used data block in the image against its stored CRC32C, split
+//              across threads, then names the files that own the bad blocks.
+uint32_t scrub()
+{
+   struct scrub_work work[MAX_THREADS];
+   int threads = workerThreads();
+
+   scrub_bad = calloc( DATA_BLOCKS, 1 );
+   adviseImage( FIRST_DATA_BLOCK, DATA_BLOCKS, MADV_WILLNEED );
+   for (int t = 0; t < threads; t++)
+   {
+      work[t].first_block = FIRST_DATA_BLOCK + (int64_t) DATA_BLOCKS * t / threads;
+      work[t].last_block  = FIRST_DATA_BLOCK + (int64_t) DATA_BLOCKS * ( t + 1 ) / threads;
+      work[t].checked = work[t].bad = 0;
+   }
+   runThreads( scrubBlocks, work, sizeof(struct scrub_work), threads );
+
+   uint32_t checked = 0;
+   uint32_t bad = 0;
+   for (int t = 0; t < threads; t++)
+   {
+      checked += work[t].checked;
+      bad     += work[t].bad;
+   }
+
+   for (uint32_t i = 0; i < file_slots && bad; i++)
+   {
+      if ( !directory[i].in_use )
+      {
+         continue;
+      }
+
+      struct inode *file_inode = &inodes[directory[i].inode];
+      uint32_t block_count = BLOCKS_FOR_SIZE( file_inode->file_size );
+      for (uint32_t j = 0; j < block_count; j++)
+      {
+         int32_t block_index = fileBlock( file_inode, j );
+         if ( block_index >= FIRST_DATA_BLOCK && block_index < NUM_BLOCKS &&
+              scrub_bad[block_index - FIRST_DATA_BLOCK] )
+         {
+            printf("scrub: %s block %"PRIu32" (disk block %"PRId32") is corrupt\n",
+                   filenames[i], j, block_index );
+         }
+      }
+   }
+
+   free( scrub_bad );
+   printf("scrub: %"PRIu32" blocks checked, %"PRIu32" corrupt\n", checked, bad );
+   return bad;
+}
+
+// encryption
+void encryption(char *filename, int cipher)
+{
+   METRIC_BEGIN();
+   
+   // Verify filename is valid and get the directory_index
+   int directory_index = findFile( filename );
+
+   uint8_t valid = directory_index != -1;
+   if(valid == 0)
+      {
+         printf("ERROR: Filename does not exist.\n");
+         return;
+      }
+  
+   // Verify cipher is valid
+   if (cipher > 256 || cipher < 0)
+   {
+      printf("ERROR: Cipher must be between 0 and 255.\n");
+      return;
+   }
+
+
+   // get the inode_index from the directory entry
+   int32_t inode_index = directory[directory_index].inode;
+
+   // get the file_size from the inode
+   int32_t file_size = inodes[inode_index].file_size;
+
+
+   // get the number of blocks from the file_size using mod 1024
+   int32_t number_of_blocks = file_size/1024;
+   int leftover = 0;
+   //get the left over bytes from the file_size , then leftover = file_size-(number_of_blocks*1024)
+   if (file_size%1024 != 0)
+   {
+      leftover = file_size - (number_of_blocks*1024);
+   }
+
+   // Blocks a snapshot shares are copied first so the snapshot keeps them as they are
+   if ( !reserveBlocks( sharedBlocks( &inodes[inode_index], 0, BLOCKS_FOR_SIZE( file_size ) ) ) )
+   {
+      printf("ERROR: Not enough free disk space.\n");
+      return;
+   }
+   for (uint32_t i = 0; i < BLOCKS_FOR_SIZE( file_size ); i++)
+   {
+      writableFileBlock( &inodes[inode_index], i );
+   }
+   
+   for (int i=0; i< number_of_blocks; i++)
+   {
+      uint8_t *block = data[fileBlock( &inodes[inode_index], i )];
+      for (int j=0; j<1024; j++)
+      {
+         block[j] = block[j] ^ cipher;
+      }
+      
+   }
+   if(leftover != 0)
+   {
+      uint8_t *block = data[fileBlock( &inodes[inode_index], number_of_blocks )];
+      for (int i=0; i< leftover; i++)
+      {
+         block[i] = block[i] ^ cipher;
+      }
+   }
+
+   // The blocks have all changed, so have their checksums
+   for (int i = 0; i < number_of_blocks + ( leftover != 0 ); i++)
+   {
+      blockWritten( fileBlock( &inodes[inode_index], i ) );
+   }
+
+   METRIC_END( OP_ENCRYPT, file_size );
+}
+
+// decryption
+void decryption(char *filename, int cipher)
+{
+   METRIC_BEGIN();
+   
+   // Verify filename is valid and get the directory_index
+   int directory_index = findFile( filename );
+
+   uint8_t valid = directory_index != -1;
+   if(valid == 0)
+      {
+         printf("ERROR: Filename does not exist.\n");
+         return;
+      }
+  
+   // Verify cipher is valid
+   if (cipher > 256 || cipher < 0)
+   {
+      printf("ERROR: Cipher must be between 0 and 255.\n");
+      return;
+   }
+
+
+   // get the inode_index from the directory entry
+   int32_t inode_index = directory[directory_index].inode;
+
+   // get the file_size from the inode
+   int32_t file_size = inodes[inode_index].file_size;
+
+
+   // get the number of blocks from the file_size using mod 1024
+   int32_t number_of_blocks = file_size/1024;
+   int leftover = 0;
+   //get the left over bytes from the file_size , then leftover = file_size-(number_of_blocks*1024)
+   if (file_size%1024 != 0)
+   {
+      leftover = file_size - (number_of_blocks*1024);
+   }
+
+   // Blocks a snapshot shares are copied first so the snapshot keeps them as they are
+   if ( !reserveBlocks( sharedBlocks( &inodes[inode_index], 0, BLOCKS_FOR_SIZE( file_size ) ) ) )
+   {
+      printf("ERROR: Not enough free disk space.\n");
+      return;
+   }
+   for (uint32_t i = 0; i < BLOCKS_FOR_SIZE( file_size ); i++)
+   {
+      writableFileBlock( &inodes[inode_index], i );
+   }
+   
+   for (int i=0; i< number_of_blocks; i++)
+   {
+      uint8_t *block = data[fileBlock( &inodes[inode_index], i )];
+      for (int j=0; j<1024; j++)
+      {
+         block[j] = block[j] ^ cipher;
+      }
+      
+   }
+   if(leftover != 0)
+   {
+      uint8_t *block = data[fileBlock( &inodes[inode_index], number_of_blocks )];
+      for (int i=0; i< leftover; i++)
+      {
+         block[i] = block[i] ^ cipher;
+      }
+   }
+
+   // The blocks have all changed, so have their checksums
+   for (int i = 0; i < number_of_blocks + ( leftover != 0 ); i++)
+   {
+      blockWritten( fileBlock( &inodes[inode_index], i ) );
+   }
+
+   METRIC_END( OP_DECRYPT, file_size );
+}
+
+
+//-------------------------------------------------------------------------------------------------
+// mfsd: serving an image to local clients
+// ------------------------------------------------------------------------------------------------
+
+// Requests a client can make
+enum mfsd_op
+{
+   MFSD_STAT,					// Size, time and attributes of a file or directory
+   MFSD_READ,					// length bytes from offset
+   MFSD_WRITE,					// The data at offset, growing the file if needed
+   MFSD_CREATE,					// A new file holding the data
+   MFSD_TRUNCATE,				// Resize to offset bytes
+   MFSD_DELETE,
+   MFSD_MKDIR,
+   MFSD_DF,					// Free bytes, as a uint64_t
+   MFSD_SAVEFS,
+   MFSD_SHUTDOWN,				// Stop serving once this is answered
+   MFSD_OP_COUNT
+};
+
+// Status of a reply
+enum mfsd_status
+{
+   MFSD_OK,
+   MFSD_NOT_FOUND,
+   MFSD_EXISTS,
+   MFSD_NO_SPACE,
+   MFSD_TOO_LARGE,
+   MFSD_READ_ONLY,
+   MFSD_IS_DIRECTORY,
+   MFSD_CHECKSUM,
+   MFSD_BAD_REQUEST,
+   MFSD_IO_ERROR,				// The image file couldn't be written
+   MFSD_STATUS_COUNT
+};
+
+const char *mfsd_status_text[MFSD_STATUS_COUNT] =
+{
+   "OK", "File not found", "File already exists", "Not enough disk space", "File is too large",
+   "File is read-only", "Is a directory", "Checksum mismatch", "Bad request",
+   "I/O error"
+};
+
+// Every request starts with this header, followed by path_length bytes of path and then
+// data_length bytes of data. Both ends are on the same machine, so fields are in host order.
+struct mfsd_request
+{
+   uint32_t magic;
+   uint16_t op;
+   uint16_t path_length;
+   uint32_t data_length;			// Bytes to write, for write and create
+   uint32_t length;				// Bytes to read, for read
+   uint64_t offset;				// Where to read or write, or the new size for truncate
+};
+
+// Every reply starts with this header, followed by data_length bytes of data
+struct mfsd_reply
+{
+   uint32_t magic;
+   uint32_t status;
+   uint64_t data_length;
+};
+
+// Reply data of a stat request
+struct mfsd_stat
+{
+   uint64_t size;
+   int64_t  time;
+   uint32_t attribute;
+   uint32_t reserved;
+};
+
+// A client connection. The event loop owns it while a request is arriving and a worker owns
+// it while the request is carried out, EPOLLONESHOT keeps the two from overlapping.
+struct mfsd_conn
+{
+   int                  fd;
+   struct mfsd_request  request;
+   size_t               received;		// Bytes of the current request read so far
+   char                 path[MFSD_PATH_MAX];
+   uint8_t             *data;
+   struct mfsd_conn    *next;			// Link in the work queue
+};
+
+pthread_mutex_t   mfsd_fs_lock = PTHREAD_MUTEX_INITIALIZER;	// Held while touching the image
+pthread_mutex_t   mfsd_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t    mfsd_queue_ready = PTHREAD_COND_INITIALIZER;
+struct mfsd_conn *mfsd_queue_head;
+struct mfsd_conn *mfsd_queue_tail;
+int               mfsd_epoll_fd = -1;
+int               mfsd_wake_fd = -1;		// eventfd that gets the event loop out of epoll_wait
+int               mfsd_stopping;
+
+// Tells the event loop to stop, safe to call from a signal handler
+void mfsdStop()
+{
+   uint64_t one = 1;
+   __atomic_store_n( &mfsd_stopping, 1, __ATOMIC_RELAXED );
+   if ( write( mfsd_wake_fd, &one, sizeof(one) ) < 0 )
+   {
+      // The counter is already non-zero, so the loop is woken anyway
+   }
+}
+
+void mfsdSignal( int sig )
+{
+   (void) sig;
+   mfsdStop();
+}
+
+// Name: mfsdReceive
+// Parameters: conn - connection with data waiting
+// Returns: 1 once the whole request has arrived, 0 if more is still to come, -1 if the client
+//          closed the connection or sent a bad header, or there is no memory for its data
+// Description: Reads as much of the request as is there without blocking: the header, then
+//              the path, then the data.
+int mfsdReceive( struct mfsd_conn *conn )
+{
+   struct mfsd_request *request = &conn->request;
+   const size_t header = sizeof(struct mfsd_request);
+
+   while ( 1 )
+   {
+      uint8_t *dst;
+      size_t   want;
+
+      if ( conn->received < header )
+      {
+         dst  = (uint8_t *) request + conn->received;
+         want = header - conn->received;
+      }
+      else if ( conn->received < header + request->path_length )
+      {
+         dst  = (uint8_t *) conn->path + ( conn->received - header );
+         want = header + request->path_length - conn->received;
+      }
+      else if ( conn->received < header + request->path_length + request->data_length )
+      {
+         size_t done = conn->received - header - request->path_length;
+         dst  = conn->data + done;
+         want = request->data_length - done;
+      }
+      else
+      {
+         conn->path[request->path_length] = 0;
+         return 1;
+      }
+
+      ssize_t got = read( conn->fd, dst, want );
+      if ( got < 0 && errno == EINTR )
+      {
+         continue;
+      }
+      if ( got < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+      {
+         return 0;
+      }
+      if ( got <= 0 )
+      {
+         return -1;
+      }
+
+      conn->received += got;
+      if ( conn->received == header )
+      {
+         if ( request->magic != MFSD_MAGIC || request->op >= MFSD_OP_COUNT ||
+              request->path_length >= MFSD_PATH_MAX || request->data_length > MAX_FILE_SIZE )
+         {
+            return -1;
+         }
+         conn->data = request->data_length ? malloc( request->data_length ) : NULL;
+         if ( request->data_length && conn->data == NULL )
+         {
+            return -1;
+         }
+      }
+   }
+}
+
+// Looks up the file a request names. Returns its inode, or -1 with status set to why not.
+int32_t mfsdFindFile( char *path, int writable, uint32_t *status )
+{
+   int32_t directory_index = findDirectoryEntry( path );
+   if ( directory_index == -1 )
+   {
+      *status = MFSD_NOT_FOUND;
+      return -1;
+   }
+   if ( isDirectory( directory_index ) )
+   {
+      *status = MFSD_IS_DIRECTORY;
+      return -1;
+   }
+
+   int32_t inode_index = directory[directory_index].inode;
+   if ( writable && ( inodes[inode_index].attribute & READONLY ) )
+   {
+      *status = MFSD_READ_ONLY;
+      return -1;
+   }
+   return inode_index;
+}
+
+// Name: mfsdExecute
+// Parameters: conn - connection holding a complete request, reply - set to malloc'd reply
+//             data, reply_length - set to its size
+// Returns: status of the reply
+// Description: Carries out one request against the image. The caller holds mfsd_fs_lock, so
+//              anything sent back is copied out of the image here and written to the socket
+//              after the lock is released.
+uint32_t mfsdExecute( struct mfsd_conn *conn, uint8_t **reply, uint64_t *reply_length )
+{
+   struct mfsd_request *request = &conn->request;
+   uint32_t status = MFSD_OK;
+   int32_t  inode_index;
+   const char *leaf;
+   int32_t  parent;
+
+   METRIC_BEGIN();
+
+   switch ( request->op )
+   {
+      case MFSD_STAT:
+      {
+         int32_t directory_index = findDirectoryEntry( conn->path );
+         if ( directory_index == -1 )
+         {
+            return MFSD_NOT_FOUND;
+         }
+
+         struct inode *file_inode = &inodes[directory[directory_index].inode];
+         struct mfsd_stat *stat_reply = calloc( 1, sizeof(struct mfsd_stat) );
+         stat_reply->size = file_inode->file_size;
+         stat_reply->time = file_inode->t;
+         stat_reply->attribute = file_inode->attribute;
+         *reply = (uint8_t *) stat_reply;
+         *reply_length = sizeof(struct mfsd_stat);
+         return MFSD_OK;
+      }
+
+      case MFSD_READ:
+      {
+         if ( ( inode_index = mfsdFindFile( conn->path, 0, &status ) ) == -1 )
+         {
+            return status;
+         }
+
+         struct inode *file_inode = &inodes[inode_index];
+         uint64_t end = request->offset + request->length;
+         if ( request->offset >= file_inode->file_size )
+         {
+            return MFSD_OK;
+         }
+         if ( end > file_inode->file_size )
+         {
+            end = file_inode->file_size;
+         }
+
+         uint32_t first = request->offset / BLOCK_SIZE;
+         uint32_t last  = BLOCKS_FOR_SIZE( end );
+         readAhead( inode_index, first, last );
+         if ( verifyFileBlocks( file_inode, first, last ) != -1 )
+         {
+            return MFSD_CHECKSUM;
+         }
+
+         *reply_length = end - request->offset;
+         *reply = malloc( *reply_length );
+         for (uint64_t pos = request->offset; pos < end; )
+         {
+            uint32_t in_block = pos % BLOCK_SIZE;
+            uint32_t n = BLOCK_SIZE - in_block < end - pos ? BLOCK_SIZE - in_block : end - pos;
+            memcpy( *reply + ( pos - request->offset ),
+                    &data[fileBlock( file_inode, pos / BLOCK_SIZE )][in_block], n );
+            pos += n;
+         }
+         METRIC_END( OP_READ, *reply_length );
+         return MFSD_OK;
+      }
+
+      case MFSD_WRITE:
+         if ( ( inode_index = mfsdFindFile( conn->path, 1, &status ) ) == -1 )
+         {
+            return status;
+         }
+         if ( request->offset + request->data_length > MAX_FILE_SIZE )
+         {
+            return MFSD_TOO_LARGE;
+         }
+         if ( file_pwrite( inode_index, conn->data, request->data_length, request->offset ) )
+         {
+            return MFSD_NO_SPACE;
+         }
+         METRIC_END( OP_WRITE, request->data_length );
+         return MFSD_OK;
+
+      case MFSD_TRUNCATE:
+         if ( ( inode_index = mfsdFindFile( conn->path, 1, &status ) ) == -1 )
+         {
+            return status;
+         }
+         if ( request->offset > MAX_FILE_SIZE )
+         {
+            return MFSD_TOO_LARGE;
+         }
+         if ( file_truncate( inode_index, request->offset ) )
+         {
+            return MFSD_NO_SPACE;
+         }
+         METRIC_END( OP_TRUNCATE, 0 );
+         return MFSD_OK;
+
+      case MFSD_CREATE:
+      case MFSD_MKDIR:
+      {
+         parent = resolveParent( conn->path, &leaf );
+         if ( parent == NO_DIRECTORY || *leaf == 0 || strlen( leaf ) >= MAX_FILENAME )
+         {
+            return MFSD_NOT_FOUND;
+         }
+         if ( findChild( parent, leaf, strlen( leaf ) ) != -1 )
+         {
+            return MFSD_EXISTS;
+         }
+
+         // The entry comes first, growing the tables for it uses data blocks from the same
+         // free space the file's blocks are reserved from
+         uint8_t attribute = request->op == MFSD_MKDIR ? DIRECTORY : 0;
+         int32_t directory_index = createEntry( parent, leaf, attribute );
+         if ( directory_index == -1 )
+         {
+            return MFSD_NO_SPACE;
+         }
+         if ( attribute == 0 && !reserveBlocks( FILE_BLOCKS( request->data_length ) ) )
+         {
+            discardEntry( directory_index );
+            return MFSD_NO_SPACE;
+         }
+         if ( request->data_length &&
+              file_pwrite( directory[directory_index].inode, conn->data, request->data_length, 0 ) )
+         {
+            discardEntry( directory_index );
+            return MFSD_NO_SPACE;
+         }
+         if ( attribute == 0 )
+         {
+            METRIC_END( OP_INSERT, request->data_length );
+         }
+         return MFSD_OK;
+      }
+
+      case MFSD_DELETE:
+         if ( mfsdFindFile( conn->path, 0, &status ) == -1 )
+         {
+            return status;
+         }
+         delete( conn->path );
+         return MFSD_OK;
+
+      case MFSD_DF:
+      {
+         uint64_t *free_bytes = malloc( sizeof(uint64_t) );
+         *free_bytes = df();
+         *reply = (uint8_t *) free_bytes;
+         *reply_length = sizeof(uint64_t);
+         return MFSD_OK;
+      }
+
+      case MFSD_SAVEFS:
+         return savefs() == 0 ? MFSD_OK : MFSD_IO_ERROR;
+
+      case MFSD_SHUTDOWN:
+         return MFSD_OK;
+   }
+   return MFSD_BAD_REQUEST;
+}
+
+// Closes a connection and frees it
+void mfsdClose( struct mfsd_conn *conn )
+{
+   close( conn->fd );
+   free( conn->data );
+   free( conn );
+}
+
+// Waits for more of the connection's next request
+void mfsdRearm( struct mfsd_conn *conn )
+{
+   struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = conn };
+   epoll_ctl( mfsd_epoll_fd, EPOLL_CTL_MOD, conn->fd, &event );
+}
+
+// Name: mfsdWorker
+// Parameters: arg - unused
+// Returns: NULL
+// Description: Worker thread: takes complete requests off the queue, carries each out under
+//              mfsd_fs_lock, then sends the reply with the lock released so large transfers to
+//              slow clients don't hold up other requests.
+void *mfsdWorker( void *arg )
+{
+   (void) arg;
+
+   while ( 1 )
+   {
+      pthread_mutex_lock( &mfsd_queue_lock );
+      while ( mfsd_queue_head == NULL && !__atomic_load_n( &mfsd_stopping, __ATOMIC_RELAXED ) )
+      {
+         pthread_cond_wait( &mfsd_queue_ready, &mfsd_queue_lock );
+      }
+      struct mfsd_conn *conn = mfsd_queue_head;
+      if ( conn == NULL )
+      {
+         pthread_mutex_unlock( &mfsd_queue_lock );
+         return NULL;
+      }
+      mfsd_queue_head = conn->next;
+      pthread_mutex_unlock( &mfsd_queue_lock );
+
+      uint8_t *reply_data = NULL;
+      uint64_t reply_length = 0;
+
+      pthread_mutex_lock( &mfsd_fs_lock );
+      uint32_t status = mfsdExecute( conn, &reply_data, &reply_length );
+      pthread_mutex_unlock( &mfsd_fs_lock );
+
+      struct mfsd_reply reply = { MFSD_MAGIC, status, reply_length };
+      struct iovec iov[2] =
+      {
+         { .iov_base = &reply, .iov_len = sizeof(reply) },
+         { .iov_base = reply_data, .iov_len = reply_length }
+      };
+      int failed = writev_all( conn->fd, iov, reply_length ? 2 : 1 );
+      free( reply_data );
+
+      if ( conn->request.op == MFSD_SHUTDOWN )
+      {
+         mfsdStop();
+      }
+
+      free( conn->data );
+      conn->data = NULL;
+      conn->received = 0;
+      if ( failed )
+      {
+         mfsdClose( conn );
+      }
+      else
+      {
+         mfsdRearm( conn );
+      }
+   }
+}
+
+// Hands a complete request to the workers
+void mfsdQueue( struct mfsd_conn *conn )
+{
+   conn->next = NULL;
+   pthread_mutex_lock( &mfsd_queue_lock );
+   if ( mfsd_queue_head == NULL )
+   {
+      mfsd_queue_head = conn;
+   }
+   else
+   {
+      mfsd_queue_tail->next = conn;
+   }
+   mfsd_queue_tail = conn;
+   pthread_cond_signal( &mfsd_queue_ready );
+   pthread_mutex_unlock( &mfsd_queue_lock );
+}
+
+// Name: mfsdServe
+// Parameters: socket_path - Unix domain socket to listen on
+// Returns: 0 after a clean shutdown, -1 if the socket could not be set up
+// Description: Serves the open image until a client sends a shutdown request or the process
+//              gets SIGINT or SIGTERM. One thread runs an epoll loop that accepts connections
+//              and reads requests without blocking, and a pool of worker threads carries out
+//              the complete ones. The image stays loaded the whole time, so clients pay for a
+//              round trip instead of loading the image themselves. Nothing is saved unless a
+//              client asks for it.
+int mfsdServe( char *socket_path )
+{
+   struct sockaddr_un address;
+   memset( &address, 0, sizeof(address) );
+   address.sun_family = AF_UNIX;
+   if ( strlen( socket_path ) >= sizeof(address.sun_path) )
+   {
+      printf("ERROR: Socket path %s is too long.\n", socket_path);
+      return -1;
+   }
+   strcpy( address.sun_path, socket_path );
+
+   int listen_fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+   unlink( socket_path );
+   if ( listen_fd < 0 || bind( listen_fd, (struct sockaddr *) &address, sizeof(address) ) ||
+        listen( listen_fd, MFSD_BACKLOG ) )
+   {
+      perror("ERROR: Setting up the socket returned");
+      if ( listen_fd >= 0 )
+      {
+         close( listen_fd );
+      }
+      return -1;
+   }
+
+   // The listening socket and the wake eventfd are told apart from connections by their
+   // event data
+   mfsd_stopping = 0;
+   mfsd_queue_head = mfsd_queue_tail = NULL;
+   mfsd_epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+   mfsd_wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+   struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+   epoll_ctl( mfsd_epoll_fd, EPOLL_CTL_ADD, listen_fd, &event );
+   event.data.ptr = &mfsd_wake_fd;
+   epoll_ctl( mfsd_epoll_fd, EPOLL_CTL_ADD, mfsd_wake_fd, &event );
+
+   struct sigaction action;
+   memset( &action, 0, sizeof(action) );
+   action.sa_handler = mfsdSignal;
+   sigaction( SIGINT, &action, NULL );
+   sigaction( SIGTERM, &action, NULL );
+   signal( SIGPIPE, SIG_IGN );
+
+   pthread_t workers[MAX_THREADS];
+   int threads = workerThreads();
+   for (int t = 0; t < threads; t++)
+   {
+      pthread_create( &workers[t], NULL, mfsdWorker, NULL );
+   }
+
+   printf("mfsd: serving %s on %s with %d workers\n", image_name, socket_path, threads);
+   fflush( stdout );
+
+   struct epoll_event events[MFSD_MAX_EVENTS];
+   while ( !__atomic_load_n( &mfsd_stopping, __ATOMIC_RELAXED ) )
+   {
+      int ready = epoll_wait( mfsd_epoll_fd, events, MFSD_MAX_EVENTS, -1 );
+      for (int i = 0; i < ready; i++)
+      {
+         if ( events[i].data.ptr == NULL )
+         {
+            int fd;
+            while ( ( fd = accept4( listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) >= 0 )
+            {
+               struct mfsd_conn *conn = calloc( 1, sizeof(struct mfsd_conn) );
+               struct epoll_event conn_event = { .events = EPOLLIN | EPOLLONESHOT,
+                                                 .data.ptr = conn };
+               conn->fd = fd;
+               epoll_ctl( mfsd_epoll_fd, EPOLL_CTL_ADD, fd, &conn_event );
+            }
+            continue;
+         }
+
+         if ( events[i].data.ptr == &mfsd_wake_fd )
+         {
+            continue;
+         }
+
+         struct mfsd_conn *conn = events[i].data.ptr;
+         int complete = mfsdReceive( conn );
+         if ( complete < 0 )
+         {
+            mfsdClose( conn );
+         }
+         else if ( complete == 0 )
+         {
+            mfsdRearm( conn );
+         }
+         else
+         {
+            mfsdQueue( conn );
+         }
+      }
+   }
+
+   // Let the workers finish what is queued, then stop them
+   pthread_mutex_lock( &mfsd_queue_lock );
+   pthread_cond_broadcast( &mfsd_queue_ready );
+   pthread_mutex_unlock( &mfsd_queue_lock );
+   for (int t = 0; t < threads; t++)
+   {
+      pthread_join( workers[t], NULL );
+   }
+
+   close( listen_fd );
+   close( mfsd_wake_fd );
+   close( mfsd_epoll_fd );
+   unlink( socket_path );
+   printf("mfsd: stopped\n");
+   return 0;
+}
+
+// Connects to an mfsd socket, returns the descriptor or -1
+int mfsdConnect( char *socket_path )
+{
+   struct sockaddr_un address;
+   memset( &address, 0, sizeof(address) );
+   address.sun_family = AF_UNIX;
+   strncpy( address.sun_path, socket_path, sizeof(address.sun_path) - 1 );
+
+   int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+   if ( fd >= 0 && connect( fd, (struct sockaddr *) &address, sizeof(address) ) )
+   {
+      close( fd );
+      fd = -1;
+   }
+   return fd;
+}
+
+// Reads exactly len bytes, returns -1 if the connection ends first
+int read_all( int fd, void *buf, size_t len )
+{
+   while ( len > 0 )
+   {
+      ssize_t got = read( fd, buf, len );
+      if ( got < 0 && errno == EINTR )
+      {
+         continue;
+      }
+      if ( got <= 0 )
+      {
+         return -1;
+      }
+      buf = (uint8_t *) buf + got;
+      len -= got;
+   }
+   return 0;
+}
+
+// Name: mfsdCall
+// Parameters: fd - connected socket, request - header, its magic and path_length are filled
+//             in here, path - file the request is about, data - request->data_length bytes,
+//             reply - set to the reply header, reply_data - set to malloc'd reply data or NULL
+// Returns: 0 once a reply has arrived, -1 if the connection failed
+// Description: Sends one request and waits for its reply.
+int mfsdCall( int fd, struct mfsd_request *request, char *path, const void *data,
+              struct mfsd_reply *reply, uint8_t **reply_data )
+{
+   request->magic = MFSD_MAGIC;
+   request->path_length = path ? strlen( path ) : 0;
+   *reply_data = NULL;
+
+   struct iovec iov[3] =
+   {
+      { .iov_base = request, .iov_len = sizeof(struct mfsd_request) },
+      { .iov_base = path, .iov_len = request->path_length },
+      { .iov_base = (void *) data, .iov_len = request->data_length }
+   };
+   if ( writev_all( fd, iov, 3 ) || read_all( fd, reply, sizeof(struct mfsd_reply) ) ||
+        reply->magic != MFSD_MAGIC )
+   {
+      return -1;
+   }
+
+   if ( reply->data_length )
+   {
+      *reply_data = malloc( reply->data_length );
+      if ( read_all( fd, *reply_data, reply->data_length ) )
+      {
+         free( *reply_data );
+         *reply_data = NULL;
+         return -1;
+      }
+   }
+   return 0;
+}
+
+// Reads a whole host file of at most MAX_FILE_SIZE bytes for a client request, or NULL
+uint8_t *mfsdLoadHostFile( char *filename, uint32_t *size )
+{
+   FILE *ifp = fopen( filename, "r" );
+   struct stat st;
+   if ( ifp == NULL || fstat( fileno( ifp ), &st ) != 0 )
+   {
+      printf("ERROR: Could not open %s.\n", filename);
+      if ( ifp != NULL )
+      {
+         fclose( ifp );
+      }
+      return NULL;
+   }
+   if ( S_ISREG( st.st_mode ) && st.st_size > MAX_FILE_SIZE )
+   {
+      printf("ERROR: File size is too large.\n");
+      fclose( ifp );
+      return NULL;
+   }
+
+   // A regular file is read in one go, with a byte to spare to notice it growing. Pipes have no
+   // size, so their buffer starts at one chunk and doubles until EOF.
+   size_t   capacity = S_ISREG( st.st_mode ) ? (size_t) st.st_size + 1 : WRITE_CHUNK_SIZE;
+   size_t   got = 0;
+   uint8_t *buf = NULL;
+
+   while ( 1 )
+   {
+      uint8_t *bigger = realloc( buf, capacity );
+      if ( bigger == NULL )
+      {
+         printf("ERROR: Not enough memory to read %s.\n", filename);
+         free( buf );
+         fclose( ifp );
+         return NULL;
+      }
+      buf = bigger;
+
+      got += fread( buf + got, 1, capacity - got, ifp );
+      if ( got < capacity || got > MAX_FILE_SIZE )
+      {
+         break;
+      }
+      capacity = capacity * 2 < MAX_FILE_SIZE + 1 ? capacity * 2 : MAX_FILE_SIZE + 1;
+   }
+
+   int failed = ferror( ifp );
+   fclose( ifp );
+   if ( failed )
+   {
+      printf("ERROR: An error occured reading from the input file.\n");
+      free( buf );
+      return NULL;
+   }
+   if ( got > MAX_FILE_SIZE )
+   {
+      printf("ERROR: File size is too large.\n");
+      free( buf );
+      return NULL;
+   }
+   *size = got;
+   return buf;
+}
+
+// Name: mfsdClient
+// Parameters: socket_path - socket mfsd listens on, argc, argv - the command and its arguments
+// Returns: exit status, 0 on success
+// Description: Sends one command to mfsd and prints the result. File data read from the image
+//              is written to stdout.
+int mfsdClient( char *socket_path, int argc, char *argv[] )
+{
+   struct mfsd_request request;
+   struct mfsd_reply   reply;
+   uint8_t *data = NULL;
+   uint8_t *reply_data = NULL;
+   char    *path = argc > 1 ? argv[1] : NULL;
+   char    *command = argc > 0 ? argv[0] : "";
+
+   memset( &request, 0, sizeof(request) );
+
+   if ( !strcmp( command, "stat" ) && argc == 2 )
+   {
+      request.op = MFSD_STAT;
+   }
+   else if ( !strcmp( command, "read" ) && ( argc == 2 || argc == 4 ) )
+   {
+      request.op = MFSD_READ;
+      request.offset = argc == 4 ? strtoull( argv[2], NULL, 10 ) : 0;
+      request.length = argc == 4 ? strtoul( argv[3], NULL, 10 ) : MAX_FILE_SIZE;
+   }
+   else if ( !strcmp( command, "put" ) && argc == 3 )
+   {
+      request.op = MFSD_CREATE;
+      path = argv[2];
+      if ( ( data = mfsdLoadHostFile( argv[1], &request.data_length ) ) == NULL )
+      {
+         return 1;
+      }
+   }
+   else if ( !strcmp( command, "write" ) && argc == 4 )
+   {
+      request.op = MFSD_WRITE;
+      request.offset = strtoull( argv[2], NULL, 10 );
+      if ( ( data = mfsdLoadHostFile( argv[3], &request.data_length ) ) == NULL )
+      {
+         return 1;
+      }
+   }
+   else if ( !strcmp( command, "truncate" ) && argc == 3 )
+   {
+      request.op = MFSD_TRUNCATE;
+      request.offset = strtoull( argv[2], NULL, 10 );
+   }
+   else if ( !strcmp( command, "delete" ) && argc == 2 )
+   {
+      request.op = MFSD_DELETE;
+   }
+   else if ( !strcmp( command, "mkdir" ) && argc == 2 )
+   {
+      request.op = MFSD_MKDIR;
+   }
+   else if ( ( !strcmp( command, "df" ) || !strcmp( command, "savefs" ) ||
+               !strcmp( command, "shutdown" ) ) && argc == 1 )
+   {
+      request.op = !strcmp( command, "df" ) ? MFSD_DF :
+                   !strcmp( command, "savefs" ) ? MFSD_SAVEFS : MFSD_SHUTDOWN;
+   }
+   else
+   {
+      printf("ERROR: Usage: mfs -c <socket> stat|read|put|write|truncate|delete|mkdir|df|savefs|"
+             "shutdown [arguments]\n");
+      return 1;
+   }
+
+   if ( path && strlen( path ) >= MFSD_PATH_MAX )
+   {
+      printf("ERROR: Path is too long.\n");
+      free( data );
+      return 1;
+   }
+
+   int fd = mfsdConnect( socket_path );
+   if ( fd < 0 )
+   {
+      perror("ERROR: Connecting to mfsd returned");
+      free( data );
+      return 1;
+   }
+
+   int failed = mfsdCall( fd, &request, path, data, &reply, &reply_data );
+   close( fd );
+   free( data );
+   if ( failed )
+   {
+      printf("ERROR: mfsd closed the connection.\n");
+      return 1;
+   }
+
+   if ( reply.status != MFSD_OK )
+   {
+      printf("ERROR: %s.\n", reply.status < MFSD_STATUS_COUNT ?
+             mfsd_status_text[reply.status] : "Unknown error");
+      free( reply_data );
+      return 1;
+   }
+
+   if ( request.op == MFSD_READ )
+   {
+      struct iovec iov = { .iov_base = reply_data, .iov_len = reply.data_length };
+      writev_all( STDOUT_FILENO, &iov, 1 );
+   }
+   else if ( request.op == MFSD_STAT && reply.data_length == sizeof(struct mfsd_stat) )
+   {
+      struct mfsd_stat *stat_reply = (struct mfsd_stat *) reply_data;
+      time_t t = stat_reply->time;
+      printf("%s: %"PRIu64" bytes, attributes %02"PRIx32"%s, %s", path, stat_reply->size,
+             stat_reply->attribute, stat_reply->attribute & DIRECTORY ? " (directory)" : "",
+             ctime( &t ));
+   }
+   else if ( request.op == MFSD_DF && reply.data_length == sizeof(uint64_t) )
+   {
+      printf("%"PRIu64" bytes free\n", *(uint64_t *) reply_data);
+   }
+
+   free( reply_data );
+   return 0;
+}
+
+//-------------------------------------------------------------------------------------------------
+// Command shell
+// ------------------------------------------------------------------------------------------------
+
+#define COMMAND_REQUIRED_ARGS 3		// Most arguments any command has to be given
+
+// One shell command. The arguments it needs are spelled out by the error printed when each of
+// them is left out, so runCommand checks them before the command runs.
+struct command
+{
+   const char *name;
+   int         needs_image;			// Refused while no disk image is open
+   const char *missing[COMMAND_REQUIRED_ARGS];	// Error for each required argument, or NULL
+   void      (*run)( char *token[] );
+};
+
+// attrib, df and list have always worded the error as savefs and close do, so they leave
+// needs_image clear and check with this. Returns 1 if the image is open.
+int imageIsOpen()
+{
+   if ( !image_open )
+   {
+      printf("ERROR: Disk image is not open.\n");
+      return 0;
+   }
+   return 1;
+}
+
+// Name: tokenize
+// Parameters: line - command line, split up in place,
+//             token - set to the first MAX_NUM_ARGUMENTS words, the slots left over are NULL
+// Returns: number of words found
+// Description: Splits the line on whitespace by writing NULs into it, so no word is copied and
+//              nothing is allocated. The words point into the line and are only good until it
+//              is overwritten. A run of whitespace is one separator, and words that don't fit
+//              in token are ignored.
+int tokenize( char *line, char *token[] )
+{
+   int count = 0;
+
+   while ( count < MAX_NUM_ARGUMENTS )
+   {
+      line += strspn( line, WHITESPACE );
+      if ( *line == 0 )
+      {
+         break;
+      }
+      token[count++] = line;
+      line += strcspn( line, WHITESPACE );
+      if ( *line != 0 )
+      {
+         *line++ = 0;
+      }
+   }
+
+   for (int i = count; i < MAX_NUM_ARGUMENTS; i++)
+   {
+      token[i] = NULL;
+   }
+   return count;
+}
+
+void commandCreatefs( char *token[] )
+{
+   createfs( token[1] );
+}
+
+void commandSavefs( char *token[] )
+{
+   (void) token;
+   savefs( );
+}
+
+void commandStats( char *token[] )
+{
+   if ( token[1] != NULL && !strcmp( token[1], "reset" ) )
+   {
+      metrics_reset();
+      return;
+   }
+   metrics_print( stdout );
+}
+
+void commandTrace( char *token[] )
+{
+   trace_command( token[1], token[2] );
+}
+
+void commandFsyncPolicy( char *token[] )
+{
+   set_fsync_policy( token[1] );
+}
+
+void commandOpen( char *token[] )
+{
+   openfs( token[1] );
+}
+
+void commandClose( char *token[] )
+{
+   (void) token;
+   closefs( );
+}
+
+void commandList( char *token[] )
+{
+   if ( !imageIsOpen() )
+   {
+      return;
+   }
+
+   struct list_options options;
+   int bad_option = 0;
+   memset( &options, 0, sizeof(options) );
+
+   for (int i = 1; i < MAX_NUM_ARGUMENTS && !bad_option; i++)
+   {
+      // Options that take a value use the token after them
+      char *value = i + 1 < MAX_NUM_ARGUMENTS ? token[i + 1] : NULL;
+
+      if ( token[i] == NULL )
+      {
+         continue;
+      }
+      else if ( !strcmp( token[i], "-h" ) )
+      {
+         options.show_hidden = 1;
+      }
+      else if ( !strcmp( token[i], "-a" ) )
+      {
+         options.show_attributes = 1;
+      }
+      else if ( !strcmp( token[i], "-r" ) )
+      {
+         options.reverse = 1;
+      }
+      else if ( !strcmp( token[i], "-s" ) && value != NULL )
+      {
+         if ( !strcmp( value, "name" ) )
+         {
+            options.sort = LIST_BY_NAME;
+         }
+         else if ( !strcmp( value, "size" ) )
+         {
+            options.sort = LIST_BY_SIZE;
+         }
+         else if ( !strcmp( value, "time" ) )
+         {
+            options.sort = LIST_BY_TIME;
+         }
+         else
+         {
+            bad_option = 1;
+         }
+         i++;
+      }
+      else if ( !strcmp( token[i], "-f" ) && value != NULL )
+      {
+         for (char *c = value; *c && !bad_option; c++)
+         {
+            if ( *c == 'h' )
+            {
+               options.require |= HIDDEN;
+            }
+            else if ( *c == 'r' )
+            {
+               options.require |= READONLY;
+            }
+            else
+            {
+               bad_option = 1;
+            }
+         }
+         i++;
+      }
+      else if ( !strcmp( token[i], "-n" ) && value != NULL )
+      {
+         char *end;
+         long page_size = strtol( value, &end, 10 );
+         bad_option = *end != 0 || page_size <= 0;
+         options.page_size = page_size;
+         i++;
+      }
+      else if ( !strcmp( token[i], "-c" ) && value != NULL )
+      {
+         options.cursor = value;
+         i++;
+      }
+      else if ( token[i][0] != '-' && options.pattern == NULL )
+      {
+         options.pattern = token[i];
+      }
+      else
+      {
+         bad_option = 1;
+      }
+   }
+
+   if ( bad_option )
+   {
+      printf("ERROR: Usage: list [-h] [-a] [-s name|size|time] [-r] [-f h|r] [-n count] "
+             "[-c cursor] [pattern]\n");
+      return;
+   }
+
+   listFiles( &options );
+}
+
+void commandAttrib( char *token[] )
+{
+   if ( !imageIsOpen() )
+   {
+      return;
+   }
+   if ( token[1] == NULL )
+   {
+      printf("ERROR: Attribute not specified.\n");
+      return;
+   }
+   if ( token[2] == NULL )
+   {
+      printf("ERROR: Filename not specified.\n");
+      return;
+   }
+   attribute( token[1], token[2] );
+}
+
+void commandDf( char *token[] )
+{
+   (void) token;
+   if ( !imageIsOpen() )
+   {
+      return;
+   }
+   printf("%d bytes free\n", df() );
+   printf("%d bytes reclaimable from deleted files\n", reclaimable() );
+}
+
+void commandQuit( char *token[] )
+{
+   (void) token;
+   fflush( stdout );		// _exit skips stdio, so push out any buffered output first
+   _exit(0);
+}
+
+void commandInsert( char *token[] )
+{
+   // "insert - <name>" streams the file in from stdin
+   if ( !strcmp( token[1], "-" ) )
+   {
+      if ( token[2] == NULL )
+      {
+         printf("ERROR: No name given for the file read from stdin.\n");
+         return;
+      }
+      insert_stream( stdin, token[2] );
+      return;
+   }
+
+   insert( token[1] );
+}
+
+void commandRetrieve( char *token[] )
+{
+   if ( !strcmp( token[1], "-a" ) )
+   {
+      if ( token[2] == NULL )
+      {
+         printf("ERROR: Usage: retrieve -a <directory> [pattern]\n");
+         return;
+      }
+      retrieveAll( token[2], token[3] );
+      return;
+   }
+
+   retrieve( token[1], token[2] != NULL ? token[2] : token[1] );
+}
+
+void commandExport( char *token[] )
+{
+   exportTar( token[1] );
+}
+
+void commandImport( char *token[] )
+{
+   importTar( token[1] );
+}
+
+void commandGrep( char *token[] )
+{
+   grepCommand( token[1], token[2] );
+}
+
+void commandWrite( char *token[] )
+{
+   int64_t offset = strtoll( token[2], NULL, 10 );
+   if ( offset < 0 )
+   {
+      printf("ERROR: Offset must not be negative.\n");
+      return;
+   }
+
+   writeFile( token[1], offset, token[3] );
+}
+
+void commandAppend( char *token[] )
+{
+   writeFile( token[1], -1, token[2] );
+}
+
+void commandTruncate( char *token[] )
+{
+   truncateFile( token[1], strtoll( token[2], NULL, 10 ) );
+}
+
+void commandDefrag( char *token[] )
+{
+   if ( token[1] != NULL && !strcmp( token[1], "report" ) )
+   {
+      defragReport();
+      return;
+   }
+
+   // "defrag <N>" moves at most N blocks so it can be spread over many calls
+   int32_t budget = token[1] != NULL ? atoi( token[1] ) : -1;
+   if ( token[1] != NULL && budget <= 0 )
+   {
+      printf("ERROR: Block budget must be a positive number.\n");
+      return;
+   }
+
+   int complete;
+   int32_t moved = defrag( budget, &complete );
+   printf("Moved %"PRId32" blocks%s\n", moved, complete ? ", defrag complete" : "" );
+}
+
+void commandFsck( char *token[] )
+{
+   fsck( token[1] != NULL && !strcmp( token[1], "-r" ) );
+}
+
+void commandScrub( char *token[] )
+{
+   (void) token;
+   scrub();
+}
+
+// Sets an on/off switch from "<command> [on|off]" and prints where it stands, returns -1 after
+// a usage error
+int commandSwitch( char *token[], uint8_t *setting, const char *name )
+{
+   if ( token[1] != NULL && !strcmp( token[1], "on" ) )
+   {
+      *setting = 1;
+   }
+   else if ( token[1] != NULL && !strcmp( token[1], "off" ) )
+   {
+      *setting = 0;
+   }
+   else if ( token[1] != NULL )
+   {
+      printf("ERROR: Usage: %s [on|off]\n", token[0]);
+      return -1;
+   }
+   printf("%s is %s\n", name, *setting ? "on" : "off");
+   return 0;
+}
+
+void commandVerify( char *token[] )
+{
+   commandSwitch( token, &verify_checksums, "Checksum verification" );
+}
+
+void commandReadahead( char *token[] )
+{
+   commandSwitch( token, &readahead_enabled, "Readahead" );
+}
+
+// "hugepages [on|off]" takes effect from the next image that isn't mapped from its file
+void commandHugepages( char *token[] )
+{
+   const char *pages[] = { "4 KiB pages", "transparent huge pages", "hugetlb pages",
+                           "mapped from its file" };
+
+   if ( commandSwitch( token, &huge_pages, "Huge page backing" ) == 0 && image_open )
+   {
+      printf("The image is %s%s\n", image_pages == IMAGE_PAGES_FILE ? "" : "on ",
+             pages[image_pages]);
+   }
+}
+
+void commandRead( char *token[] )
+{
+   if ( token[2][0] == '-' || token[3][0] == '-' )
+   {
+      printf("ERROR: Start byte and number of bytes must not be negative.\n");
+      return;
+   }
+
+   // "read <file> <start> <count> -r" dumps the bytes raw instead of in hex
+   int raw = token[4] != NULL && !strcmp( token[4], "-r" );
+
+   readDisk( token[1], strtoul( token[2], NULL, 10 ), strtoul( token[3], NULL, 10 ), raw );
+}
+
+void commandEncrypt( char *token[] )
+{
+   printf("%s\n", token[1]);
+   encryption( token[1], atoi( token[2] ) );
+}
+
+void commandDecrypt( char *token[] )
+{
+   printf("%s\n", token[1]);
+   decryption( token[1], atoi( token[2] ) );
+}
+
+void commandDelete( char *token[] )
+{
+   delete( token[1] );
+}
+
+void commandUndel( char *token[] )
+{
+   undel( token[1] );
+}
+
+void commandMkdir( char *token[] )
+{
+   makeDirectory( token[1] );
+}
+
+void commandRmdir( char *token[] )
+{
+   removeDirectory( token[1] );
+}
+
+void commandSnapshot( char *token[] )
+{
+   snapshotCommand( token[1], token[2] );
+}
+
+// Every shell command, kept sorted by name for the binary search in runCommand
+const struct command commands[] =
+{
+   { "append",      1, { "Usage: append <filename> <hostfile>",
+                         "Usage: append <filename> <hostfile>" },            commandAppend },
+   { "attrib",      0, { NULL },                                            commandAttrib },
+   { "close",       0, { NULL },                                            commandClose },
+   { "createfs",    0, { "No disk image name specified." },                 commandCreatefs },
+   { "decrypt",     1, { "No filename specified.", "No cipher specified." }, commandDecrypt },
+   { "defrag",      1, { NULL },                                            commandDefrag },
+   { "delete",      1, { "No filename specified." },                        commandDelete },
+   { "df",          0, { NULL },                                            commandDf },
+   { "encrypt",     1, { "No filename specified.", "No cipher specified." }, commandEncrypt },
+   { "export",      1, { "Usage: export <file.tar|->" },                    commandExport },
+   { "fsck",        1, { NULL },                                            commandFsck },
+   { "fsyncpolicy", 0, { NULL },                                            commandFsyncPolicy },
+   { "grep",        1, { "Usage: grep <pattern> [glob]" },                  commandGrep },
+   { "hugepages",   0, { NULL },                                            commandHugepages },
+   { "import",      1, { "Usage: import <file.tar|->" },                    commandImport },
+   { "insert",      1, { "No filename specified." },                        commandInsert },
+   { "list",        0, { NULL },                                            commandList },
+   { "mkdir",       1, { "No directory specified." },                       commandMkdir },
+   { "open",        0, { "No disk image name specified." },                 commandOpen },
+   { "quit",        0, { NULL },                                            commandQuit },
+   { "read",        1, { "No filename specified.", "No start byte specified.",
+                         "No number of bytes specified." },                 commandRead },
+   { "readahead",   0, { NULL },                                            commandReadahead },
+   { "retrieve",    1, { "No filename specified." },                        commandRetrieve },
+   { "rmdir",       1, { "No directory specified." },                       commandRmdir },
+   { "savefs",      0, { NULL },                                            commandSavefs },
+   { "scrub",       1, { NULL },                                            commandScrub },
+   { "snapshot",    1, { NULL },                                            commandSnapshot },
+   { "stats",       0, { NULL },                                            commandStats },
+   { "trace",       0, { NULL },                                            commandTrace },
+   { "truncate",    1, { "Usage: truncate <filename> <size>",
+                         "Usage: truncate <filename> <size>" },             commandTruncate },
+   { "undel",       1, { "No filename specified." },                        commandUndel },
+   { "verify",      0, { NULL },                                            commandVerify },
+   { "write",       1, { "Usage: write <filename> <offset> <hostfile>",
+                         "Usage: write <filename> <offset> <hostfile>",
+                         "Usage: write <filename> <offset> <hostfile>" },   commandWrite },
+};
+
+#define COMMAND_COUNT ( sizeof(commands) / sizeof(commands[0]) )
+
+// bsearch comparison of a command name against a table entry
+int compareCommand( const void *name, const void *entry )
+{
+   return strcmp( (const char *) name, ( (const struct command *) entry )->name );
+}
+
+// Name: runCommand
+// Parameters: token - the command and its arguments, as split up by tokenize
+// Returns: none
+// Description: Looks the command up in the sorted table with a binary search, checks that an
+//              image is open if it needs one and that its required arguments are there, then
+//              runs it. Blank lines and unknown commands are ignored.
+void runCommand( char *token[] )
+{
+   if ( token[0] == NULL )
+   {
+      return;
+   }
+
+   const struct command *command = bsearch( token[0], commands, COMMAND_COUNT,
+                                            sizeof(struct command), compareCommand );
+   if ( command == NULL )
+   {
+      return;
+   }
+
+   if ( command->needs_image && !image_open )
+   {
+      printf("ERROR: Disk image not open.\n");
+      return;
+   }
+
+   for (int i = 0; i < COMMAND_REQUIRED_ARGS && command->missing[i] != NULL; i++)
+   {
+      if ( token[i + 1] == NULL )
+      {
+         printf("ERROR: %s\n", command->missing[i]);
+         return;
+      }
+   }
+
+   command->run( token );
+}
+
+//-------------------------------------------------------------------------------------------------
+// Main
+// ------------------------------------------------------------------------------------------------
+
+// bench.c builds the file system functions into its own program, so it leaves our main out
+#ifndef MFS_NO_MAIN
+
+int main( int argc, char *argv[] )
+{
+
+   char * command_string = ( char* ) malloc( MAX_COMMAND_SIZE );
+   char * token[MAX_NUM_ARGUMENTS];
+
+   fp = NULL;
+
+   init();
+
+   // "mfs -d <socket> <image>" (or "mfsd <socket> <image>") keeps the image loaded and serves
+   // it to clients, "mfs -c <socket> <command> ..." is one of those clients
+   int daemon = argc == 4 && !strcmp( argv[1], "-d" );
+   if ( daemon || ( argc == 3 && !strcmp( basename( argv[0] ), "mfsd" ) ) )
+   {
+      openfs( argv[argc - 1] );
+      if ( !image_open )
+      {
+         return 1;
+      }
+      return mfsdServe( argv[argc - 2] ) ? 1 : 0;
+   }
+   if ( argc >= 3 && !strcmp( argv[1], "-c" ) )
+   {
+      return mfsdClient( argv[2], argc - 3, argv + 3 );
+   }
+
+   while( 1 )
+   {
+      // Print out the msh prompt
+      printf ("mfs> ");
+
+       // Read the command from the commandline.  The
+       // maximum command that will be read is MAX_COMMAND_SIZE
+      // This while command will wait here until the user
+      // inputs something since fgets returns NULL when there
+      // is no input
+
+      fflush( stdin );
+      if ( !fgets (command_string, MAX_COMMAND_SIZE, stdin) )
+      {
+         // No more commands are coming once the input is closed
+         if ( feof( stdin ) )
+         {
+            break;
+         }
+         clearerr( stdin );
+         continue;
+      }
+
+      // The tokens point into command_string, so parsing and running a command allocates
+      // nothing
+      tokenize( command_string, token );
+      runCommand( token );
+   }
+
+  free( command_string );
+
+  return 0;
+  // e2520ca2-76f3-90d6-0242ac120003
+}
+
+#endif // MFS_NO_MAIN